@@ -56,6 +56,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define INIT_MEM 0x200000 // 2MB
 // Default page size
 #define PAGE_SIZE 0x1000
+// Block buffer cache size
+#define BCACHE_SIZE 0x1000000 // 16MB
+// DMA pool sizes (per address zone)
+#define DMA_POOL_16M 0x40000 // 256KB below 16MB (ISA reach)
+#define DMA_POOL_4G 0x400000 // 4MB below 4GB (32-bit bus masters)
+#define DMA_POOL_ANY 0x400000 // 4MB anywhere
+// Striped set assembled at boot - member device names, none by default.
+// The set overwrites whatever the members hold, never list the boot disk.
+//#define RAID0_MEMBERS {"sata1", "sata2"}
+// Chunk size of the striped set
+#define RAID0_CHUNK_SIZE 0x10000 // 64KB
 
 //
 // Hard-coded memory locations
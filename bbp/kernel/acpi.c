@@ -94,12 +94,13 @@ static void acpi_map(){
 	if (_rsdp != null){
 		SDTHeader_t *th;
 		uint64 i;
-		uint64 j;
 		uint64 count;
 		uint64 ptr;
 		if (_rsdp->revision == 0){
 			// ACPI version 1.0
 			RSDT_t *rsdt = (RSDT_t *)((uint64)_rsdp->RSDT_address);
+			// Map the whole table pointer array
+			page_map_range((uint64)rsdt, rsdt->h.length, PAGE_ATTR_WRITE | PAGE_ATTR_UC);
 			// Get count of other table pointers
 			count = (rsdt->h.length - sizeof(SDTHeader_t)) / 4;
 			for (i = 0; i < count; i ++){
@@ -107,20 +108,17 @@ static void acpi_map(){
 				ptr = (uint64)&rsdt->ptr;
 				// Move on to entry i (32bits = 4 bytes) in table pointer array
 				ptr += (i * 4);
-				// Map the page
-				page_map_mmio(ptr);
 				// Get the pointer of table in table pointer array
 				th = (SDTHeader_t *)((uint64)(*((uint32 *)ptr)));
-				// If the length is greater than a page, map additional pages 
-				if (th->length > PAGE_SIZE){
-					for (j = (ptr & PAGE_MASK) + PAGE_SIZE; j < ((ptr + th->length) & PAGE_MASK); j += PAGE_SIZE){
-						page_map_mmio(j);
-					}
-				}
+				// Map the header to learn the length, then the whole table
+				page_map_range((uint64)th, sizeof(SDTHeader_t), PAGE_ATTR_WRITE | PAGE_ATTR_UC);
+				page_map_range((uint64)th, th->length, PAGE_ATTR_WRITE | PAGE_ATTR_UC);
 			}
 		} else {
 			// ACPI version 2.0+
 			XSDT_t *xsdt = (XSDT_t *)_rsdp->XSDT_address;
+			// Map the whole table pointer array
+			page_map_range((uint64)xsdt, xsdt->h.length, PAGE_ATTR_WRITE | PAGE_ATTR_UC);
 			// Get count of other table pointers
 			count = (xsdt->h.length - sizeof(SDTHeader_t)) / 8;
 			for (i = 0; i < count; i ++){
@@ -128,16 +126,11 @@ static void acpi_map(){
 				ptr = (uint64)&xsdt->ptr;
 				// Move on to entry i (64bits = 8 bytes) in table pointer array
 				ptr += (i * 8);
-				// Map the page
-				page_map_mmio(ptr);
 				// Get the pointer of table in table pointer array
 				th = (SDTHeader_t *)(*((uint64 *)ptr));
-				// If the length is greater than a page, map additional pages 
-				if (th->length > PAGE_SIZE){
-					for (j = (ptr & PAGE_MASK) + PAGE_SIZE; j < ((ptr + th->length) & PAGE_MASK); j += PAGE_SIZE){
-						page_map_mmio(j);
-					}
-				}
+				// Map the header to learn the length, then the whole table
+				page_map_range((uint64)th, sizeof(SDTHeader_t), PAGE_ATTR_WRITE | PAGE_ATTR_UC);
+				page_map_range((uint64)th, th->length, PAGE_ATTR_WRITE | PAGE_ATTR_UC);
 			}
 		}
 	}
@@ -38,6 +38,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "lib.h"
 #include "pci.h"
 #include "paging.h"
+#include "interrupts.h"
+#include "timer.h"
+#include "block.h"
+#include "dma.h"
 #include "ahci.h"
 #if DEBUG == 1
 	#include "debug_print.h"
@@ -49,6 +53,102 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define AHCI_DEV_SEMB	0xC33C0101	// Enclosure management bridge
 #define AHCI_DEV_PM		0x96690101	// Port multiplier
 
+// FIS types
+#define FIS_TYPE_REG_H2D	0x27	// Register FIS - host to device
+#define FIS_TYPE_REG_D2H	0x34	// Register FIS - device to host
+#define FIS_TYPE_DMA_ACT	0x39	// DMA activate FIS - device to host
+#define FIS_TYPE_DMA_SETUP	0x41	// DMA setup FIS - bidirectional
+#define FIS_TYPE_DATA		0x46	// Data FIS - bidirectional
+#define FIS_TYPE_BIST		0x58	// BIST activate FIS - bidirectional
+#define FIS_TYPE_PIO_SETUP	0x5F	// PIO setup FIS - device to host
+#define FIS_TYPE_DEV_BITS	0xA1	// Set device bits FIS - device to host
+
+// ATA commands
+#define ATA_CMD_READ_DMA		0xC8	// 28-bit LBA
+#define ATA_CMD_WRITE_DMA		0xCA	// 28-bit LBA
+#define ATA_CMD_READ_DMA_EX		0x25
+#define ATA_CMD_WRITE_DMA_EX	0x35
+#define ATA_CMD_WRITE_DMA_FUA_EX	0x3D	// Forced Unit Access, 48-bit LBA
+#define ATA_CMD_READ_FPDMA		0x60	// READ FPDMA QUEUED
+#define ATA_CMD_WRITE_FPDMA		0x61	// WRITE FPDMA QUEUED
+#define ATA_CMD_DSM				0x06	// DATA SET MANAGEMENT
+#define ATA_CMD_FLUSH_CACHE_EX	0xEA
+#define ATA_CMD_IDENTIFY		0xEC
+
+// IDENTIFY DEVICE words
+#define ATA_ID_LBA_SECTORS		60		// 2 words - user addressable sectors (28-bit)
+#define ATA_ID_ADD_SUPPORTED	69		// bit 3 - extended sector count, bit 5 - zeroes after TRIM, bit 14 - deterministic read after TRIM
+#define ATA_ID_QUEUE_DEPTH		75		// bits 4:0 - maximum queue depth - 1
+#define ATA_ID_SATA_CAP			76		// bit 8 - NCQ supported
+#define ATA_ID_CMD_SET_1		82		// bit 5 - volatile write cache supported
+#define ATA_ID_CMD_SET_2		83		// bit 10 - 48-bit addressing supported
+#define ATA_ID_CMD_SET_3		84		// bit 6 - WRITE DMA FUA EXT supported (valid when bits 15:14 read 01)
+#define ATA_ID_CMD_ENABLED_1	85		// bit 5 - volatile write cache enabled
+#define ATA_ID_LBA48_SECTORS	100		// 4 words - user addressable sectors (48-bit)
+#define ATA_ID_DSM_BLOCKS		105		// maximum 512 byte blocks of DSM ranges per command
+#define ATA_ID_SECTOR_SIZE		106		// bits 3:0 - log2 logical per physical, bit 12 - long logical sectors, bit 13 - multiple logical per physical
+#define ATA_ID_LOGICAL_SIZE		117		// 2 words - logical sector size in words
+#define ATA_ID_DSM				169		// bit 0 - TRIM supported
+#define ATA_ID_ALIGNMENT		209		// bits 13:0 - offset of LBA 0 in the first physical sector
+#define ATA_ID_EXT_SECTORS		230		// 4 words - extended user addressable sectors
+
+// Port interrupt status/enable bits (for raw register access)
+#define AHCI_PxIS_DHRS	(1 << 0)	// Device to Host Register FIS
+#define AHCI_PxIS_PSS	(1 << 1)	// PIO Setup FIS
+#define AHCI_PxIS_DSS	(1 << 2)	// DMA Setup FIS
+#define AHCI_PxIS_SDBS	(1 << 3)	// Set Device Bits FIS
+#define AHCI_PxIS_DPS	(1 << 5)	// Descriptor Processed
+#define AHCI_PxIS_OFS	(1 << 24)	// Overflow
+#define AHCI_PxIS_IFS	(1 << 27)	// Interface Fatal Error
+#define AHCI_PxIS_HBDS	(1 << 28)	// Host Bus Data Error
+#define AHCI_PxIS_HBFS	(1 << 29)	// Host Bus Fatal Error
+#define AHCI_PxIS_TFES	(1 << 30)	// Task File Error
+// Errors that abort outstanding commands
+#define AHCI_PxIS_ERROR	(AHCI_PxIS_OFS | AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+// Interrupts we want to see
+#define AHCI_PxIE_DEFAULT (AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | AHCI_PxIS_SDBS | AHCI_PxIS_DPS | AHCI_PxIS_ERROR)
+// Interrupts left to a coalescing port (completions raise the CCC interrupt instead)
+#define AHCI_PxIE_CCC	(AHCI_PxIS_ERROR)
+
+// Command completion coalescing limits
+#define AHCI_CCC_MAX_COUNT	0xFF		// 8-bit completion threshold
+#define AHCI_CCC_MAX_MS		0xFFFF		// 16-bit timeout in 1ms units
+
+// ATA device register bits
+#define ATA_DEV_LBA		0x40	// LBA addressing
+#define ATA_DEV_FUA		0x80	// Forced Unit Access (FPDMA commands)
+
+// Driver limits
+#define AHCI_SECTOR_SIZE	512			// Default logical sector size
+#define AHCI_PRDT_COUNT		64			// PRDT entries per command table
+#define AHCI_PRDT_MAX_BYTES	0x400000	// 4MiB per PRDT entry
+#define AHCI_MAX_SECTORS	0x10000		// 16-bit sector count (0 means 65536)
+#define AHCI_MAX_SECTORS_28	0x100		// 8-bit sector count of 28-bit commands
+#define AHCI_SPIN_TIMEOUT	10000000	// Busy-wait iterations before giving up
+#define AHCI_TIMEOUT_US		5000000		// Command timeout
+#define AHCI_POLL_MAX_US	100			// Longest busy-poll window in hybrid mode
+#define AHCI_POLL_MAX_BYTES	0x10000		// Larger transfers never busy-poll in hybrid mode
+#define AHCI_BOUNCE_MAX		0x100000	// Largest bounced command (32-bit HBAs only)
+
+// Link bring-up timing
+#define AHCI_STOP_TIMEOUT_US	500000		// Command engine stop (spec limit)
+#define AHCI_COMRESET_US		1000		// COMRESET assertion (at least 1ms)
+#define AHCI_DETECT_US			20000		// No presence by now - nothing attached
+#define AHCI_LINK_TIMEOUT_US	1000000		// PHY communication established
+#define AHCI_READY_TIMEOUT_US	10000000	// BSY clear (drive spin-up)
+#define AHCI_SPINUP_STAGGER_US	200000		// Delay between drive spin-ups
+
+// TRIM batching
+#define ATA_DSM_TRIM			0x01		// DSM feature bit
+#define ATA_DSM_RANGE_MAX		0xFFFF		// Sectors per range entry
+#define AHCI_TRIM_RANGES		64			// Range entries per 512 byte payload
+#define AHCI_TRIM_MAX_AGE_US	1000000		// Queued ranges are sent after this long
+
+// Task file status bits
+#define ATA_SR_BSY		0x80
+#define ATA_SR_DRQ		0x08
+#define ATA_SR_ERR		0x01
+
 // AHCI Specification 1.3 data structures
 
 /**
@@ -201,11 +301,11 @@ typedef volatile struct {
 typedef volatile struct {
 	// Host capability
 	struct {
-		uint32 np			:4;	// Number of Ports
+		uint32 np			:5;	// Number of Ports (zero based)
 		uint32 sxs			:1;	// External SATA (eSATA) supported
 		uint32 ems			:1;	// Enclosure Management supported
 		uint32 cccs			:1; // Command Completion Coalescing supported
-		uint32 ncs			:5;	// Number of Command Slots
+		uint32 ncs			:5;	// Number of Command Slots (zero based)
 		uint32 psc			:1;	// Partial State Capable
 		uint32 ssc			:1;	// Slumber State Capable
 		uint32 pmd			:1;	// PIO Multiple DRQ Block
@@ -379,7 +479,7 @@ typedef volatile struct {
 	uint32 dma_buff_offset;		//uint8 offset into buffer. First 2 bits must be 0
 	uint32 trans_count;			//Number of uint8s to transfer. Bit 0 must be 0
 	uint32 reserved4;
-} ahci_fis_dma_t; // 28 bytes
+} __PACKED ahci_fis_dma_t; // 28 bytes
 
 typedef volatile struct {
 	ahci_fis_dma_t dsfis;		// DMA Setup FIS
@@ -388,11 +488,22 @@ typedef volatile struct {
 	uint32 pad2[3];
 	ahci_fis_reg_d2h_t rfis;	// Register  Device to Host FIS
 	uint32 pad3;
-	uint8 sdbfis;		// Set Device Bit FIS
+	uint8 sdbfis[8];			// Set Device Bit FIS
  	uint8 ufis[64];
- 	uint32 reserved[96];
+ 	uint8 reserved[96];
 } ahci_fis_t; // 256 bytes
 
+typedef volatile struct {
+	uint8 fis_type;				// FIS_TYPE_DEV_BITS
+	uint8 pmport			:4;	// Port multiplier
+	uint8 reserved1			:2;
+	uint8 interrupt			:1;	// Interrupt bit
+	uint8 notification		:1;	// Notification bit
+	uint8 status;				// Status register (low and high nibbles)
+	uint8 error;				// Error register
+	uint32 active;				// NCQ tags completed (SActive bits)
+} ahci_fis_dev_bits_t; // 8 bytes
+
 typedef volatile struct {
 	// DW0 - Description Information
 	struct {
@@ -415,14 +526,138 @@ typedef volatile struct {
 	uint32	reserved[4];
 } ahci_hba_cmd_header_t;
 
+/**
+* Physical Region Descriptor Table entry
+*/
+typedef volatile struct {
+	uint64 dba;					// Data base address, word aligned
+	uint32 reserved1;
+	uint32 dbc				:22;// Byte count (zero based), 4M max
+	uint32 reserved2		:9;
+	uint32 i				:1;	// Interrupt on completion
+} ahci_hba_prdt_entry_t; // 16 bytes
+
+/**
+* Command table (one per command slot), 128-byte aligned
+*/
+typedef volatile struct {
+	uint8 cfis[64];				// Command FIS
+	uint8 acmd[16];				// ATAPI command
+	uint8 reserved[48];
+	ahci_hba_prdt_entry_t prdt[AHCI_PRDT_COUNT]; // Scatter-gather list
+} ahci_hba_cmd_tbl_t;
+
+/**
+* Submission/completion rings of a device
+* Indices run freely and are masked on access. Every queued submission
+* owns a completion entry, so the completion ring can not overflow.
+*/
+typedef struct {
+	ahci_sqe_t sq[AHCI_RING_SIZE];	// Submission queue
+	ahci_cqe_t cq[AHCI_RING_SIZE];	// Completion queue
+	uint64 sq_head;					// Next submission to send to the drive
+	uint64 sq_tail;					// Next free submission entry
+	uint64 cq_head;					// Next completion to reap
+	uint64 cq_tail;					// Next free completion entry
+	uint32 busy;					// Slots issued from the ring
+	uint32 failed;					// Issued slots lost to an error
+	uint32 fua;						// Issued slots that need a cache flush before they complete
+	uint32 barrier;					// Barrier slot in flight (nothing else is issued meanwhile)
+	uint64 cookie[32];				// Cookie of each issued slot
+} ahci_ring_t;
+
+/**
+* Bounce buffer of a command
+* Used when an HBA without 64-bit addressing has to reach memory above
+* 4GiB. The caller's buffer list is kept in front of the data, so that
+* read data can be copied back on completion.
+*/
+typedef struct {
+	uint64 size;					// Allocation size
+	uint64 sg_count;				// Caller's scatter-gather entries
+	bool write;						// Data went from host to device
+	ahci_sg_t sg[];					// Caller's buffers (data follows)
+} ahci_bounce_t;
+
+/**
+* Device (port) state
+*/
 typedef volatile struct {
 	ahci_hba_t *hba;
 	uint8 port;
+	uint8 slot_count;				// Number of command slots the HBA implements
+	uint32 type;					// Device signature
+	uint8 queue_depth;				// Usable slots (NCQ tags or command slots)
+	bool ncq;						// Native Command Queuing in use
+	uint8 irq;						// Controller IRQ line (0xFF if none)
+	uint8 mode;						// Completion mode (AHCI_MODE_*)
+	bool dma64;						// HBA can reach memory above 4GiB
+	bool ccc;						// Completion interrupts are coalesced
+	bool error;						// Error reported, outstanding commands are lost
+	uint64 lat_avg;					// Average small transfer latency (TSC ticks)
+	uint32 busy;					// Slots issued by the driver and not yet reaped
+	// Capabilities from IDENTIFY DEVICE
+	uint64 sectors;					// Capacity in logical sectors
+	uint32 sector_size;				// Logical sector size in bytes
+	uint32 phys_sector_size;		// Physical sector size in bytes
+	uint16 align_offset;			// Logical sector offset of LBA 0 in the first physical sector
+	uint32 max_sectors;				// Largest transfer per command in logical sectors
+	bool lba48;						// 48-bit addressing (EXT and FPDMA commands)
+	bool wcache;					// Volatile write cache enabled
+	bool fua;						// Forced Unit Access writes supported
+	bool trim;						// DATA SET MANAGEMENT TRIM supported
+	bool trim_zero;					// Trimmed sectors read back as zeroes
+	uint16 trim_blocks;				// 512 byte DSM range blocks per command
+	ahci_hba_cmd_header_t *cmd_list;// Command list (one header per slot)
+	ahci_fis_t *fis;				// Received FIS area
+	ahci_hba_cmd_tbl_t *cmd_tbl;	// Command tables (one per slot)
+	uint16 *ident;					// IDENTIFY DEVICE data (256 words)
+	ahci_ring_t *ring;				// Asynchronous request rings
+	uint64 *trim_buf;				// DSM payload being filled (one entry per range)
+	uint8 trim_count;				// Ranges in the payload
+	uint64 trim_stamp;				// When the first range was queued (TSC ticks)
+	uint64 bounce[32];				// Bounce buffer of each slot (0 if none)
+	bool bounce_short;				// Last command found the bounce pool exhausted
+	// Queue depth statistics
+	uint64 cmd_count;				// Commands issued
+	uint64 depth_sum;				// Sum of queue depths sampled at issue time
+	uint64 sdb_count;				// Set Device Bits FIS received
+	uint64 sdb_tags;				// NCQ tags completed by those FIS
+	uint8 depth_max;				// Deepest queue seen
+	// Completion statistics
+	uint64 irq_count;				// Interrupts serviced
+	uint64 poll_count;				// Waits completed while busy-polling
+	uint64 sleep_count;				// Waits that fell back to the interrupt
+	// Coalescing statistics
+	uint64 ccc_cmds;				// Commands issued while coalescing
+	uint64 ccc_irqs;				// Coalesced interrupts serviced
+	uint64 wait_irq;				// Average sleeping wait without coalescing (TSC ticks)
+	uint64 wait_ccc;				// Average sleeping wait with coalescing (TSC ticks)
+	// Discard statistics
+	uint64 trim_ranges;				// Ranges discarded
+	uint64 trim_merged;				// Ranges merged into queued ones
+	uint64 trim_cmds;				// DSM commands issued
+	uint64 bounce_count;			// Commands bounced below 4GiB
+	uint64 bounce_waits;			// Commands held back until a bounce buffer was free
+	// Durability statistics
+	uint64 fua_cmds;				// FUA writes issued
+	uint64 fua_flushes;				// Cache flushes standing in for FUA
+	uint64 barriers;				// Barrier requests issued
 } ahci_dev_t;
 
 static ahci_dev_t _ahci_dev[256];
 static uint64 _ahci_dev_count = 0;
 
+/**
+* Run a non-queued command and wait for it (FUA fallback needs it early)
+*/
+static bool ahci_exec(ahci_dev_t *dev, uint8 command, uint16 feature, uint16 count, ahci_sg_t *sg, uint64 sg_count, bool write);
+/**
+* Post completions for ring slots the HBA has finished with (synchronous
+* transfers have to free ring slots before they can take them)
+*/
+static void ahci_ring_complete(ahci_dev_t *dev);
+
 // Check device type
 static uint32 ahci_get_type(ahci_port_t *port){
 	if (port->ssts.det != 3){
@@ -440,17 +675,1227 @@ static uint32 ahci_get_type(ahci_port_t *port){
 			return AHCI_DEV_SATA;
 	}
 }
-static void ahci_init_port(ahci_hba_t *hba){
+// Count set bits
+static uint8 ahci_bit_count(uint32 mask){
+	uint8 n = 0;
+	while (mask != 0){
+		mask &= mask - 1;
+		n ++;
+	}
+	return n;
+}
+// Get port registers of a device
+static ahci_port_t *ahci_dev_port(ahci_dev_t *dev){
+	return &dev->hba->ports[dev->port];
+}
+// Stop command list processing and FIS receive
+static bool ahci_port_stop(ahci_port_t *port){
+	uint64 spin = 0;
+	port->cmd.st = 0;
+	while (port->cmd.cr){
+		if (++spin > AHCI_SPIN_TIMEOUT){
+			return false;
+		}
+	}
+	port->cmd.fre = 0;
+	while (port->cmd.fr){
+		if (++spin > AHCI_SPIN_TIMEOUT){
+			return false;
+		}
+	}
+	return true;
+}
+// Start FIS receive and command list processing
+static void ahci_port_start(ahci_port_t *port){
+	while (port->cmd.cr){}
+	port->cmd.fre = 1;
+	port->cmd.st = 1;
+}
+// Acknowledge port interrupt status bits (write 1 to clear)
+static void ahci_port_ack(ahci_port_t *port, uint32 bits){
+	*((volatile uint32 *)&port->is) = bits;
+}
+// Clear interrupt and error status (both are write 1 to clear)
+static void ahci_port_clear(ahci_port_t *port){
+	*((volatile uint32 *)&port->serr) = 0xFFFFFFFF;
+	*((volatile uint32 *)&port->is) = 0xFFFFFFFF;
+}
+/**
+* Allocate command list, FIS area and command tables for the port
+* and point the HBA at them
+*/
+static bool ahci_port_rebase(ahci_dev_t *dev){
+	ahci_port_t *port = ahci_dev_port(dev);
+	uint8 zone = (dev->dma64 ? DMA_ZONE_ANY : DMA_ZONE_4G);
+	uint64 ident;
+	uint8 i;
+	if (!ahci_port_stop(port)){
+		return false;
+	}
+	// Everything the HBA reads or writes comes from the DMA pool - command
+	// list (1K aligned), FIS (256 byte aligned), command tables (128 byte
+	// aligned), IDENTIFY data and the DSM payload. Command list and FIS
+	// area are usually there already from ahci_link_up().
+	if (dev->cmd_list == null){
+		dev->cmd_list = (ahci_hba_cmd_header_t *)dma_alloc(sizeof(ahci_hba_cmd_header_t) * 32, 1024, zone);
+	}
+	if (dev->fis == null){
+		dev->fis = (ahci_fis_t *)dma_alloc(sizeof(ahci_fis_t), 256, zone);
+	}
+	dev->cmd_tbl = (ahci_hba_cmd_tbl_t *)dma_alloc(sizeof(ahci_hba_cmd_tbl_t) * dev->slot_count, 128, zone);
+	ident = dma_alloc(512 + 512, 2, zone);
+	if (dev->cmd_list == null || dev->fis == null || dev->cmd_tbl == null || ident == 0){
+		dev->cmd_list = null;
+		return false;
+	}
+	dev->ident = (uint16 *)ident;
+	dev->trim_buf = (uint64 *)(ident + 512);
+	dev->trim_count = 0;
+	// Request rings are only touched by the CPU
+	dev->ring = (ahci_ring_t *)page_reserve(sizeof(ahci_ring_t));
+	mem_fill((uint8 *)dev->bounce, sizeof(dev->bounce), 0);
+	for (i = 0; i < dev->slot_count; i ++){
+		dev->cmd_list[i].ctba = (uint64)&dev->cmd_tbl[i];
+	}
+	port->clb = (uint64)dev->cmd_list;
+	port->fb = (uint64)dev->fis;
+	ahci_port_clear(port);
+	ahci_port_start(port);
+	dev->busy = 0;
+	return true;
+}
+/**
+* Release bounce buffers of finished slots
+* @param dev - device
+* @param mask - slot mask
+* @param ok - true if the commands succeeded (read data is copied back)
+*/
+static void ahci_bounce_done(ahci_dev_t *dev, uint32 mask, bool ok){
+	ahci_bounce_t *bounce;
+	uint8 *data;
+	uint64 i;
+	uint8 slot;
+	for (slot = 0; slot < 32; slot ++){
+		if ((mask & (1 << slot)) == 0 || dev->bounce[slot] == 0){
+			continue;
+		}
+		bounce = (ahci_bounce_t *)dev->bounce[slot];
+		if (ok && !bounce->write){
+			data = (uint8 *)&bounce->sg[bounce->sg_count];
+			for (i = 0; i < bounce->sg_count; i ++){
+				mem_copy((uint8 *)bounce->sg[i].addr, bounce->sg[i].len, data);
+				data += bounce->sg[i].len;
+			}
+		}
+		dma_free((uint64)bounce, bounce->size);
+		dev->bounce[slot] = 0;
+	}
+}
+/**
+* Recover from a task file error - all outstanding commands are lost
+*/
+static void ahci_port_recover(ahci_dev_t *dev){
+	ahci_port_t *port = ahci_dev_port(dev);
+#if DEBUG == 1
+	debug_print(DC_WRD, "AHCI port %d error: status 0x%x, error 0x%x", (uint64)dev->port, (uint64)port->tfd.status, (uint64)port->tfd.error);
+#endif
+	ahci_port_stop(port);
+	ahci_port_clear(port);
+	ahci_port_start(port);
+	ahci_bounce_done(dev, dev->busy, false);
+	if (dev->ring != null){
+		dev->ring->failed |= dev->ring->busy;
+	}
+	dev->busy = 0;
+	dev->error = false;
+}
+/**
+* Read and acknowledge port interrupt status
+* Called from the interrupt handler and from the polling loop
+*/
+static void ahci_port_status(ahci_dev_t *dev){
+	ahci_port_t *port = ahci_dev_port(dev);
+	uint32 status = *((volatile uint32 *)&port->is);
+	if (status == 0){
+		return;
+	}
+	ahci_port_ack(port, status);
+	if ((status & AHCI_PxIS_SDBS) != 0){
+		// Tags reported by the Set Device Bits FIS are the ones the HBA
+		// is about to clear from SActive
+		dev->sdb_count ++;
+		dev->sdb_tags += ahci_bit_count(((ahci_fis_dev_bits_t *)dev->fis->sdbfis)->active);
+	}
+	if ((status & AHCI_PxIS_ERROR) != 0){
+		dev->error = true;
+	}
+}
+/**
+* AHCI interrupt handler (shared by all controllers on the line)
+* @param irq - IRQ number
+*/
+static void ahci_irq(uint8 irq){
+	uint64 i;
+	uint64 j;
+	uint32 ccc;
+	ahci_dev_t *dev;
+	for (i = 0; i < _ahci_dev_count; i ++){
+		dev = &_ahci_dev[i];
+		if (dev->irq == irq && dev->cmd_list != null && (dev->hba->is & (1 << dev->port)) != 0){
+			ahci_port_status(dev);
+			dev->irq_count ++;
+			// Port status first, then the HBA status bit of the port
+			dev->hba->is = (1 << dev->port);
+		}
+		if (dev->irq == irq && dev->ccc){
+			// Coalesced completions of all ports share a single HBA status
+			// bit - acknowledge it first, so that new completions fire again
+			ccc = (1 << dev->hba->ccc_ctl.interrupt);
+			if ((dev->hba->is & ccc) != 0){
+				dev->hba->is = ccc;
+				for (j = 0; j < _ahci_dev_count; j ++){
+					if (_ahci_dev[j].hba == dev->hba && _ahci_dev[j].ccc){
+						ahci_port_status(&_ahci_dev[j]);
+						_ahci_dev[j].ccc_irqs ++;
+					}
+				}
+			}
+		}
+	}
+}
+/**
+* Find a command slot that is neither issued nor active
+* @return slot number or -1 if all slots are in flight
+*/
+static int64 ahci_slot_alloc(ahci_dev_t *dev){
+	ahci_port_t *port = ahci_dev_port(dev);
+	uint32 used = dev->busy | port->ci | port->sact;
+	// Ring slots stay taken until their completion has been posted
+	if (dev->ring != null){
+		used |= dev->ring->busy;
+	}
+	uint8 i;
+	for (i = 0; i < dev->queue_depth; i ++){
+		if ((used & (1 << i)) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+/**
+* Translate a buffer address for DMA, mapping the page in if needed
+* @param vaddr - virtual address
+* @return physical address or 0 if the page can't be mapped
+*/
+static uint64 ahci_resolve(uint64 vaddr){
+	uint64 paddr = page_resolve(vaddr);
+	if (paddr == 0 && (vaddr & PAGE_MASK) != 0){
+		// Touch the page so the page fault handler maps it in
+		*((volatile uint8 *)vaddr);
+		paddr = page_resolve(vaddr);
+	}
+	return paddr;
+}
+/**
+* Find the physically contiguous run at the start of a buffer
+* Virtually contiguous buffers may be scattered in physical memory, so
+* the buffer is walked page by page until the physical address jumps.
+* @param addr - buffer address
+* @param len - buffer length
+* @param [out] paddr - physical address of the run
+* @return run length in bytes (at most AHCI_PRDT_MAX_BYTES, 0 on failure)
+*/
+static uint64 ahci_phys_run(uint64 addr, uint64 len, uint64 *paddr){
+	uint64 run = PAGE_SIZE - (addr & PAGE_IMASK);
+	*paddr = ahci_resolve(addr);
+	if (*paddr == 0 && (addr & PAGE_MASK) != 0){
+		return 0;
+	}
+	while (run < len && run < AHCI_PRDT_MAX_BYTES && ahci_resolve(addr + run) == *paddr + run){
+		run += PAGE_SIZE;
+	}
+	if (run > len){
+		run = len;
+	}
+	if (run > AHCI_PRDT_MAX_BYTES){
+		run = AHCI_PRDT_MAX_BYTES;
+	}
+	return run;
+}
+/**
+* Measure how much of a buffer fits into one command's PRDT
+* @param addr - buffer address
+* @param len - buffer length
+* @return number of bytes that fit
+*/
+static uint64 ahci_prdt_fit(uint64 addr, uint64 len){
+	uint64 paddr;
+	uint64 chunk;
+	uint64 fit = 0;
+	uint16 n;
+	for (n = 0; n < AHCI_PRDT_COUNT && fit < len; n ++){
+		chunk = ahci_phys_run(addr + fit, len - fit, &paddr);
+		if (chunk == 0){
+			break;
+		}
+		fit += chunk;
+	}
+	return fit;
+}
+/**
+* Check if any part of the buffers lies above 4GiB
+* @param sg - data buffers
+* @param sg_count - number of scatter-gather entries
+* @return true if a 32-bit HBA can't reach the buffers
+*/
+static bool ahci_sg_high(ahci_sg_t *sg, uint64 sg_count){
+	uint64 addr;
+	uint64 paddr;
+	uint64 len;
+	uint64 chunk;
+	uint64 i;
+	for (i = 0; i < sg_count; i ++){
+		addr = sg[i].addr;
+		len = sg[i].len;
+		while (len > 0){
+			chunk = ahci_phys_run(addr, len, &paddr);
+			if (chunk == 0){
+				break;
+			}
+			if (dma_zone(paddr + chunk - 1) == DMA_ZONE_ANY){
+				return true;
+			}
+			addr += chunk;
+			len -= chunk;
+		}
+	}
+	return false;
+}
+/**
+* Move a command's data into a bounce buffer below 4GiB
+* @param dev - device
+* @param slot - command slot the buffer belongs to
+* @param sg - caller's buffers
+* @param sg_count - number of scatter-gather entries
+* @param write - true if data goes from host to device
+* @param [out] out - bounce buffer entry to build the PRDT from
+* @return false if the command is too large or the pool is exhausted
+* (bounce_short is set then - commands in flight give their buffers
+* back as they complete)
+*/
+static bool ahci_bounce_map(ahci_dev_t *dev, uint8 slot, ahci_sg_t *sg, uint64 sg_count, bool write, ahci_sg_t *out){
+	ahci_bounce_t *bounce;
+	uint8 *data;
+	uint64 size;
+	uint64 len = 0;
+	uint64 i;
+	for (i = 0; i < sg_count; i ++){
+		len += sg[i].len;
+	}
+	if (len > AHCI_BOUNCE_MAX){
+		return false;
+	}
+	size = sizeof(ahci_bounce_t) + sizeof(ahci_sg_t) * sg_count + len;
+	bounce = (ahci_bounce_t *)dma_alloc(size, 0, DMA_ZONE_4G);
+	if (bounce == null){
+		dev->bounce_short = true;
+		return false;
+	}
+	bounce->size = size;
+	bounce->sg_count = sg_count;
+	bounce->write = write;
+	mem_copy((uint8 *)bounce->sg, sizeof(ahci_sg_t) * sg_count, (uint8 *)sg);
+	data = (uint8 *)&bounce->sg[sg_count];
+	out->addr = (uint64)data;
+	out->len = len;
+	if (write){
+		for (i = 0; i < sg_count; i ++){
+			mem_copy(data, sg[i].len, (uint8 *)sg[i].addr);
+			data += sg[i].len;
+		}
+	}
+	dev->bounce[slot] = (uint64)bounce;
+	dev->bounce_count ++;
+	return true;
+}
+/**
+* Fill command header, command FIS and PRDT of a slot
+* @param dev - device
+* @param slot - command slot
+* @param command - ATA command
+* @param lba - starting sector
+* @param count - sector count (65536 is encoded as 0)
+* @param sg - scatter-gather list of physically contiguous buffers
+* @param sg_count - number of scatter-gather entries
+* @param write - true if data goes from host to device
+* @return false if the list does not fit in the PRDT or could not be
+* bounced (check bounce_short)
+*/
+static bool ahci_build_cmd(ahci_dev_t *dev, uint8 slot, uint8 command, uint64 lba, uint64 count, ahci_sg_t *sg, uint64 sg_count, bool write){
+	ahci_hba_cmd_header_t *hdr = &dev->cmd_list[slot];
+	ahci_hba_cmd_tbl_t *tbl = &dev->cmd_tbl[slot];
+	ahci_fis_reg_h2d_t *fis = (ahci_fis_reg_h2d_t *)tbl->cfis;
+	uint64 addr;
+	uint64 paddr;
+	uint64 len;
+	uint64 chunk;
+	uint64 i;
+	uint16 n = 0;
+	ahci_sg_t bounce;
+	mem_fill((uint8 *)tbl, sizeof(ahci_hba_cmd_tbl_t), 0);
+	dev->bounce_short = false;
+	// Whatever the slot bounced last time is not needed anymore
+	ahci_bounce_done(dev, (1 << slot), false);
+	if (!dev->dma64 && ahci_sg_high(sg, sg_count)){
+		if (!ahci_bounce_map(dev, slot, sg, sg_count, write, &bounce)){
+			return false;
+		}
+		sg = &bounce;
+		sg_count = 1;
+	}
+	// Scatter the buffers over PRDT entries - one per physically
+	// contiguous run, 4MiB at most per entry
+	for (i = 0; i < sg_count; i ++){
+		addr = sg[i].addr;
+		len = sg[i].len;
+		if ((addr & 1) != 0 || (len & 1) != 0){
+			return false;
+		}
+		while (len > 0){
+			if (n >= AHCI_PRDT_COUNT){
+				return false;
+			}
+			chunk = ahci_phys_run(addr, len, &paddr);
+			if (chunk == 0){
+				return false;
+			}
+			tbl->prdt[n].dba = paddr;
+			tbl->prdt[n].dbc = chunk - 1;
+			addr += chunk;
+			len -= chunk;
+			n ++;
+		}
+	}
+	if (n > 0){
+		tbl->prdt[n - 1].i = 1;
+	}
+	// Command header
+	mem_fill((uint8 *)hdr, sizeof(ahci_hba_cmd_header_t), 0);
+	hdr->desc.cfl = sizeof(ahci_fis_reg_h2d_t) / sizeof(uint32);
+	hdr->desc.w = (write ? 1 : 0);
+	hdr->desc.prdtl = n;
+	hdr->ctba = (uint64)tbl;
+	// Command FIS
+	fis->fis_type = FIS_TYPE_REG_H2D;
+	fis->cmd = 1;
+	fis->command = command;
+	fis->lba0 = (uint8)lba;
+	fis->lba1 = (uint8)(lba >> 8);
+	fis->lba2 = (uint8)(lba >> 16);
+	fis->lba3 = (uint8)(lba >> 24);
+	fis->lba4 = (uint8)(lba >> 32);
+	fis->lba5 = (uint8)(lba >> 40);
+	fis->device = ATA_DEV_LBA;
+	fis->countl = (uint8)count;
+	fis->counth = (uint8)(count >> 8);
+	return true;
+}
+/**
+* Fill a read or write command - READ/WRITE FPDMA QUEUED when NCQ is in
+* use (slot number is the NCQ tag), READ/WRITE DMA EXT otherwise
+* @param fua - write through to the media (the drive has to support FUA)
+* @see ahci_build_cmd
+*/
+static bool ahci_build_rw(ahci_dev_t *dev, uint8 slot, uint64 lba, uint64 count, ahci_sg_t *sg, uint64 sg_count, bool write, bool fua){
+	ahci_fis_reg_h2d_t *fis = (ahci_fis_reg_h2d_t *)dev->cmd_tbl[slot].cfis;
+	fua = (fua && write && dev->fua);
+	if (fua){
+		dev->fua_cmds ++;
+	}
+	if (!dev->lba48){
+		// 28-bit LBA - top 4 bits go into the device register
+		if (lba + count > 0x10000000 || !ahci_build_cmd(dev, slot, (write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA), lba, count, sg, sg_count, write)){
+			return false;
+		}
+		fis->device |= (uint8)((lba >> 24) & 0x0F);
+		return true;
+	}
+	if (!dev->ncq){
+		return ahci_build_cmd(dev, slot, (write ? (fua ? ATA_CMD_WRITE_DMA_FUA_EX : ATA_CMD_WRITE_DMA_EX) : ATA_CMD_READ_DMA_EX), lba, count, sg, sg_count, write);
+	}
+	if (!ahci_build_cmd(dev, slot, (write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA), lba, 0, sg, sg_count, write)){
+		return false;
+	}
+	if (fua){
+		fis->device |= ATA_DEV_FUA;
+	}
+	// Sector count moves to the feature register, tag goes into count 7:3
+	fis->featurel = (uint8)count;
+	fis->featureh = (uint8)(count >> 8);
+	fis->countl = (slot << 3);
+	fis->counth = 0;
+	return true;
+}
+/**
+* Hand prepared slots over to the HBA with a single doorbell write
+* @param dev - device
+* @param mask - command slot mask
+*/
+static void ahci_issue(ahci_dev_t *dev, uint32 mask){
+	ahci_port_t *port = ahci_dev_port(dev);
+	uint8 depth;
+	uint8 n = ahci_bit_count(mask);
+	dev->busy |= mask;
+	if (dev->ncq){
+		// Queued commands must be marked active before they are issued
+		port->sact = mask;
+	}
+	port->ci = mask;
+	// Sample queue depth
+	depth = ahci_bit_count(dev->busy);
+	dev->cmd_count += n;
+	if (dev->ccc){
+		dev->ccc_cmds += n;
+	}
+	dev->depth_sum += depth * n;
+	if (depth > dev->depth_max){
+		dev->depth_max = depth;
+	}
+}
+/**
+* Get the busy-poll window for a wait
+* @param dev - device
+* @param len - number of bytes being transfered
+* @return window in TSC ticks
+*/
+static uint64 ahci_poll_window(ahci_dev_t *dev, uint64 len){
+	uint64 window;
+	switch (dev->mode){
+		case AHCI_MODE_IRQ:
+			return 0;
+		case AHCI_MODE_HYBRID:
+			// Large transfers are not worth burning the CPU for
+			if (len > AHCI_POLL_MAX_BYTES){
+				return 0;
+			}
+			// Twice the usual latency of small transfers, capped
+			window = timer_us_to_ticks(AHCI_POLL_MAX_US);
+			if (dev->lat_avg != 0 && dev->lat_avg * 2 < window){
+				window = dev->lat_avg * 2;
+			}
+			return window;
+	}
+	return (uint64)-1;
+}
+/**
+* Sleep until the next interrupt, unless commands have completed already
+* @param dev - device
+* @param mask - slot mask being waited for
+* @param any - true if a single completed slot is enough to stay awake
+*/
+static void ahci_sleep(ahci_dev_t *dev, uint32 mask, bool any){
+	ahci_port_t *port = ahci_dev_port(dev);
+	uint32 pending;
+	asm volatile ("cli");
+	pending = ((port->ci | port->sact) & mask);
+	if ((any ? pending == mask : pending != 0) && !dev->error){
+		// STI takes effect after HLT starts, so the wake-up can't slip in between
+		asm volatile ("sti\n\thlt");
+	} else {
+		asm volatile ("sti");
+	}
+}
+/**
+* Wait for issued commands to complete
+* Non-queued commands complete when the HBA clears their CI bit, queued
+* commands complete when a Set Device Bits FIS clears their SActive bit.
+* Depending on the completion mode the CPU busy-polls, sleeps until
+* the completion interrupt or does both (poll first, then sleep).
+* @param dev - device
+* @param mask - slot mask to wait for
+* @param len - number of bytes transfered by the commands
+* @return false on error or timeout
+*/
+static bool ahci_wait(ahci_dev_t *dev, uint32 mask, uint64 len){
+	ahci_port_t *port = ahci_dev_port(dev);
+	uint64 start = timer_ticks();
+	uint64 window = ahci_poll_window(dev, len);
+	uint64 timeout = timer_us_to_ticks(AHCI_TIMEOUT_US);
+	uint64 elapsed = 0;
+	bool slept = false;
+	while (((port->ci | port->sact) & mask) != 0 && !dev->error){
+		elapsed = timer_ticks() - start;
+		if (elapsed > timeout){
+			dev->error = true;
+			break;
+		}
+		if (elapsed < window){
+			// Status is shared with the interrupt handler
+			asm volatile ("cli");
+			ahci_port_status(dev);
+			asm volatile ("sti");
+			asm volatile ("pause");
+		} else {
+			ahci_sleep(dev, mask, false);
+			slept = true;
+		}
+	}
+	if (!dev->error){
+		asm volatile ("cli");
+		ahci_port_status(dev);
+		asm volatile ("sti");
+	}
+	if (dev->error){
+		ahci_port_recover(dev);
+		return false;
+	}
+	ahci_bounce_done(dev, mask, true);
+	dev->busy &= ~mask;
+	// Calibrate the poll window on small transfers
+	if (len <= AHCI_POLL_MAX_BYTES){
+		elapsed = timer_ticks() - start;
+		dev->lat_avg = (dev->lat_avg == 0 ? elapsed : (dev->lat_avg * 7 + elapsed) / 8);
+	}
+	if (slept){
+		dev->sleep_count ++;
+		// Wake-up latency with and without coalescing on small transfers
+		if (len <= AHCI_POLL_MAX_BYTES){
+			elapsed = timer_ticks() - start;
+			if (dev->ccc){
+				dev->wait_ccc = (dev->wait_ccc == 0 ? elapsed : (dev->wait_ccc * 7 + elapsed) / 8);
+			} else {
+				dev->wait_irq = (dev->wait_irq == 0 ? elapsed : (dev->wait_irq * 7 + elapsed) / 8);
+			}
+		}
+	} else {
+		dev->poll_count ++;
+	}
+	return true;
+}
+/**
+* Split a transfer into commands and spread them over free command slots
+* @param idx - device index
+* @param lba - starting sector
+* @param buff - data buffer
+* @param len - number of bytes
+* @param write - true to write, false to read
+* @param fua - write through to the media before returning
+* @return false if any of the commands failed
+*/
+static bool ahci_transfer(uint64 idx, uint64 lba, uint8 *buff, uint64 len, bool write, bool fua){
+	ahci_dev_t *dev;
+	uint32 issued = 0;
+	uint64 total = len;
+	uint64 count;
+	uint64 bytes;
+	uint64 ratio;
+	int64 slot;
+	ahci_sg_t sg;
+	bool ok = true;
+	if (idx >= _ahci_dev_count){
+		return false;
+	}
+	dev = &_ahci_dev[idx];
+	if (dev->cmd_list == null || len == 0 || (len % dev->sector_size) != 0 || ((uint64)buff & 1) != 0){
+		return false;
+	}
+	ratio = dev->phys_sector_size / dev->sector_size;
+	while (len > 0 && ok){
+		slot = ahci_slot_alloc(dev);
+		if (slot < 0){
+			// Every slot is in flight - drain them before queuing more
+			ok = (dev->busy == 0 || ahci_wait(dev, dev->busy, (uint64)-1));
+			issued = 0;
+			if (dev->ring != null){
+				// Ring slots stay taken until their completions are posted
+				ahci_ring_complete(dev);
+			}
+			continue;
+		}
+		// Scattered buffers may need more PRDT entries than a command has
+		count = ahci_prdt_fit((uint64)buff, len) / dev->sector_size;
+		if (count == 0){
+			ok = false;
+			break;
+		}
+		if (!dev->dma64 && count > AHCI_BOUNCE_MAX / dev->sector_size){
+			// Commands that have to be bounced are kept small
+			sg.addr = (uint64)buff;
+			sg.len = count * dev->sector_size;
+			if (ahci_sg_high(&sg, 1)){
+				count = AHCI_BOUNCE_MAX / dev->sector_size;
+			}
+		}
+		if (count > dev->max_sectors){
+			count = dev->max_sectors;
+			// Split on a physical sector boundary, so that the drive
+			// doesn't have to read-modify-write the sector in between
+			if (ratio > 1 && count > ratio){
+				count -= (lba + count + dev->align_offset) % ratio;
+			}
+		}
+		bytes = count * dev->sector_size;
+		sg.addr = (uint64)buff;
+		sg.len = bytes;
+		if (!ahci_build_rw(dev, slot, lba, count, &sg, 1, write, fua)){
+			if (dev->bounce_short && issued != 0){
+				// Bounce pool is exhausted - commands in flight give
+				// their buffers back, then try again
+				dev->bounce_waits ++;
+				ok = ahci_wait(dev, issued, (uint64)-1);
+				issued = 0;
+				continue;
+			}
+			ok = false;
+			break;
+		}
+		ahci_issue(dev, (1 << slot));
+		issued |= (1 << slot);
+		lba += count;
+		buff += bytes;
+		len -= bytes;
+	}
+	if (issued != 0 && !ahci_wait(dev, issued, total)){
+		ok = false;
+	}
+	if (ok && fua && write && !dev->fua && dev->wcache){
+		// Drive can't force unit access - flush the whole cache instead
+		dev->fua_flushes ++;
+		ok = ahci_exec(dev, ATA_CMD_FLUSH_CACHE_EX, 0, 0, null, 0, false);
+	}
+	return ok;
+}
+/**
+* Post a completion entry
+*/
+static void ahci_ring_post(ahci_ring_t *ring, uint64 cookie, bool ok){
+	ahci_cqe_t *cqe = &ring->cq[ring->cq_tail & (AHCI_RING_SIZE - 1)];
+	cqe->cookie = cookie;
+	cqe->ok = ok;
+	ring->cq_tail ++;
+}
+/**
+* Move queued submissions into free command slots
+* @param dev - device
+* @return number of requests issued
+*/
+static uint64 ahci_ring_submit(ahci_dev_t *dev){
+	ahci_ring_t *ring = dev->ring;
+	ahci_sqe_t *sqe;
+	uint32 mask = 0;
+	uint64 count;
+	uint64 n = 0;
+	int64 slot;
+	bool write;
+	while (ring->sq_head != ring->sq_tail){
+		sqe = &ring->sq[ring->sq_head & (AHCI_RING_SIZE - 1)];
+		// Nothing passes a barrier in flight, and a barrier waits for
+		// everything issued before it (the drive may reorder queued commands)
+		if (ring->barrier != 0 || ((sqe->flags & AHCI_SQE_BARRIER) != 0 && dev->busy != 0)){
+			break;
+		}
+		count = sqe->len / dev->sector_size;
+		if (count == 0 || count > dev->max_sectors || (sqe->len % dev->sector_size) != 0){
+			ring->sq_head ++;
+			ahci_ring_post(ring, sqe->cookie, false);
+			continue;
+		}
+		slot = ahci_slot_alloc(dev);
+		if (slot < 0){
+			break;
+		}
+		write = (sqe->op == AHCI_OP_WRITE);
+		if (!ahci_build_rw(dev, slot, sqe->lba, count, sqe->sg, sqe->sg_count, write, (sqe->flags & AHCI_SQE_FUA) != 0)){
+			if (dev->bounce_short && dev->busy != 0){
+				// Bounce pool is exhausted - the request stays queued, like
+				// with all slots taken, until completions free buffers.
+				// With nothing of ours in flight waiting wouldn't help.
+				dev->bounce_waits ++;
+				break;
+			}
+			ring->sq_head ++;
+			ahci_ring_post(ring, sqe->cookie, false);
+			continue;
+		}
+		ring->sq_head ++;
+		// Hold the slot until the whole batch goes out
+		dev->busy |= (1 << slot);
+		ring->cookie[slot] = sqe->cookie;
+		mask |= (1 << slot);
+		n ++;
+		if (write && (sqe->flags & AHCI_SQE_FUA) != 0 && !dev->fua && dev->wcache){
+			ring->fua |= (1 << slot);
+		}
+		if ((sqe->flags & AHCI_SQE_BARRIER) != 0){
+			ring->barrier = (1 << slot);
+			dev->barriers ++;
+		}
+	}
+	if (mask != 0){
+		ring->busy |= mask;
+		ahci_issue(dev, mask);
+	}
+	return n;
+}
+/**
+* Post completions for ring slots the HBA has finished with
+* @param dev - device
+*/
+static void ahci_ring_complete(ahci_dev_t *dev){
+	ahci_ring_t *ring = dev->ring;
+	ahci_port_t *port = ahci_dev_port(dev);
+	uint64 cookie[32];
+	uint32 flush = 0;
+	uint32 done;
+	uint8 i;
+	bool ok;
+	if (ring->busy == 0){
+		return;
+	}
+	asm volatile ("cli");
+	ahci_port_status(dev);
+	asm volatile ("sti");
+	if (dev->error){
+		ahci_port_recover(dev);
+	}
+	done = ring->busy & ~(port->ci | port->sact);
+	for (i = 0; i < 32; i ++){
+		if ((done & (1 << i)) != 0){
+			ahci_bounce_done(dev, (1 << i), (ring->failed & (1 << i)) == 0);
+			if ((ring->fua & (1 << i)) != 0 && (ring->failed & (1 << i)) == 0){
+				// Completes once the cache flush below is through
+				cookie[i] = ring->cookie[i];
+				flush |= (1 << i);
+			} else {
+				ahci_ring_post(ring, ring->cookie[i], (ring->failed & (1 << i)) == 0);
+			}
+		}
+	}
+	ring->busy &= ~done;
+	ring->failed &= ~done;
+	ring->fua &= ~done;
+	ring->barrier &= ~done;
+	dev->busy &= ~done;
+	if (flush != 0){
+		// Drive can't force unit access - one flush covers all of these writes
+		dev->fua_flushes ++;
+		ok = ahci_exec(dev, ATA_CMD_FLUSH_CACHE_EX, 0, 0, null, 0, false);
+		for (i = 0; i < 32; i ++){
+			if ((flush & (1 << i)) != 0){
+				ahci_ring_post(ring, cookie[i], ok);
+			}
+		}
+	}
+}
+/**
+* Run a non-queued command and wait for it
+* Queued and non-queued commands can't be mixed, so everything in flight
+* is drained first.
+* @param dev - device
+* @param command - ATA command
+* @param feature - feature register
+* @param count - sector count register
+* @param sg - data buffers (null for non-data commands)
+* @param sg_count - number of scatter-gather entries
+* @param write - true if data goes from host to device
+* @return false on error
+*/
+static bool ahci_exec(ahci_dev_t *dev, uint8 command, uint16 feature, uint16 count, ahci_sg_t *sg, uint64 sg_count, bool write){
+	ahci_port_t *port = ahci_dev_port(dev);
+	ahci_fis_reg_h2d_t *fis;
+	uint64 len = 0;
+	uint64 i;
+	int64 slot;
+	if (dev->busy != 0 && !ahci_wait(dev, dev->busy, (uint64)-1)){
+		return false;
+	}
+	if (dev->ring != null){
+		// Post drained ring commands so that their slots free up
+		ahci_ring_complete(dev);
+	}
+	slot = ahci_slot_alloc(dev);
+	if (slot < 0 || !ahci_build_cmd(dev, slot, command, 0, count, sg, sg_count, write)){
+		return false;
+	}
+	fis = (ahci_fis_reg_h2d_t *)dev->cmd_tbl[slot].cfis;
+	fis->featurel = (uint8)feature;
+	fis->featureh = (uint8)(feature >> 8);
+	for (i = 0; i < sg_count; i ++){
+		len += sg[i].len;
+	}
+	// No SActive bit and no queue depth sample for non-queued commands
+	dev->busy |= (1 << slot);
+	port->ci = (1 << slot);
+	return ahci_wait(dev, (1 << slot), len);
+}
+/**
+* Read a 64-bit value from IDENTIFY data (least significant word first)
+*/
+static uint64 ahci_ident_qword(uint16 *id, uint16 word){
+	return (uint64)id[word] | ((uint64)id[word + 1] << 16) | ((uint64)id[word + 2] << 32) | ((uint64)id[word + 3] << 48);
+}
+/**
+* Issue IDENTIFY DEVICE, build the capability model (addressing, sector
+* sizes, write cache, TRIM, transfer limit) and pick NCQ or DMA mode
+* @param dev - device with a running command engine
+* @return false if the device did not respond
+*/
+static bool ahci_identify(ahci_dev_t *dev){
+	uint16 *id = (uint16 *)dev->ident;
+	uint8 depth;
+	ahci_sg_t sg;
+	dev->ncq = false;
+	dev->queue_depth = dev->slot_count;
+	dev->sectors = 0;
+	sg.addr = (uint64)id;
+	sg.len = 512;
+	if (!ahci_exec(dev, ATA_CMD_IDENTIFY, 0, 0, &sg, 1, false)){
+		return false;
+	}
+	// Addressing and capacity
+	dev->lba48 = ((id[ATA_ID_CMD_SET_2] & (1 << 10)) != 0);
+	if (dev->lba48){
+		if ((id[ATA_ID_ADD_SUPPORTED] & (1 << 3)) != 0){
+			dev->sectors = ahci_ident_qword(id, ATA_ID_EXT_SECTORS);
+		} else {
+			dev->sectors = ahci_ident_qword(id, ATA_ID_LBA48_SECTORS);
+		}
+		dev->max_sectors = AHCI_MAX_SECTORS;
+	} else {
+		dev->sectors = (uint64)id[ATA_ID_LBA_SECTORS] | ((uint64)id[ATA_ID_LBA_SECTORS + 1] << 16);
+		dev->max_sectors = AHCI_MAX_SECTORS_28;
+	}
+	// Sector sizes (words 106 and 209 are valid when bits 15:14 read 01)
+	dev->sector_size = AHCI_SECTOR_SIZE;
+	dev->phys_sector_size = AHCI_SECTOR_SIZE;
+	dev->align_offset = 0;
+	if ((id[ATA_ID_SECTOR_SIZE] & 0xC000) == 0x4000){
+		if ((id[ATA_ID_SECTOR_SIZE] & (1 << 12)) != 0){
+			dev->sector_size = ((uint32)id[ATA_ID_LOGICAL_SIZE] | ((uint32)id[ATA_ID_LOGICAL_SIZE + 1] << 16)) * 2;
+			if (dev->sector_size < AHCI_SECTOR_SIZE || (dev->sector_size % AHCI_SECTOR_SIZE) != 0){
+				dev->sector_size = AHCI_SECTOR_SIZE;
+			}
+		}
+		dev->phys_sector_size = dev->sector_size;
+		if ((id[ATA_ID_SECTOR_SIZE] & (1 << 13)) != 0){
+			dev->phys_sector_size = dev->sector_size << (id[ATA_ID_SECTOR_SIZE] & 0x0F);
+		}
+	}
+	if ((id[ATA_ID_ALIGNMENT] & 0xC000) == 0x4000){
+		dev->align_offset = id[ATA_ID_ALIGNMENT] & 0x3FFF;
+	}
+	// Write cache and TRIM
+	dev->wcache = ((id[ATA_ID_CMD_SET_1] & (1 << 5)) != 0 && (id[ATA_ID_CMD_ENABLED_1] & (1 << 5)) != 0);
+	dev->trim = (dev->lba48 && (id[ATA_ID_DSM] & 1) != 0);
+	dev->trim_zero = (dev->trim && (id[ATA_ID_ADD_SUPPORTED] & (1 << 14)) != 0 && (id[ATA_ID_ADD_SUPPORTED] & (1 << 5)) != 0);
+	dev->trim_blocks = (id[ATA_ID_DSM_BLOCKS] > 0 ? id[ATA_ID_DSM_BLOCKS] : 1);
+	// Use NCQ only when both the HBA and the drive support it
+	if (dev->lba48 && dev->hba->cap.sncq && (id[ATA_ID_SATA_CAP] & (1 << 8)) != 0){
+		depth = (id[ATA_ID_QUEUE_DEPTH] & 0x1F) + 1;
+		dev->ncq = true;
+		if (depth < dev->queue_depth){
+			dev->queue_depth = depth;
+		}
+	}
+	// FUA bit is part of every FPDMA write, non-queued FUA writes are optional
+	dev->fua = (dev->ncq || (dev->lba48 && (id[ATA_ID_CMD_SET_3] & 0xC000) == 0x4000 && (id[ATA_ID_CMD_SET_3] & (1 << 6)) != 0));
+	return true;
+}
+/**
+* Send the queued TRIM ranges as one DATA SET MANAGEMENT command
+* @param dev - device
+* @return false if the command failed
+*/
+static bool ahci_trim_commit(ahci_dev_t *dev){
+	ahci_sg_t sg;
+	bool ok;
+	if (dev->trim_count == 0){
+		return true;
+	}
+	sg.addr = (uint64)dev->trim_buf;
+	sg.len = 512;
+	ok = ahci_exec(dev, ATA_CMD_DSM, ATA_DSM_TRIM, 1, &sg, 1, true);
+	mem_fill((uint8 *)dev->trim_buf, 512, 0);
+	dev->trim_count = 0;
+	dev->trim_cmds ++;
+	return ok;
+}
+/**
+* Send queued TRIM ranges if they overlap a transfer (so that the TRIM
+* can't land after new data) or if they have waited long enough
+* @param dev - device
+* @param lba - first sector of the transfer
+* @param count - number of sectors (0 to check the age only)
+* @return false if the command failed
+*/
+static bool ahci_trim_check(ahci_dev_t *dev, uint64 lba, uint64 count){
+	uint64 start;
+	uint64 len;
+	uint8 i;
+	if (dev->trim_count == 0){
+		return true;
+	}
+	if (timer_ticks() - dev->trim_stamp > timer_us_to_ticks(AHCI_TRIM_MAX_AGE_US)){
+		return ahci_trim_commit(dev);
+	}
+	for (i = 0; i < dev->trim_count; i ++){
+		start = dev->trim_buf[i] & 0xFFFFFFFFFFFF;
+		len = dev->trim_buf[i] >> 48;
+		if (lba < start + len && start < lba + count){
+			return ahci_trim_commit(dev);
+		}
+	}
+	return true;
+}
+/**
+* Queue a range for TRIM - each payload entry holds a 48-bit LBA and
+* a 16-bit sector count, adjacent ranges share an entry
+* @param dev - device
+* @param lba - first sector
+* @param count - number of sectors
+* @return false if a full payload could not be sent
+*/
+static bool ahci_trim_add(ahci_dev_t *dev, uint64 lba, uint64 count){
+	uint64 start;
+	uint64 len;
+	uint64 n;
+	uint8 i;
+	while (count > 0){
+		n = (count > ATA_DSM_RANGE_MAX ? ATA_DSM_RANGE_MAX : count);
+		for (i = 0; i < dev->trim_count; i ++){
+			start = dev->trim_buf[i] & 0xFFFFFFFFFFFF;
+			len = dev->trim_buf[i] >> 48;
+			if (len + n <= ATA_DSM_RANGE_MAX && (start + len == lba || lba + n == start)){
+				dev->trim_buf[i] = (start < lba ? start : lba) | ((len + n) << 48);
+				dev->trim_merged ++;
+				break;
+			}
+		}
+		if (i == dev->trim_count){
+			if (dev->trim_count == AHCI_TRIM_RANGES && !ahci_trim_commit(dev)){
+				return false;
+			}
+			if (dev->trim_count == 0){
+				dev->trim_stamp = timer_ticks();
+			}
+			dev->trim_buf[dev->trim_count ++] = lba | (n << 48);
+		}
+		dev->trim_ranges ++;
+		lba += n;
+		count -= n;
+	}
+	return true;
+}
+/**
+* Block layer glue - the device index travels in the private pointer
+*/
+static bool ahci_block_submit(block_dev_t *bdev, block_req_t *req){
+	uint64 idx = (uint64)bdev->priv;
+	ahci_sqe_t *sqe = ahci_sq_get(idx);
+	if (sqe == null){
+		return false;
+	}
+	sqe->op = (req->op == BLOCK_OP_WRITE ? AHCI_OP_WRITE : AHCI_OP_READ);
+	sqe->lba = req->lba;
+	sqe->len = req->count * bdev->sector_size;
+	sqe->sg = req->sg;
+	sqe->sg_count = req->sg_count;
+	sqe->cookie = (uint64)req;
+	if ((req->flags & BLOCK_REQ_FUA) != 0){
+		sqe->flags |= AHCI_SQE_FUA;
+	}
+	if ((req->flags & BLOCK_REQ_BARRIER) != 0){
+		sqe->flags |= AHCI_SQE_BARRIER;
+	}
+	ahci_submit(idx);
+	return true;
+}
+static void ahci_block_poll(block_dev_t *bdev, bool wait){
+	ahci_cqe_t cqe[8];
+	uint64 n;
+	uint64 i;
+	n = ahci_reap((uint64)bdev->priv, cqe, 8, (wait ? 1 : 0));
+	for (i = 0; i < n; i ++){
+		block_complete((block_req_t *)cqe[i].cookie, cqe[i].ok);
+	}
+}
+static bool ahci_block_flush(block_dev_t *bdev){
+	return ahci_flush((uint64)bdev->priv);
+}
+static bool ahci_block_discard(block_dev_t *bdev, uint64 lba, uint64 count){
+	return ahci_discard((uint64)bdev->priv, lba, count);
+}
+
+static block_ops_t _ahci_block_ops = {
+	.submit = ahci_block_submit,
+	.poll = ahci_block_poll,
+	.flush = ahci_block_flush,
+	.discard = ahci_block_discard
+};
+
+/**
+* Turn FIS receive off and give the command list and FIS area of a port
+* without a usable device back to the DMA pool
+* @param port - port registers
+* @param [in,out] cmd_list - command list (cleared)
+* @param [in,out] fis - FIS area (cleared)
+*/
+static void ahci_link_release(ahci_port_t *port, ahci_hba_cmd_header_t **cmd_list, ahci_fis_t **fis){
+	if ((*fis) != null && !ahci_port_stop(port)){
+		// HBA may still write there, better lose the memory
+		(*cmd_list) = null;
+		(*fis) = null;
+		return;
+	}
+	if ((*cmd_list) != null){
+		dma_free((uint64)(*cmd_list), sizeof(ahci_hba_cmd_header_t) * 32);
+		(*cmd_list) = null;
+	}
+	if ((*fis) != null){
+		dma_free((uint64)(*fis), sizeof(ahci_fis_t));
+		(*fis) = null;
+	}
+}
+/**
+* Bring the links of all implemented ports up together, so that boot
+* time grows by one link timeout and not by one per port (AHCI 1.3 10.1.2):
+* 1. stop every command engine
+* 2. give every port a command list and FIS area and turn FIS receive on,
+*    the HBA only updates the task file and signature registers from the
+*    first D2H Register FIS when it may receive it
+* 3. spin up drives one by one (if the HBA does staggered spin-up),
+*    COMRESET every other port at once
+* 4. wait for PHY ready on all ports in one loop
+* 5. wait for BSY, DRQ and ERR to clear on all linked ports in one loop
+* @param hba - controller
+* @param [out] cmd_list - command list of each port (null if it couldn't be allocated)
+* @param [out] fis - FIS area of each port
+* @return mask of ports with a device ready for commands
+*/
+static uint32 ahci_link_up(ahci_hba_t *hba, ahci_hba_cmd_header_t **cmd_list, ahci_fis_t **fis){
+	uint32 ports = hba->pi;
+	uint32 reset = ports;
+	uint32 pending;
+	uint32 linked = 0;
+	uint32 ready = 0;
+	uint64 start;
+	uint64 elapsed;
+	ahci_port_t *port;
+	uint8 zone = (hba->cap.s64a ? DMA_ZONE_ANY : DMA_ZONE_4G);
+	uint8 i;
+	// Stop command list processing, then FIS receive
+	for (i = 0; i < 32; i ++){
+		if ((ports & (1 << i)) != 0){
+			hba->ports[i].cmd.st = 0;
+		}
+	}
+	start = timer_ticks();
+	for (i = 0; i < 32; i ++){
+		while ((ports & (1 << i)) != 0 && hba->ports[i].cmd.cr && timer_ticks() - start < timer_us_to_ticks(AHCI_STOP_TIMEOUT_US)){}
+		if ((ports & (1 << i)) != 0){
+			hba->ports[i].cmd.fre = 0;
+		}
+	}
+	for (i = 0; i < 32; i ++){
+		while ((ports & (1 << i)) != 0 && hba->ports[i].cmd.fr && timer_ticks() - start < timer_us_to_ticks(AHCI_STOP_TIMEOUT_US)){}
+	}
+	// Point the ports at their received FIS areas and start FIS receive
+	for (i = 0; i < 32; i ++){
+		cmd_list[i] = null;
+		fis[i] = null;
+		if ((ports & (1 << i)) == 0){
+			continue;
+		}
+		cmd_list[i] = (ahci_hba_cmd_header_t *)dma_alloc(sizeof(ahci_hba_cmd_header_t) * 32, 1024, zone);
+		fis[i] = (ahci_fis_t *)dma_alloc(sizeof(ahci_fis_t), 256, zone);
+		if (cmd_list[i] == null || fis[i] == null){
+			ahci_link_release(&hba->ports[i], &cmd_list[i], &fis[i]);
+			continue;
+		}
+		hba->ports[i].clb = (uint64)cmd_list[i];
+		hba->ports[i].fb = (uint64)fis[i];
+		*((volatile uint32 *)&hba->ports[i].serr) = 0xFFFFFFFF;
+		hba->ports[i].cmd.fre = 1;
+	}
+	// Spinning a drive up starts its link initialization as well
+	if (hba->cap.sss){
+		for (i = 0; i < 32; i ++){
+			if ((ports & (1 << i)) != 0 && !hba->ports[i].cmd.sud){
+				hba->ports[i].sctl.det = 0;
+				hba->ports[i].cmd.sud = 1;
+				reset &= ~(1 << i);
+				timer_delay(AHCI_SPINUP_STAGGER_US);
+			}
+		}
+	}
+	// COMRESET the rest at once
+	for (i = 0; i < 32; i ++){
+		if ((reset & (1 << i)) != 0){
+			hba->ports[i].sctl.det = 1;
+		}
+	}
+	if (reset != 0){
+		timer_delay(AHCI_COMRESET_US);
+	}
+	for (i = 0; i < 32; i ++){
+		if ((reset & (1 << i)) != 0){
+			hba->ports[i].sctl.det = 0;
+		}
+	}
+	// Wait for PHY ready
+	pending = ports;
+	start = timer_ticks();
+	while (pending != 0){
+		elapsed = timer_ticks() - start;
+		for (i = 0; i < 32; i ++){
+			if ((pending & (1 << i)) == 0){
+				continue;
+			}
+			port = &hba->ports[i];
+			if (port->ssts.det == 3){
+				linked |= (1 << i);
+				pending &= ~(1 << i);
+			} else if (port->ssts.det == 4 || (port->ssts.det == 0 && elapsed > timer_us_to_ticks(AHCI_DETECT_US))){
+				// Offline or nothing attached
+				pending &= ~(1 << i);
+			}
+		}
+		if (elapsed > timer_us_to_ticks(AHCI_LINK_TIMEOUT_US)){
+			break;
+		}
+	}
+	for (i = 0; i < 32; i ++){
+		if ((linked & (1 << i)) != 0){
+			*((volatile uint32 *)&hba->ports[i].serr) = 0xFFFFFFFF;
+		}
+	}
+	// Wait for the drives to become ready
+	pending = linked;
+	start = timer_ticks();
+	while (pending != 0 && timer_ticks() - start < timer_us_to_ticks(AHCI_READY_TIMEOUT_US)){
+		for (i = 0; i < 32; i ++){
+			if ((pending & (1 << i)) != 0 && (hba->ports[i].tfd.status & (ATA_SR_BSY | ATA_SR_DRQ | ATA_SR_ERR)) == 0){
+				ready |= (1 << i);
+				pending &= ~(1 << i);
+			}
+		}
+	}
+	return ready;
+}
+static void ahci_init_port(ahci_hba_t *hba, uint8 irq, uint32 ready, ahci_hba_cmd_header_t **cmd_list, ahci_fis_t **fis){
 	uint32 dev_type = 0;
 	uint32 ports = hba->pi;
 	uint8 i = 0;
+	ahci_dev_t *dev;
+	char name[BLOCK_NAME_LEN];
+	block_dev_t *bdev;
 	for (i = 0; i < 32; i ++){
 		if (ports & 1) {
-			dev_type = ahci_get_type(&hba->ports[i]);
+			dev_type = ((ready & (1 << i)) != 0 ? ahci_get_type(&hba->ports[i]) : 0);
 #if DEBUG == 1
 			switch (dev_type){
 				case AHCI_DEV_SATA:
-					debug_print(DC_WGR, "SATAPI drive found at port %d\n", i);
+					debug_print(DC_WGR, "SATA drive found at port %d\n", i);
 					break;
 				case AHCI_DEV_SATAPI:
 					debug_print(DC_WGR, "SATAPI drive found at port %d\n", i);
@@ -471,14 +1916,69 @@ static void ahci_init_port(ahci_hba_t *hba){
 				case AHCI_DEV_SATAPI:
 				case AHCI_DEV_SEMB:
 				case AHCI_DEV_PM:
-					_ahci_dev[_ahci_dev_count].hba = hba;
-					_ahci_dev[_ahci_dev_count].port = i;
+					dev = &_ahci_dev[_ahci_dev_count];
+					dev->hba = hba;
+					dev->port = i;
+					dev->type = dev_type;
+					dev->slot_count = hba->cap.ncs + 1;
+					dev->queue_depth = dev->slot_count;
+					dev->ncq = false;
+					dev->irq = irq;
+					dev->mode = AHCI_MODE_POLL;
+					dev->dma64 = hba->cap.s64a;
+					dev->ccc = false;
+					dev->bounce_count = 0;
+					dev->bounce_waits = 0;
+					dev->bounce_short = false;
+					dev->error = false;
+					dev->lat_avg = 0;
+					dev->busy = 0;
+					dev->sectors = 0;
+					dev->sector_size = AHCI_SECTOR_SIZE;
+					dev->phys_sector_size = AHCI_SECTOR_SIZE;
+					dev->align_offset = 0;
+					dev->max_sectors = AHCI_MAX_SECTORS_28;
+					dev->lba48 = false;
+					dev->wcache = false;
+					dev->fua = false;
+					dev->trim = false;
+					dev->trim_zero = false;
+					dev->trim_count = 0;
+					dev->cmd_list = null;
+					dev->fis = null;
+					dev->ring = null;
+					// Only ATA drives get a DMA command engine for now
+					if (dev_type == AHCI_DEV_SATA && cmd_list[i] != null){
+						dev->cmd_list = cmd_list[i];
+						dev->fis = fis[i];
+						cmd_list[i] = null;
+						fis[i] = null;
+						if (ahci_port_rebase(dev)){
+							if (ahci_identify(dev) && dev->sectors > 0){
+								mem_fill((uint8 *)name, BLOCK_NAME_LEN, 0);
+								str_write_f(name, BLOCK_NAME_LEN - 1, "sata%u", _ahci_dev_count);
+								bdev = block_register(name, &_ahci_block_ops, dev->sector_size, dev->sectors, dev->queue_depth, (void *)_ahci_dev_count);
+								if (bdev != null){
+									bdev->phys_sector_size = dev->phys_sector_size;
+									bdev->align_offset = dev->align_offset;
+									bdev->max_segments = AHCI_PRDT_COUNT;
+									bdev->max_sectors = dev->max_sectors;
+								}
+							}
+							if (irq < 16){
+								// Completion interrupts (HBA wide enable is set by ahci_init)
+								*((volatile uint32 *)&hba->ports[i].ie) = AHCI_PxIE_DEFAULT;
+								dev->mode = AHCI_MODE_HYBRID;
+							}
+						}
+					}
 					_ahci_dev_count ++;
 					break;
 			}
+			// Nobody took the port's FIS receive over
+			ahci_link_release(&hba->ports[i], &cmd_list[i], &fis[i]);
 		}
 		ports >>= 1;
-		i ++;
 	}
 }
 
@@ -486,8 +1986,13 @@ bool ahci_init(){
 	uint64 abar = 0;
 	uint8 i = 0;
 	uint8 dev_count = 0;
+	uint8 irq;
+	uint32 ready;
+	uint64 start;
 	ahci_hba_t *hba;
 	pci_device_t dev;
+	ahci_hba_cmd_header_t *cmd_list[32];
+	ahci_fis_t *fis[32];
 
 	dev_count = pci_num_device(0x1, 0x6);
 	if (dev_count > 0){
@@ -507,12 +2012,33 @@ bool ahci_init(){
 #if DEBUG == 1
 				debug_print(DC_WB, "SATA controller at %u:%u", addr.s.bus, addr.s.device);
 				debug_print(DC_WB, "     BAR:0x%x", abar);
-				debug_print(DC_WB, "     Num Ports:%d", hba->cap.np);
-				debug_print(DC_WB, "     Num Commands:%d", hba->cap.ncs);
+				debug_print(DC_WB, "     Num Ports:%d", hba->cap.np + 1);
+				debug_print(DC_WB, "     Num Commands:%d", hba->cap.ncs + 1);
 				debug_print(DC_WB, "     64-bit addresing:%d", hba->cap.s64a);
 				debug_print(DC_WB, "     Version:%x", hba->vs);
 #endif
-				ahci_init_port(hba);
+				// Make sure we're talking AHCI, not legacy IDE
+				hba->ghc.ae = 1;
+				// Route controller interrupt through the PIC line the BIOS assigned
+				pci_enable_device(addr);
+				irq = dev.int_line;
+				if (irq >= 16 || !irq_register(irq, ahci_irq)){
+					irq = 0xFF;
+				}
+#if DEBUG == 1
+				debug_print(DC_WB, "     IRQ:%d", (uint64)irq);
+#endif
+				// Reset and wait for all links together
+				start = timer_ticks();
+				ready = ahci_link_up(hba, cmd_list, fis);
+#if DEBUG == 1
+				debug_print(DC_WB, "     Ready ports:0x%x (%ums)", (uint64)ready, timer_ticks_to_us(timer_ticks() - start) / 1000);
+#endif
+				ahci_init_port(hba, irq, ready, cmd_list, fis);
+				if (irq < 16){
+					hba->is = 0xFFFFFFFF;
+					hba->ghc.ie = 1;
+				}
 			}
 		}
 		return true;
@@ -524,19 +2050,214 @@ bool ahci_init(){
 	return false;
 }
 
-bool ahci_read(uint64 idx, uint8 *buff, uint64 len){
-	if (idx < _ahci_dev_count){
-		ahci_hba_t *hba = _ahci_dev[idx].hba;
-		ahci_port_t *port = &hba->ports[_ahci_dev[idx].port];
+uint64 ahci_num_dev(){
+	return _ahci_dev_count;
+}
 
+#if DEBUG == 1
+void ahci_list(){
+	uint64 i;
+	ahci_dev_t *dev;
+	for (i = 0; i < _ahci_dev_count; i ++){
+		dev = &_ahci_dev[i];
+		debug_print(DC_WB, "ahci:%u port:%u, %s, depth:%u/%u, max:%u, avg:%u, cmds:%u, sdb:%u/%u",
+			i, (uint64)dev->port, (dev->ncq ? "NCQ" : "DMA"), (uint64)dev->queue_depth, (uint64)dev->slot_count,
+			(uint64)dev->depth_max, (dev->cmd_count > 0 ? dev->depth_sum / dev->cmd_count : 0), dev->cmd_count,
+			dev->sdb_count, dev->sdb_tags);
+		debug_print(DC_WB, "     %uMB, sector:%u/%u, align:%u, max:%u, %s, cache:%u, trim:%u",
+			(dev->sectors * dev->sector_size) / 1024 / 1024, (uint64)dev->sector_size, (uint64)dev->phys_sector_size,
+			(uint64)dev->align_offset, (uint64)dev->max_sectors, (dev->lba48 ? "LBA48" : "LBA28"), (uint64)dev->wcache, (uint64)dev->trim);
+		debug_print(DC_WB, "     irq:%u, polled:%u, slept:%u, latency:%uus",
+			dev->irq_count, dev->poll_count, dev->sleep_count, timer_ticks_to_us(dev->lat_avg));
+		debug_print(DC_WB, "     trim ranges:%u, merged:%u, commands:%u, bounced:%u, waited:%u",
+			dev->trim_ranges, dev->trim_merged, dev->trim_cmds, dev->bounce_count, dev->bounce_waits);
+		debug_print(DC_WB, "     fua:%u, writes:%u, flushes:%u, barriers:%u",
+			(uint64)dev->fua, dev->fua_cmds, dev->fua_flushes, dev->barriers);
+		debug_print(DC_WB, "     ccc:%u, commands:%u, irqs:%u, avoided:%u, wait:%uus (%uus without)",
+			(uint64)dev->ccc, dev->ccc_cmds, dev->ccc_irqs, (dev->ccc_cmds > dev->ccc_irqs ? dev->ccc_cmds - dev->ccc_irqs : 0),
+			timer_ticks_to_us(dev->wait_ccc), timer_ticks_to_us(dev->wait_irq));
 	}
-	return false;
 }
-bool ahci_write(uint64 idx, uint8 *buff, uint64 len){
-	if (idx < _ahci_dev_count){
-		ahci_hba_t *hba = _ahci_dev[idx].hba;
-		ahci_port_t *port = &hba->ports[_ahci_dev[idx].port];
+#endif
 
+bool ahci_set_mode(uint64 idx, uint8 mode){
+	ahci_dev_t *dev;
+	if (idx >= _ahci_dev_count || mode > AHCI_MODE_HYBRID){
+		return false;
 	}
-	return false;
-}
\ No newline at end of file
+	dev = &_ahci_dev[idx];
+	// Sleeping needs a working interrupt
+	if (mode != AHCI_MODE_POLL && dev->irq >= 16){
+		return false;
+	}
+	dev->mode = mode;
+	return true;
+}
+
+bool ahci_set_coalescing(uint64 idx, uint8 count, uint64 timeout_us){
+	ahci_dev_t *dev;
+	ahci_hba_t *hba;
+	uint64 ms;
+	if (idx >= _ahci_dev_count){
+		return false;
+	}
+	dev = &_ahci_dev[idx];
+	hba = dev->hba;
+	// Coalescing only changes how often the interrupt fires
+	if (!hba->cap.cccs || dev->irq >= 16 || dev->cmd_list == null){
+		return false;
+	}
+	// Hardware timer ticks in milliseconds
+	ms = (timeout_us + 999) / 1000;
+	if (ms == 0){
+		ms = 1;
+	}
+	if (ms > AHCI_CCC_MAX_MS){
+		ms = AHCI_CCC_MAX_MS;
+	}
+	// Thresholds may only change while coalescing is off
+	hba->ccc_ctl.en = 0;
+	if (count > 0){
+		hba->ccc_ctl.cc = count;
+		hba->ccc_ctl.tv = ms;
+		hba->ccc_ports |= (1 << dev->port);
+		*((volatile uint32 *)&hba->ports[dev->port].ie) = AHCI_PxIE_CCC;
+	} else {
+		hba->ccc_ports &= ~(1 << dev->port);
+		*((volatile uint32 *)&hba->ports[dev->port].ie) = AHCI_PxIE_DEFAULT;
+	}
+	dev->ccc = (count > 0);
+	if (hba->ccc_ports != 0){
+		hba->ccc_ctl.en = 1;
+	}
+	return true;
+}
+
+bool ahci_flush(uint64 idx){
+	if (idx >= _ahci_dev_count || _ahci_dev[idx].cmd_list == null){
+		return false;
+	}
+	if (!ahci_trim_commit(&_ahci_dev[idx])){
+		return false;
+	}
+	// Writes go straight to the media without a volatile cache
+	if (!_ahci_dev[idx].wcache){
+		return true;
+	}
+	return ahci_exec(&_ahci_dev[idx], ATA_CMD_FLUSH_CACHE_EX, 0, 0, null, 0, false);
+}
+
+bool ahci_discard(uint64 idx, uint64 lba, uint64 count){
+	ahci_dev_t *dev;
+	if (idx >= _ahci_dev_count){
+		return false;
+	}
+	dev = &_ahci_dev[idx];
+	if (dev->cmd_list == null || !dev->trim || count == 0 || lba + count > dev->sectors){
+		return false;
+	}
+	if (!ahci_trim_add(dev, lba, count)){
+		return false;
+	}
+	return ahci_trim_check(dev, 0, 0);
+}
+
+bool ahci_discard_commit(uint64 idx){
+	if (idx >= _ahci_dev_count || _ahci_dev[idx].cmd_list == null){
+		return false;
+	}
+	return ahci_trim_commit(&_ahci_dev[idx]);
+}
+
+bool ahci_read(uint64 idx, uint64 lba, uint8 *buff, uint64 len){
+	if (idx < _ahci_dev_count && !ahci_trim_check(&_ahci_dev[idx], lba, len / _ahci_dev[idx].sector_size)){
+		return false;
+	}
+	return ahci_transfer(idx, lba, buff, len, false, false);
+}
+bool ahci_write(uint64 idx, uint64 lba, uint8 *buff, uint64 len){
+	if (idx < _ahci_dev_count && !ahci_trim_check(&_ahci_dev[idx], lba, len / _ahci_dev[idx].sector_size)){
+		return false;
+	}
+	return ahci_transfer(idx, lba, buff, len, true, false);
+}
+bool ahci_write_fua(uint64 idx, uint64 lba, uint8 *buff, uint64 len){
+	if (idx < _ahci_dev_count && !ahci_trim_check(&_ahci_dev[idx], lba, len / _ahci_dev[idx].sector_size)){
+		return false;
+	}
+	return ahci_transfer(idx, lba, buff, len, true, true);
+}
+
+ahci_sqe_t *ahci_sq_get(uint64 idx){
+	ahci_ring_t *ring;
+	ahci_sqe_t *sqe;
+	if (idx >= _ahci_dev_count || _ahci_dev[idx].ring == null){
+		return null;
+	}
+	ring = _ahci_dev[idx].ring;
+	// Every submission needs room for its completion as well
+	if (ring->sq_tail - ring->cq_head >= AHCI_RING_SIZE){
+		return null;
+	}
+	sqe = &ring->sq[ring->sq_tail & (AHCI_RING_SIZE - 1)];
+	mem_fill((uint8 *)sqe, sizeof(ahci_sqe_t), 0);
+	ring->sq_tail ++;
+	return sqe;
+}
+
+uint64 ahci_submit(uint64 idx){
+	ahci_dev_t *dev;
+	ahci_sqe_t *sqe;
+	uint64 i;
+	if (idx >= _ahci_dev_count || _ahci_dev[idx].ring == null){
+		return 0;
+	}
+	dev = &_ahci_dev[idx];
+	// Queued TRIM goes out before anything that touches its ranges
+	for (i = dev->ring->sq_head; i != dev->ring->sq_tail && dev->trim_count > 0; i ++){
+		sqe = &dev->ring->sq[i & (AHCI_RING_SIZE - 1)];
+		ahci_trim_check(dev, sqe->lba, sqe->len / dev->sector_size);
+	}
+	return ahci_ring_submit(dev);
+}
+
+uint64 ahci_reap(uint64 idx, ahci_cqe_t *cqe, uint64 max, uint64 min){
+	ahci_dev_t *dev;
+	ahci_ring_t *ring;
+	uint64 start = timer_ticks();
+	uint64 elapsed;
+	uint64 window;
+	uint64 n = 0;
+	if (idx >= _ahci_dev_count || _ahci_dev[idx].ring == null){
+		return 0;
+	}
+	dev = &_ahci_dev[idx];
+	ring = dev->ring;
+	window = ahci_poll_window(dev, 0);
+	if (min > max){
+		min = max;
+	}
+	while (true){
+		ahci_ring_complete(dev);
+		// Freed slots let waiting submissions out
+		ahci_ring_submit(dev);
+		if (ring->cq_tail - ring->cq_head >= min || ring->busy == 0){
+			break;
+		}
+		elapsed = timer_ticks() - start;
+		if (elapsed > timer_us_to_ticks(AHCI_TIMEOUT_US)){
+			// Fail everything that is in flight
+			dev->error = true;
+		} else if (elapsed < window){
+			asm volatile ("pause");
+		} else {
+			ahci_sleep(dev, ring->busy, true);
+		}
+	}
+	while (n < max && ring->cq_head != ring->cq_tail){
+		cqe[n] = ring->cq[ring->cq_head & (AHCI_RING_SIZE - 1)];
+		ring->cq_head ++;
+		n ++;
+	}
+	return n;
+}
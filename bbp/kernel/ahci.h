@@ -39,6 +39,48 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "common.h"
 #include "../config.h"
+#include "block.h"
+
+// Completion modes
+#define AHCI_MODE_POLL		0	// Busy-poll the command issue register
+#define AHCI_MODE_IRQ		1	// Sleep until the completion interrupt
+#define AHCI_MODE_HYBRID	2	// Busy-poll for a calibrated window, then sleep
+
+// Ring request operations
+#define AHCI_OP_READ		0
+#define AHCI_OP_WRITE		1
+
+// Ring request flags
+#define AHCI_SQE_FUA		(1 << 0)	// Write reaches the media before it completes
+#define AHCI_SQE_BARRIER	(1 << 1)	// Issued alone, after everything queued before it has completed
+
+// Submission/completion ring size (entries, power of 2)
+#define AHCI_RING_SIZE		64
+
+/**
+* Scatter-gather entry - shared with the block layer
+* Addresses must be word aligned, lengths even.
+*/
+typedef block_sg_t ahci_sg_t;
+/**
+* Submission queue entry
+*/
+typedef struct {
+	uint8 op;					// AHCI_OP_*
+	uint8 flags;				// AHCI_SQE_*
+	uint64 lba;					// First sector
+	uint64 len;					// Number of bytes (multiple of sector size)
+	ahci_sg_t *sg;				// Scatter-gather list (must stay valid until completion)
+	uint64 sg_count;			// Number of scatter-gather entries
+	uint64 cookie;				// Caller data, returned with the completion
+} ahci_sqe_t;
+/**
+* Completion queue entry
+*/
+typedef struct {
+	uint64 cookie;				// Cookie of the submission
+	bool ok;					// false if the request failed
+} ahci_cqe_t;
 
 /**
 * Initialize AHCI driver
@@ -51,22 +93,110 @@ bool ahci_init();
 */
 uint64 ahci_num_dev();
 /**
+* Select how the driver waits for command completion
+* Devices start in hybrid mode when the controller interrupt could be routed,
+* in polling mode otherwise.
+* @param idx - device index in the device list
+* @param mode - completion mode (AHCI_MODE_*)
+* @return false if the mode is not available for the device
+*/
+bool ahci_set_mode(uint64 idx, uint8 mode);
+/**
+* Coalesce completion interrupts of a device (Command Completion Coalescing)
+* The interrupt fires once count commands have completed or timeout_us has
+* passed since the first of them. Thresholds are shared by all coalescing
+* ports of the controller.
+* @param idx - device index in the device list
+* @param count - completions per interrupt (1-255, 0 turns coalescing off)
+* @param timeout_us - longest delay (rounded up to 1ms, the hardware resolution)
+* @return false if the controller can't coalesce or has no interrupt
+*/
+bool ahci_set_coalescing(uint64 idx, uint8 count, uint64 timeout_us);
+/**
+* Write the drive's volatile cache to the media (FLUSH CACHE EXT)
+* Waits for all outstanding commands first.
+* @param idx - device index in the device list
+* @return false if the flush failed
+*/
+bool ahci_flush(uint64 idx);
+/**
+* Discard (TRIM) a range of sectors
+* Ranges are collected and sent in batches of up to 64 per DATA SET
+* MANAGEMENT command - when the batch is full, on ahci_flush() or
+* ahci_discard_commit(), before a transfer that overlaps a queued range
+* and once the oldest range has waited for a second.
+* @param idx - device index in the device list
+* @param lba - first sector
+* @param count - number of sectors
+* @return false if the drive doesn't support TRIM or a batch failed
+*/
+bool ahci_discard(uint64 idx, uint64 lba, uint64 count);
+/**
+* Send queued discard ranges now
+* @param idx - device index in the device list
+* @return false if the command failed
+*/
+bool ahci_discard_commit(uint64 idx);
+/**
 * Read data from AHCI drive
+* Large reads are split over all command slots the HBA implements
 * @param idx - device index in the device list
-* @param buff - byte buffer to write into
-* @param len - number of bytes to read
-* @todo implement
+* @param lba - first sector to read
+* @param buff - byte buffer to write into (word aligned)
+* @param len - number of bytes to read (multiple of sector size)
 * @return false if read failed
 */
-bool ahci_read(uint64 idx, uint8 *buff, uint64 len);
+bool ahci_read(uint64 idx, uint64 lba, uint8 *buff, uint64 len);
 /**
 * Write data to AHCI drive
+* Large writes are split over all command slots the HBA implements
 * @param idx - device index in the device list
-* @param buff - byte buffer to read from
-* @param len - number of bytes to write
-* @todo implement
+* @param lba - first sector to write
+* @param buff - byte buffer to read from (word aligned)
+* @param len - number of bytes to write (multiple of sector size)
 * @return false if write failed
 */
-bool ahci_write(uint64 idx, uint8 *buff, uint64 len);
+bool ahci_write(uint64 idx, uint64 lba, uint8 *buff, uint64 len);
+/**
+* Write data to AHCI drive with Forced Unit Access
+* The data is on the media when the call returns, without flushing the
+* rest of the drive's cache. Drives without FUA support get a cache flush.
+* @see ahci_write
+*/
+bool ahci_write_fua(uint64 idx, uint64 lba, uint8 *buff, uint64 len);
+/**
+* Get the next free submission queue entry of a device
+* The entry is queued by filling it in - nothing is sent to the drive
+* until ahci_submit() is called.
+* @param idx - device index in the device list
+* @return submission entry or null if the ring is full
+*/
+ahci_sqe_t *ahci_sq_get(uint64 idx);
+/**
+* Send queued submissions to the drive
+* All requests that fit into free command slots go out with a single
+* write to the command issue register; the rest wait in the ring and go
+* out as slots free up in ahci_reap().
+* @param idx - device index in the device list
+* @return number of requests handed to the HBA
+*/
+uint64 ahci_submit(uint64 idx);
+/**
+* Reap completions in a batch
+* @param idx - device index in the device list
+* @param [out] cqe - completion entries to fill
+* @param max - maximum number of entries to return
+* @param min - block until at least this many completions are available
+* (or nothing is in flight anymore)
+* @return number of completion entries returned
+*/
+uint64 ahci_reap(uint64 idx, ahci_cqe_t *cqe, uint64 max, uint64 min);
+
+#if DEBUG == 1
+/**
+* List AHCI devices with their command mode and queue depth statistics
+*/
+void ahci_list();
+#endif
 
 #endif
@@ -159,6 +159,24 @@ void apic_set_base(apic_base_t addr){
 	msr_write(MSR_IA32_APIC_BASE, addr.raw);
 }
 
+uint64 apic_num_cpu(){
+	return _lapic_count;
+}
+uint64 apic_cpu_index(){
+	uint64 i;
+	uint8 id;
+	if (_lapic_count == 0){
+		return 0;
+	}
+	id = (uint8)(apic_read_reg(APIC_LAPIC_ID) >> 24);
+	for (i = 0; i < _lapic_count; i ++){
+		if (_lapic[i]->apic_id == id){
+			return i;
+		}
+	}
+	return 0;
+}
+
 uint32 apic_read_reg(uint64 reg){
 	uint32 volatile *apic = (uint32 volatile *)(_lapic_addr + reg);
 	return *apic;
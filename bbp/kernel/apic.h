@@ -90,6 +90,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define APIC_CURR_COUNT		0x0390 // Current Count Register (for Timer) (Read Only)
 #define APIC_DIV_CONF		0x03E0 // Divide Configuration Register (for Timer) (Read/Write)
 
+#define APIC_SIVR_ENABLE	0x100 // APIC Software Enable bit in SIVR
+#define APIC_MSI_ADDR		0xFEE00000 // MSI message address base (destination ID in bits 19:12)
+
 //
 // APIC entry types from ACPI MADT table
 //
@@ -136,6 +139,16 @@ apic_base_t apic_get_base();
 * @param addr - physical address of APIC memory maped registers
 */
 void apic_set_base(apic_base_t addr);
+/**
+* Get the number of enabled CPUs listed in MADT
+* @return CPU count or 0 if there is no APIC
+*/
+uint64 apic_num_cpu();
+/**
+* Get the index of the current CPU in MADT order
+* @return CPU index (0 if there is no APIC)
+*/
+uint64 apic_cpu_index();
 
 /**
 * Read Local APIC register
@@ -0,0 +1,798 @@
+/*
+
+Block buffer cache
+==================
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "lib.h"
+#include "paging.h"
+#include "block.h"
+#include "bcache.h"
+#if DEBUG == 1
+	#include "debug_print.h"
+#endif
+
+// Radix tree geometry
+#define BCACHE_RADIX_SHIFT	6
+#define BCACHE_RADIX_SLOTS	(1 << BCACHE_RADIX_SHIFT)
+#define BCACHE_RADIX_MASK	(BCACHE_RADIX_SLOTS - 1)
+#define BCACHE_RADIX_MAX_HEIGHT	11	// Enough for 64-bit keys
+
+// Queues
+#define BCACHE_Q_FREE		0	// Unused buffers
+#define BCACHE_Q_A1IN		1	// First reference (FIFO)
+#define BCACHE_Q_AM			2	// Re-referenced (LRU)
+#define BCACHE_Q_A1OUT		3	// Ghosts of blocks evicted from A1in (FIFO)
+#define BCACHE_Q_COUNT		4
+
+// Read-ahead
+#define BCACHE_RA_MIN		0x8000		// Initial window (32KiB, same as the MBR reads the BBP)
+#define BCACHE_RA_MAX		0x400000	// Largest window (4MiB, also limited by A1in size)
+#define BCACHE_RA_REQS		32			// Read-ahead requests in flight
+#define BCACHE_RA_SEGMENTS	64			// Blocks per read-ahead request
+#define BCACHE_STREAMS		8			// Sequential streams tracked
+
+/**
+* Radix tree node
+*/
+typedef struct bcache_node_struct bcache_node_t;
+struct bcache_node_struct {
+	void *slot[BCACHE_RADIX_SLOTS];	// Child nodes or buffers at the bottom level
+	uint64 count;					// Slots in use
+};
+/**
+* Radix tree root of a device
+*/
+typedef struct {
+	bcache_node_t *node;
+	uint8 height;					// Levels below the root (0 - empty tree)
+} bcache_root_t;
+/**
+* Buffer queue (head is the newest entry)
+*/
+typedef struct {
+	bcache_buf_t *head;
+	bcache_buf_t *tail;
+	uint64 count;
+} bcache_queue_t;
+/**
+* Read-ahead request - a run of consecutive blocks
+*/
+typedef struct {
+	block_req_t req;
+	block_sg_t sg[BCACHE_RA_SEGMENTS];
+	bcache_buf_t *buf[BCACHE_RA_SEGMENTS];
+	bool used;
+} bcache_ra_t;
+/**
+* Sequential stream
+*/
+typedef struct {
+	block_dev_t *dev;
+	uint64 next;					// Block the stream is expected to read next
+	uint64 ra_next;					// First block not read ahead yet
+	uint64 window;					// Read-ahead window in blocks (0 - not sequential yet)
+	uint64 stamp;					// Last use, for replacement
+} bcache_stream_t;
+
+static bcache_root_t _bcache_root[BLOCK_MAX_DEV];
+static bcache_queue_t _bcache_queue[BCACHE_Q_COUNT];
+static bcache_queue_t _bcache_ghost_free;
+static bcache_node_t *_bcache_node_free = null;
+static uint64 _bcache_kin = 0;		// A1in target size
+static uint64 _bcache_kout = 0;		// A1out size
+static bcache_stats_t _bcache_stats;
+static bool _bcache_ready = false;
+static bcache_ra_t *_bcache_ra = null;
+static bcache_stream_t _bcache_stream[BCACHE_STREAMS];
+static uint64 _bcache_stream_clock = 0;
+
+/**
+* Queue helpers
+*/
+static void bcache_queue_remove(bcache_queue_t *q, bcache_buf_t *buf){
+	if (buf->prev != null){
+		buf->prev->next = buf->next;
+	} else {
+		q->head = buf->next;
+	}
+	if (buf->next != null){
+		buf->next->prev = buf->prev;
+	} else {
+		q->tail = buf->prev;
+	}
+	buf->prev = null;
+	buf->next = null;
+	q->count --;
+}
+static void bcache_queue_push(bcache_queue_t *q, bcache_buf_t *buf){
+	buf->prev = null;
+	buf->next = q->head;
+	if (q->head != null){
+		q->head->prev = buf;
+	} else {
+		q->tail = buf;
+	}
+	q->head = buf;
+	q->count ++;
+}
+static void bcache_move(bcache_buf_t *buf, uint8 queue){
+	bcache_queue_remove(&_bcache_queue[buf->queue], buf);
+	buf->queue = queue;
+	bcache_queue_push(&_bcache_queue[queue], buf);
+}
+/**
+* Radix tree node allocation
+*/
+static bcache_node_t *bcache_node_alloc(){
+	bcache_node_t *node = _bcache_node_free;
+	if (node != null){
+		_bcache_node_free = (bcache_node_t *)node->slot[0];
+		mem_fill((uint8 *)node, sizeof(bcache_node_t), 0);
+		_bcache_stats.nodes ++;
+	}
+	return node;
+}
+static void bcache_node_free(bcache_node_t *node){
+	node->slot[0] = _bcache_node_free;
+	_bcache_node_free = node;
+	_bcache_stats.nodes --;
+}
+/**
+* Find a buffer in the index
+*/
+static bcache_buf_t *bcache_lookup(block_dev_t *dev, uint64 blk){
+	bcache_root_t *root = &_bcache_root[dev->idx];
+	bcache_node_t *node = root->node;
+	uint8 level;
+	if (root->height == 0 || (root->height * BCACHE_RADIX_SHIFT < 64 && (blk >> (root->height * BCACHE_RADIX_SHIFT)) != 0)){
+		return null;
+	}
+	for (level = root->height; level > 1 && node != null; level --){
+		node = (bcache_node_t *)node->slot[(blk >> ((level - 1) * BCACHE_RADIX_SHIFT)) & BCACHE_RADIX_MASK];
+	}
+	if (node == null){
+		return null;
+	}
+	return (bcache_buf_t *)node->slot[blk & BCACHE_RADIX_MASK];
+}
+/**
+* Add a buffer to the index
+* @return false if the tree ran out of nodes
+*/
+static bool bcache_insert(bcache_buf_t *buf){
+	bcache_root_t *root = &_bcache_root[buf->dev->idx];
+	bcache_node_t *node;
+	bcache_node_t *child;
+	uint64 idx;
+	uint8 level;
+	// Grow the tree until the key fits
+	while (root->height == 0 || (root->height * BCACHE_RADIX_SHIFT < 64 && (buf->blk >> (root->height * BCACHE_RADIX_SHIFT)) != 0)){
+		node = bcache_node_alloc();
+		if (node == null){
+			return false;
+		}
+		if (root->node != null){
+			node->slot[0] = root->node;
+			node->count = 1;
+		}
+		root->node = node;
+		root->height ++;
+	}
+	node = root->node;
+	for (level = root->height; level > 1; level --){
+		idx = (buf->blk >> ((level - 1) * BCACHE_RADIX_SHIFT)) & BCACHE_RADIX_MASK;
+		child = (bcache_node_t *)node->slot[idx];
+		if (child == null){
+			child = bcache_node_alloc();
+			if (child == null){
+				return false;
+			}
+			node->slot[idx] = child;
+			node->count ++;
+		}
+		node = child;
+	}
+	idx = buf->blk & BCACHE_RADIX_MASK;
+	if (node->slot[idx] == null){
+		node->count ++;
+	}
+	node->slot[idx] = buf;
+	return true;
+}
+/**
+* Remove a buffer from the index, freeing nodes that become empty
+*/
+static void bcache_remove(bcache_buf_t *buf){
+	bcache_root_t *root = &_bcache_root[buf->dev->idx];
+	bcache_node_t *path[BCACHE_RADIX_MAX_HEIGHT];
+	bcache_node_t *node = root->node;
+	uint8 level;
+	uint8 depth = 0;
+	uint64 idx;
+	if (bcache_lookup(buf->dev, buf->blk) != buf){
+		return;
+	}
+	for (level = root->height; level > 0; level --){
+		path[depth ++] = node;
+		if (level > 1){
+			node = (bcache_node_t *)node->slot[(buf->blk >> ((level - 1) * BCACHE_RADIX_SHIFT)) & BCACHE_RADIX_MASK];
+		}
+	}
+	// Walk back up, clearing the slot and any node left empty
+	for (level = 1; depth > 0; level ++){
+		node = path[-- depth];
+		idx = (buf->blk >> ((level - 1) * BCACHE_RADIX_SHIFT)) & BCACHE_RADIX_MASK;
+		node->slot[idx] = null;
+		node->count --;
+		if (node->count > 0){
+			return;
+		}
+		bcache_node_free(node);
+	}
+	root->node = null;
+	root->height = 0;
+}
+/**
+* Write a dirty buffer back to its device
+*/
+static bool bcache_writeback(bcache_buf_t *buf){
+	uint64 spb = BCACHE_BLOCK_SIZE / buf->dev->sector_size;
+	uint64 lba = buf->blk * spb;
+	uint64 count = spb;
+	if (lba + count > buf->dev->capacity){
+		count = buf->dev->capacity - lba;
+	}
+	if (!block_write(buf->dev, lba, count, buf->data)){
+		return false;
+	}
+	buf->dirty = false;
+	_bcache_stats.writebacks ++;
+	return true;
+}
+/**
+* Remember an evicted A1in block in the ghost queue
+*/
+static void bcache_ghost_add(block_dev_t *dev, uint64 blk){
+	bcache_buf_t *ghost;
+	if (_bcache_kout == 0){
+		return;
+	}
+	if (_bcache_ghost_free.count > 0){
+		ghost = _bcache_ghost_free.head;
+		bcache_queue_remove(&_bcache_ghost_free, ghost);
+	} else {
+		// Forget the oldest ghost
+		ghost = _bcache_queue[BCACHE_Q_A1OUT].tail;
+		bcache_queue_remove(&_bcache_queue[BCACHE_Q_A1OUT], ghost);
+		bcache_remove(ghost);
+	}
+	ghost->dev = dev;
+	ghost->blk = blk;
+	if (bcache_insert(ghost)){
+		ghost->queue = BCACHE_Q_A1OUT;
+		bcache_queue_push(&_bcache_queue[BCACHE_Q_A1OUT], ghost);
+	} else {
+		bcache_queue_push(&_bcache_ghost_free, ghost);
+	}
+}
+static void bcache_ghost_drop(bcache_buf_t *ghost){
+	bcache_remove(ghost);
+	bcache_queue_remove(&_bcache_queue[BCACHE_Q_A1OUT], ghost);
+	bcache_queue_push(&_bcache_ghost_free, ghost);
+}
+/**
+* Find the oldest unpinned buffer of a queue
+*/
+static bcache_buf_t *bcache_victim(uint8 queue){
+	bcache_buf_t *buf = _bcache_queue[queue].tail;
+	while (buf != null && buf->refs > 0){
+		buf = buf->prev;
+	}
+	return buf;
+}
+/**
+* Get a buffer for a new block - free one or evict following 2Q:
+* A1in gives up its oldest block (remembered as a ghost) when it is
+* above its target size, Am gives up its least recently used otherwise.
+* @return detached buffer or null if every buffer is pinned
+*/
+static bcache_buf_t *bcache_reclaim(){
+	bcache_buf_t *buf = null;
+	bool a1in = false;
+	if (_bcache_queue[BCACHE_Q_FREE].count > 0){
+		buf = _bcache_queue[BCACHE_Q_FREE].tail;
+		bcache_queue_remove(&_bcache_queue[BCACHE_Q_FREE], buf);
+		_bcache_stats.used ++;
+		return buf;
+	}
+	if (_bcache_queue[BCACHE_Q_A1IN].count > _bcache_kin){
+		buf = bcache_victim(BCACHE_Q_A1IN);
+		a1in = (buf != null);
+	}
+	if (buf == null){
+		buf = bcache_victim(BCACHE_Q_AM);
+	}
+	if (buf == null){
+		buf = bcache_victim(BCACHE_Q_A1IN);
+		a1in = (buf != null);
+	}
+	if (buf == null){
+		return null;
+	}
+	if (buf->dirty && !bcache_writeback(buf)){
+		return null;
+	}
+	bcache_queue_remove(&_bcache_queue[buf->queue], buf);
+	bcache_remove(buf);
+	if (a1in){
+		bcache_ghost_add(buf->dev, buf->blk);
+	}
+	_bcache_stats.evictions ++;
+	return buf;
+}
+
+/**
+* Read-ahead completion - unpin the buffers
+*/
+static void bcache_ra_done(block_req_t *req){
+	bcache_ra_t *ra = (bcache_ra_t *)req->priv;
+	uint64 i;
+	for (i = 0; i < req->sg_count; i ++){
+		ra->buf[i]->valid = req->ok;
+		ra->buf[i]->busy = false;
+		ra->buf[i]->refs --;
+	}
+	ra->used = false;
+}
+/**
+* Send a read-ahead request
+*/
+static void bcache_ra_submit(bcache_ra_t *ra, uint64 sg_count){
+	block_dev_t *dev = ra->buf[0]->dev;
+	uint64 spb = BCACHE_BLOCK_SIZE / dev->sector_size;
+	uint64 lba = ra->buf[0]->blk * spb;
+	mem_fill((uint8 *)&ra->req, sizeof(block_req_t), 0);
+	ra->req.op = BLOCK_OP_READ;
+	ra->req.lba = lba;
+	ra->req.count = spb * sg_count;
+	if (lba + ra->req.count > dev->capacity){
+		// Partial block at the end of the device
+		ra->req.count = dev->capacity - lba;
+		ra->sg[sg_count - 1].len -= ((spb * sg_count) - ra->req.count) * dev->sector_size;
+	}
+	ra->req.sg = ra->sg;
+	ra->req.sg_count = sg_count;
+	ra->req.done = bcache_ra_done;
+	ra->req.priv = ra;
+	_bcache_stats.ra_blocks += sg_count;
+	if (!block_submit(dev, &ra->req)){
+		block_complete(&ra->req, false);
+	}
+}
+/**
+* Start asynchronous reads of blocks that are not cached yet
+* @param dev - block device
+* @param blk - first block
+* @param count - number of blocks
+* @return number of blocks dealt with (less than count if out of buffers
+* or requests)
+*/
+static uint64 bcache_prefetch(block_dev_t *dev, uint64 blk, uint64 count){
+	uint64 spb = BCACHE_BLOCK_SIZE / dev->sector_size;
+	uint64 max = BCACHE_RA_SEGMENTS;
+	uint64 done = 0;
+	uint64 n = 0;
+	uint64 i;
+	uint8 queue;
+	bcache_ra_t *ra = null;
+	bcache_buf_t *buf;
+	if (dev->max_segments != 0 && dev->max_segments < max){
+		max = dev->max_segments;
+	}
+	// Let the scheduler sort and merge the whole window
+	block_plug(dev);
+	for (; done < count && blk * spb < dev->capacity; blk ++, done ++){
+		buf = bcache_lookup(dev, blk);
+		queue = BCACHE_Q_A1IN;
+		if (buf != null && buf->queue != BCACHE_Q_A1OUT){
+			// Cached block ends the run
+			if (n > 0){
+				bcache_ra_submit(ra, n);
+				ra = null;
+				n = 0;
+			}
+			continue;
+		}
+		if (ra == null){
+			for (i = 0; i < BCACHE_RA_REQS && _bcache_ra[i].used; i ++);
+			if (i == BCACHE_RA_REQS){
+				break;
+			}
+			ra = &_bcache_ra[i];
+			ra->used = true;
+		}
+		if (buf != null){
+			bcache_ghost_drop(buf);
+			queue = BCACHE_Q_AM;
+		}
+		buf = bcache_reclaim();
+		if (buf == null){
+			break;
+		}
+		buf->dev = dev;
+		buf->blk = blk;
+		buf->refs = 1;
+		buf->valid = false;
+		buf->dirty = false;
+		buf->busy = true;
+		buf->ahead = true;
+		if (!bcache_insert(buf)){
+			buf->refs = 0;
+			buf->busy = false;
+			buf->queue = BCACHE_Q_FREE;
+			bcache_queue_push(&_bcache_queue[BCACHE_Q_FREE], buf);
+			_bcache_stats.used --;
+			break;
+		}
+		buf->queue = queue;
+		bcache_queue_push(&_bcache_queue[queue], buf);
+		if ((blk + 1) * spb > dev->capacity){
+			mem_fill(buf->data, BCACHE_BLOCK_SIZE, 0);
+		}
+		ra->sg[n].addr = (uint64)buf->data;
+		ra->sg[n].len = BCACHE_BLOCK_SIZE;
+		ra->buf[n] = buf;
+		n ++;
+		if (n == max){
+			bcache_ra_submit(ra, n);
+			ra = null;
+			n = 0;
+		}
+	}
+	if (n > 0){
+		bcache_ra_submit(ra, n);
+	} else if (ra != null){
+		ra->used = false;
+	}
+	block_unplug(dev);
+	return done;
+}
+/**
+* Track sequential streams and keep the read-ahead at least half
+* a window in front of the reader. The window starts at BCACHE_RA_MIN
+* on the second sequential read and doubles every time it is refilled.
+* @param dev - block device
+* @param first - first block read
+* @param last - last block read
+*/
+static void bcache_readahead(block_dev_t *dev, uint64 first, uint64 last){
+	bcache_stream_t *s = null;
+	uint64 max = BCACHE_RA_MAX / BCACHE_BLOCK_SIZE;
+	uint64 lead;
+	uint64 i;
+	_bcache_stream_clock ++;
+	for (i = 0; i < BCACHE_STREAMS; i ++){
+		// Small reads may hit the last block of the previous one again
+		if (_bcache_stream[i].dev == dev && first <= _bcache_stream[i].next && first + 1 >= _bcache_stream[i].next){
+			s = &_bcache_stream[i];
+			break;
+		}
+	}
+	if (s == null){
+		// New stream replaces the least recently used one
+		s = &_bcache_stream[0];
+		for (i = 1; i < BCACHE_STREAMS; i ++){
+			if (_bcache_stream[i].stamp < s->stamp){
+				s = &_bcache_stream[i];
+			}
+		}
+		s->dev = dev;
+		s->next = last + 1;
+		s->ra_next = last + 1;
+		s->window = 0;
+		s->stamp = _bcache_stream_clock;
+		return;
+	}
+	s->stamp = _bcache_stream_clock;
+	s->next = last + 1;
+	if (s->ra_next < s->next){
+		s->ra_next = s->next;
+	}
+	lead = s->ra_next - s->next;
+	if (lead > s->window / 2){
+		return;
+	}
+	// Read-ahead must not outgrow the FIFO it is cached in
+	if (max > _bcache_kin){
+		max = _bcache_kin;
+	}
+	s->window = (s->window == 0 ? BCACHE_RA_MIN / BCACHE_BLOCK_SIZE : s->window * 2);
+	if (s->window > max){
+		s->window = max;
+	}
+	if (s->window > lead){
+		s->ra_next += bcache_prefetch(dev, s->ra_next, s->window - lead);
+	}
+}
+
+bool bcache_init(uint64 size){
+	uint64 count = size / BCACHE_BLOCK_SIZE;
+	uint64 ghosts = count / 2;
+	uint64 nodes = count * 2;
+	uint8 *data;
+	bcache_buf_t *bufs;
+	bcache_node_t *pool;
+	uint64 i;
+	if (count == 0){
+		return false;
+	}
+	data = (uint8 *)page_reserve(count * BCACHE_BLOCK_SIZE);
+	bufs = (bcache_buf_t *)page_reserve((count + ghosts) * sizeof(bcache_buf_t));
+	pool = (bcache_node_t *)page_reserve(nodes * sizeof(bcache_node_t));
+	_bcache_ra = (bcache_ra_t *)page_reserve(BCACHE_RA_REQS * sizeof(bcache_ra_t));
+	mem_fill((uint8 *)_bcache_stream, sizeof(_bcache_stream), 0);
+	mem_fill((uint8 *)_bcache_root, sizeof(_bcache_root), 0);
+	mem_fill((uint8 *)_bcache_queue, sizeof(_bcache_queue), 0);
+	mem_fill((uint8 *)&_bcache_ghost_free, sizeof(bcache_queue_t), 0);
+	mem_fill((uint8 *)&_bcache_stats, sizeof(bcache_stats_t), 0);
+	for (i = 0; i < count; i ++){
+		bufs[i].data = data + (i * BCACHE_BLOCK_SIZE);
+		bufs[i].queue = BCACHE_Q_FREE;
+		bcache_queue_push(&_bcache_queue[BCACHE_Q_FREE], &bufs[i]);
+	}
+	for (i = count; i < count + ghosts; i ++){
+		bufs[i].queue = BCACHE_Q_A1OUT;
+		bcache_queue_push(&_bcache_ghost_free, &bufs[i]);
+	}
+	_bcache_node_free = null;
+	for (i = 0; i < nodes; i ++){
+		pool[i].slot[0] = _bcache_node_free;
+		_bcache_node_free = &pool[i];
+	}
+	// 2Q tuning from the paper: Kin 25% of the cache, Kout 50%
+	_bcache_kin = count / 4;
+	_bcache_kout = ghosts;
+	_bcache_stats.size = count * BCACHE_BLOCK_SIZE;
+	_bcache_ready = true;
+	return true;
+}
+
+bcache_buf_t *bcache_get(block_dev_t *dev, uint64 blk){
+	bcache_buf_t *buf;
+	uint8 queue = BCACHE_Q_A1IN;
+	uint64 spb;
+	uint64 lba;
+	uint64 count;
+	if (!_bcache_ready || dev->sector_size > BCACHE_BLOCK_SIZE){
+		return null;
+	}
+	spb = BCACHE_BLOCK_SIZE / dev->sector_size;
+	lba = blk * spb;
+	if (lba >= dev->capacity){
+		return null;
+	}
+	buf = bcache_lookup(dev, blk);
+	if (buf != null && buf->queue != BCACHE_Q_A1OUT){
+		_bcache_stats.hits ++;
+		// Re-used blocks move to the front of Am, A1in is a plain FIFO
+		if (buf->queue == BCACHE_Q_AM){
+			bcache_move(buf, BCACHE_Q_AM);
+		}
+		buf->refs ++;
+		if (buf->busy){
+			_bcache_stats.ra_waits ++;
+			while (buf->busy){
+				block_poll(dev, true);
+			}
+		}
+		if (buf->ahead){
+			buf->ahead = false;
+			_bcache_stats.ra_hits ++;
+		}
+		if (!buf->valid){
+			// Read-ahead failed - try again synchronously
+			count = spb;
+			if (lba + count > dev->capacity){
+				count = dev->capacity - lba;
+			}
+			if (!block_read(dev, lba, count, buf->data)){
+				buf->refs --;
+				return null;
+			}
+			buf->valid = true;
+		}
+		return buf;
+	}
+	_bcache_stats.misses ++;
+	if (buf != null){
+		// Evicted not long ago - this block is worth keeping around
+		_bcache_stats.ghost_hits ++;
+		bcache_ghost_drop(buf);
+		queue = BCACHE_Q_AM;
+	}
+	buf = bcache_reclaim();
+	if (buf == null){
+		return null;
+	}
+	buf->dev = dev;
+	buf->blk = blk;
+	buf->refs = 1;
+	buf->valid = false;
+	buf->dirty = false;
+	buf->busy = false;
+	buf->ahead = false;
+	count = spb;
+	if (lba + count > dev->capacity){
+		count = dev->capacity - lba;
+		mem_fill(buf->data, BCACHE_BLOCK_SIZE, 0);
+	}
+	if (!block_read(dev, lba, count, buf->data)){
+		buf->refs = 0;
+		buf->queue = BCACHE_Q_FREE;
+		bcache_queue_push(&_bcache_queue[BCACHE_Q_FREE], buf);
+		_bcache_stats.used --;
+		return null;
+	}
+	buf->valid = true;
+	buf->queue = queue;
+	bcache_queue_push(&_bcache_queue[queue], buf);
+	if (!bcache_insert(buf)){
+		// Out of index nodes - hand the data out uncached
+		bcache_queue_remove(&_bcache_queue[queue], buf);
+		buf->queue = BCACHE_Q_FREE;
+	}
+	return buf;
+}
+
+void bcache_put(bcache_buf_t *buf){
+	if (buf->refs > 0){
+		buf->refs --;
+	}
+	if (buf->refs == 0 && buf->queue == BCACHE_Q_FREE){
+		// Uncached buffer goes back to the free list
+		if (buf->dirty){
+			bcache_writeback(buf);
+		}
+		bcache_queue_push(&_bcache_queue[BCACHE_Q_FREE], buf);
+		_bcache_stats.used --;
+	}
+}
+
+void bcache_dirty(bcache_buf_t *buf){
+	buf->dirty = true;
+}
+
+bool bcache_read(block_dev_t *dev, uint64 lba, uint64 count, uint8 *buff){
+	uint64 spb;
+	uint64 first;
+	uint64 offset;
+	uint64 n;
+	bcache_buf_t *buf;
+	if (!_bcache_ready || dev->sector_size > BCACHE_BLOCK_SIZE){
+		return block_read(dev, lba, count, buff);
+	}
+	if (count == 0 || lba + count > dev->capacity){
+		return false;
+	}
+	spb = BCACHE_BLOCK_SIZE / dev->sector_size;
+	first = lba / spb;
+	while (count > 0){
+		offset = lba % spb;
+		n = spb - offset;
+		if (n > count){
+			n = count;
+		}
+		buf = bcache_get(dev, lba / spb);
+		if (buf == null){
+			return false;
+		}
+		mem_copy(buff, n * dev->sector_size, buf->data + (offset * dev->sector_size));
+		bcache_put(buf);
+		buff += n * dev->sector_size;
+		lba += n;
+		count -= n;
+	}
+	bcache_readahead(dev, first, (lba - 1) / spb);
+	return true;
+}
+
+bool bcache_write(block_dev_t *dev, uint64 lba, uint64 count, uint8 *buff){
+	uint64 spb;
+	uint64 offset;
+	uint64 n;
+	bcache_buf_t *buf;
+	if (!block_write(dev, lba, count, buff)){
+		return false;
+	}
+	if (!_bcache_ready || dev->sector_size > BCACHE_BLOCK_SIZE){
+		return true;
+	}
+	// Update blocks that are cached, don't pull in new ones
+	spb = BCACHE_BLOCK_SIZE / dev->sector_size;
+	while (count > 0){
+		offset = lba % spb;
+		n = spb - offset;
+		if (n > count){
+			n = count;
+		}
+		buf = bcache_lookup(dev, lba / spb);
+		if (buf != null && buf->queue != BCACHE_Q_A1OUT){
+			// Wait for read-ahead so it doesn't overwrite the new data
+			while (buf->busy){
+				block_poll(dev, true);
+			}
+			mem_copy(buf->data + (offset * dev->sector_size), n * dev->sector_size, buff);
+		}
+		buff += n * dev->sector_size;
+		lba += n;
+		count -= n;
+	}
+	return true;
+}
+
+bool bcache_sync(block_dev_t *dev){
+	bcache_buf_t *buf;
+	bool ok = true;
+	uint8 q;
+	for (q = BCACHE_Q_A1IN; q <= BCACHE_Q_AM; q ++){
+		for (buf = _bcache_queue[q].head; buf != null; buf = buf->next){
+			if (buf->dev == dev && buf->dirty && !bcache_writeback(buf)){
+				ok = false;
+			}
+		}
+	}
+	if (dev->ops->flush != null && !block_flush(dev)){
+		ok = false;
+	}
+	return ok;
+}
+
+void bcache_get_stats(bcache_stats_t *stats){
+	mem_copy((uint8 *)stats, sizeof(bcache_stats_t), (uint8 *)&_bcache_stats);
+}
+
+#if DEBUG == 1
+void bcache_list(){
+	uint64 lookups = _bcache_stats.hits + _bcache_stats.misses;
+	debug_print(DC_WB, "bcache: %uKB, used:%u, a1in:%u, am:%u, ghosts:%u, nodes:%u",
+		_bcache_stats.size / 1024, _bcache_stats.used, _bcache_queue[BCACHE_Q_A1IN].count,
+		_bcache_queue[BCACHE_Q_AM].count, _bcache_queue[BCACHE_Q_A1OUT].count, _bcache_stats.nodes);
+	debug_print(DC_WB, "     hits:%u, misses:%u (ghost:%u), hit rate:%u%, evicted:%u, written back:%u",
+		_bcache_stats.hits, _bcache_stats.misses, _bcache_stats.ghost_hits,
+		(lookups > 0 ? _bcache_stats.hits * 100 / lookups : 0), _bcache_stats.evictions, _bcache_stats.writebacks);
+	debug_print(DC_WB, "     read-ahead:%u, used:%u, waited:%u",
+		_bcache_stats.ra_blocks, _bcache_stats.ra_hits, _bcache_stats.ra_waits);
+}
+#endif
@@ -0,0 +1,148 @@
+/*
+
+Block buffer cache
+==================
+
+Block sized buffers of any block device, indexed with a radix tree per
+device and evicted with 2Q (FIFO for first references, LRU for re-used
+blocks, ghost FIFO to remember recently evicted first references).
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef __bcache_h
+#define __bcache_h
+
+#include "common.h"
+#include "../config.h"
+#include "block.h"
+
+// Cache block size (bytes)
+#define BCACHE_BLOCK_SIZE	0x1000
+
+typedef struct bcache_buf_struct bcache_buf_t;
+
+/**
+* Cached block
+*/
+struct bcache_buf_struct {
+	block_dev_t *dev;			// Device
+	uint64 blk;					// Block number (BCACHE_BLOCK_SIZE units)
+	uint8 *data;				// Block data (null for ghost entries)
+	uint64 refs;				// Pin count - pinned buffers are never evicted
+	uint8 queue;				// Queue the buffer is on
+	bool valid;					// Data has been read from the device
+	bool dirty;					// Data has to be written back
+	volatile bool busy;			// Read-ahead in flight (holds a reference)
+	bool ahead;					// Read ahead and not used yet
+	bcache_buf_t *prev;			// Queue links
+	bcache_buf_t *next;
+};
+/**
+* Cache counters
+*/
+typedef struct {
+	uint64 size;				// Cache size in bytes
+	uint64 used;				// Buffers holding a block
+	uint64 hits;				// Lookups served from the cache
+	uint64 misses;				// Lookups that went to the device
+	uint64 ghost_hits;			// Misses on recently evicted blocks
+	uint64 evictions;			// Buffers reclaimed
+	uint64 writebacks;			// Dirty buffers written back
+	uint64 nodes;				// Radix tree nodes in use
+	uint64 ra_blocks;			// Blocks read ahead
+	uint64 ra_hits;				// Read-ahead blocks used
+	uint64 ra_waits;			// Lookups that had to wait for a read-ahead
+} bcache_stats_t;
+
+/**
+* Initialize the buffer cache
+* @param size - cache size in bytes
+* @return false if there's no memory for it
+*/
+bool bcache_init(uint64 size);
+/**
+* Get a pinned cache block, reading it from the device if needed
+* @param dev - block device (sector size up to BCACHE_BLOCK_SIZE)
+* @param blk - block number (BCACHE_BLOCK_SIZE units)
+* @return buffer or null on read error or if every buffer is pinned
+*/
+bcache_buf_t *bcache_get(block_dev_t *dev, uint64 blk);
+/**
+* Release a buffer returned by bcache_get()
+* @param buf - buffer
+*/
+void bcache_put(bcache_buf_t *buf);
+/**
+* Mark a pinned buffer modified - it will be written back on eviction
+* or by bcache_sync()
+* @param buf - buffer
+*/
+void bcache_dirty(bcache_buf_t *buf);
+/**
+* Read sectors through the cache
+* Sequential streams are detected and read ahead of the reader
+* @param dev - block device
+* @param lba - first sector
+* @param count - number of sectors
+* @param [out] buff - destination buffer
+* @return false on failure
+*/
+bool bcache_read(block_dev_t *dev, uint64 lba, uint64 count, uint8 *buff);
+/**
+* Write sectors to the device and update cached copies (write-through)
+* @param dev - block device
+* @param lba - first sector
+* @param count - number of sectors
+* @param [in] buff - source buffer
+* @return false on failure
+*/
+bool bcache_write(block_dev_t *dev, uint64 lba, uint64 count, uint8 *buff);
+/**
+* Write back dirty buffers of a device and flush the device cache
+* @param dev - block device
+* @return false if any of the writes failed
+*/
+bool bcache_sync(block_dev_t *dev);
+/**
+* Get cache counters
+* @param [out] stats - counters
+*/
+void bcache_get_stats(bcache_stats_t *stats);
+
+#if DEBUG == 1
+/**
+* Print cache size, hit rate and eviction counters
+*/
+void bcache_list();
+#endif
+
+#endif /* __bcache_h */
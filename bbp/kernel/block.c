@@ -0,0 +1,365 @@
+/*
+
+Block device layer
+==================
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "lib.h"
+#include "timer.h"
+#include "block.h"
+#include "iosched.h"
+#if DEBUG == 1
+	#include "debug_print.h"
+#endif
+
+// Registered devices
+static block_dev_t _block_dev[BLOCK_MAX_DEV];
+static uint64 _block_dev_count = 0;
+
+/**
+* Compare device name
+*/
+static bool block_name_equal(const char *a, const char *b){
+	uint64 len = str_length(a);
+	if (len != str_length(b)){
+		return false;
+	}
+	return mem_compare((const uint8 *)a, (const uint8 *)b, len);
+}
+/**
+* Add to a counter without a lock - completions may be reaped on
+* another CPU than the one that submitted
+*/
+static void block_stat_add(uint64 *counter, uint64 val){
+	asm volatile ("lock addq %1, %0" : "+m"(*counter) : "r"(val));
+}
+/**
+* Get the log2 bucket of a value (0 and 1 share bucket 0)
+*/
+static uint64 block_stat_bucket(uint64 val, uint64 buckets){
+	uint64 bit = 0;
+	if (val > 1){
+		asm ("bsrq %1, %0" : "=r"(bit) : "r"(val));
+	}
+	return (bit < buckets ? bit : buckets - 1);
+}
+/**
+* Account a request going out
+*/
+static void block_stat_submit(block_dev_t *dev, block_req_t *req){
+	block_stats_t *s = &dev->stats;
+	uint64 depth;
+	req->dev = dev;
+	req->start = timer_ticks();
+	block_stat_add(&s->in_flight, 1);
+	depth = s->in_flight;
+	block_stat_add(&s->depth_sum, depth);
+	block_stat_add(&s->depth[block_stat_bucket(depth, BLOCK_DEPTH_BUCKETS)], 1);
+	if (depth > s->depth_max){
+		s->depth_max = depth;
+	}
+}
+/**
+* Account a completed request
+*/
+static void block_stat_complete(block_req_t *req){
+	block_dev_t *dev = req->dev;
+	block_stats_t *s = &dev->stats;
+	uint64 lat = timer_ticks() - req->start;
+	uint8 op = (req->op == BLOCK_OP_WRITE ? BLOCK_OP_WRITE : BLOCK_OP_READ);
+	// Counted once even if the request is completed again without a submit
+	req->dev = null;
+	block_stat_add(&s->in_flight, (uint64)-1);
+	if (!req->ok){
+		block_stat_add(&s->errors, 1);
+		return;
+	}
+	block_stat_add(&s->ops[op], 1);
+	block_stat_add(&s->bytes[op], req->count * dev->sector_size);
+	block_stat_add(&s->lat_sum[op], lat);
+	block_stat_add(&s->lat[op][block_stat_bucket(lat, BLOCK_LAT_BUCKETS)], 1);
+	if (lat > s->lat_max[op]){
+		s->lat_max[op] = lat;
+	}
+}
+
+block_dev_t *block_register(const char *name, block_ops_t *ops, uint64 sector_size, uint64 capacity, uint64 queue_depth, void *priv){
+	block_dev_t *dev;
+	if (_block_dev_count >= BLOCK_MAX_DEV || ops == null || ops->submit == null || ops->poll == null || sector_size == 0){
+		return null;
+	}
+	dev = &_block_dev[_block_dev_count];
+	mem_fill((uint8 *)dev, sizeof(block_dev_t), 0);
+	str_copy(dev->name, BLOCK_NAME_LEN - 1, name);
+	dev->idx = _block_dev_count;
+	dev->ops = ops;
+	dev->sector_size = sector_size;
+	dev->phys_sector_size = sector_size;
+	dev->capacity = capacity;
+	dev->queue_depth = (queue_depth > 0 ? queue_depth : 1);
+	dev->priv = priv;
+	dev->stats.since = timer_ticks();
+	_block_dev_count ++;
+	if (dev->queue_depth > 1){
+		iosched_attach(dev);
+	}
+	return dev;
+}
+
+uint64 block_num_dev(){
+	return _block_dev_count;
+}
+
+block_dev_t *block_get(uint64 idx){
+	if (idx < _block_dev_count){
+		return &_block_dev[idx];
+	}
+	return null;
+}
+
+block_dev_t *block_find(const char *name){
+	uint64 i;
+	for (i = 0; i < _block_dev_count; i ++){
+		if (block_name_equal(_block_dev[i].name, name)){
+			return &_block_dev[i];
+		}
+	}
+	return null;
+}
+
+bool block_submit(block_dev_t *dev, block_req_t *req){
+	uint64 len = 0;
+	uint64 i;
+	req->complete = false;
+	req->ok = false;
+	// Validate the range and the buffers
+	if (req->count == 0 || req->lba + req->count > dev->capacity || req->lba + req->count < req->lba){
+		return false;
+	}
+	for (i = 0; i < req->sg_count; i ++){
+		len += req->sg[i].len;
+	}
+	if (len != req->count * dev->sector_size || (dev->max_segments != 0 && req->sg_count > dev->max_segments)
+		|| (dev->max_sectors != 0 && req->count > dev->max_sectors)){
+		return false;
+	}
+	block_stat_submit(dev, req);
+	if (dev->sched != null){
+		iosched_add(dev, req);
+		return true;
+	}
+	// Wait for room in the device queue
+	while (!dev->ops->submit(dev, req)){
+		dev->ops->poll(dev, true);
+	}
+	if (dev->ops->commit != null){
+		dev->ops->commit(dev);
+	}
+	return true;
+}
+
+void block_plug(block_dev_t *dev){
+	if (dev->sched != null){
+		iosched_plug(dev);
+	}
+}
+
+void block_unplug(block_dev_t *dev){
+	if (dev->sched != null){
+		iosched_unplug(dev);
+	}
+}
+
+void block_complete(block_req_t *req, bool ok){
+	req->ok = ok;
+	// Driver internal requests were never submitted
+	if (req->dev != null){
+		block_stat_complete(req);
+	}
+	req->complete = true;
+	if (req->done != null){
+		req->done(req);
+	}
+}
+
+void block_poll(block_dev_t *dev, bool wait){
+	dev->ops->poll(dev, wait);
+}
+
+bool block_wait(block_dev_t *dev, block_req_t *req){
+	while (!req->complete){
+		// Don't wait on a request that is held back by a plug
+		if (dev->sched != null){
+			iosched_kick(dev);
+		}
+		dev->ops->poll(dev, true);
+	}
+	return req->ok;
+}
+
+/**
+* Synchronous single buffer transfer
+*/
+static bool block_transfer(block_dev_t *dev, uint8 op, uint8 flags, uint64 lba, uint64 count, uint8 *buff){
+	block_req_t req;
+	block_sg_t sg;
+	mem_fill((uint8 *)&req, sizeof(block_req_t), 0);
+	sg.addr = (uint64)buff;
+	sg.len = count * dev->sector_size;
+	req.op = op;
+	req.flags = flags;
+	req.lba = lba;
+	req.count = count;
+	req.sg = &sg;
+	req.sg_count = 1;
+	if (!block_submit(dev, &req)){
+		return false;
+	}
+	return block_wait(dev, &req);
+}
+
+bool block_read(block_dev_t *dev, uint64 lba, uint64 count, uint8 *buff){
+	return block_transfer(dev, BLOCK_OP_READ, 0, lba, count, buff);
+}
+
+bool block_write(block_dev_t *dev, uint64 lba, uint64 count, uint8 *buff){
+	return block_transfer(dev, BLOCK_OP_WRITE, 0, lba, count, buff);
+}
+
+bool block_write_fua(block_dev_t *dev, uint64 lba, uint64 count, uint8 *buff){
+	return block_transfer(dev, BLOCK_OP_WRITE, BLOCK_REQ_FUA, lba, count, buff);
+}
+
+bool block_flush(block_dev_t *dev){
+	if (dev->ops->flush == null){
+		return false;
+	}
+	block_stat_add(&dev->stats.flushes, 1);
+	return dev->ops->flush(dev);
+}
+
+bool block_discard(block_dev_t *dev, uint64 lba, uint64 count){
+	if (dev->ops->discard == null || count == 0 || lba + count > dev->capacity){
+		return false;
+	}
+	block_stat_add(&dev->stats.discards, 1);
+	return dev->ops->discard(dev, lba, count);
+}
+
+void block_get_stats(block_dev_t *dev, block_stats_t *stats){
+	mem_copy((uint8 *)stats, sizeof(block_stats_t), (uint8 *)&dev->stats);
+}
+
+void block_reset_stats(block_dev_t *dev){
+	uint64 in_flight = dev->stats.in_flight;
+	mem_fill((uint8 *)&dev->stats, sizeof(block_stats_t), 0);
+	dev->stats.in_flight = in_flight;
+	dev->stats.since = timer_ticks();
+}
+
+uint64 block_latency_pct(block_dev_t *dev, uint8 op, uint64 pct){
+	block_stats_t *s = &dev->stats;
+	uint64 total = 0;
+	uint64 sum = 0;
+	uint64 i;
+	op = (op == BLOCK_OP_WRITE ? BLOCK_OP_WRITE : BLOCK_OP_READ);
+	for (i = 0; i < BLOCK_LAT_BUCKETS; i ++){
+		total += s->lat[op][i];
+	}
+	if (total == 0){
+		return 0;
+	}
+	for (i = 0; i < BLOCK_LAT_BUCKETS; i ++){
+		sum += s->lat[op][i];
+		if (sum * 100 >= total * pct){
+			break;
+		}
+	}
+	// Nothing took longer than the slowest request
+	if (((uint64)1 << (i + 1)) > s->lat_max[op]){
+		return timer_ticks_to_us(s->lat_max[op]);
+	}
+	return timer_ticks_to_us((uint64)1 << (i + 1));
+}
+
+#if DEBUG == 1
+void block_list(){
+	uint64 i;
+	block_dev_t *dev;
+	for (i = 0; i < _block_dev_count; i ++){
+		dev = &_block_dev[i];
+		debug_print(DC_WB, "%s: %uMB, sector:%u/%u, depth:%u", dev->name, (dev->capacity * dev->sector_size) / 1024 / 1024, dev->sector_size, dev->phys_sector_size, dev->queue_depth);
+	}
+}
+void block_stats_list(){
+	uint64 i;
+	uint64 us;
+	uint64 ops;
+	uint64 samples;
+	uint64 avg;
+	uint64 j;
+	block_dev_t *dev;
+	block_stats_t *s;
+	for (i = 0; i < _block_dev_count; i ++){
+		dev = &_block_dev[i];
+		s = &dev->stats;
+		ops = s->ops[BLOCK_OP_READ] + s->ops[BLOCK_OP_WRITE];
+		if (ops + s->errors == 0){
+			continue;
+		}
+		us = timer_ticks_to_us(timer_ticks() - s->since);
+		if (us == 0){
+			us = 1;
+		}
+		// Average depth in tenths
+		samples = 0;
+		for (j = 0; j < BLOCK_DEPTH_BUCKETS; j ++){
+			samples += s->depth[j];
+		}
+		avg = (samples > 0 ? (s->depth_sum * 10) / samples : 0);
+		debug_print(DC_WB, "%s: reads:%u (%uKB), writes:%u (%uKB), errors:%u, flushes:%u, discards:%u",
+			dev->name, s->ops[BLOCK_OP_READ], s->bytes[BLOCK_OP_READ] / 1024,
+			s->ops[BLOCK_OP_WRITE], s->bytes[BLOCK_OP_WRITE] / 1024, s->errors, s->flushes, s->discards);
+		debug_print(DC_WB, "     IOPS:%u, KB/s:%u, depth avg:%u.%u max:%u now:%u, depth log2:%u/%u/%u/%u/%u/%u/%u/%u",
+			(ops * 1000000) / us, ((s->bytes[BLOCK_OP_READ] + s->bytes[BLOCK_OP_WRITE]) * 1000000 / 1024) / us,
+			avg / 10, avg % 10, s->depth_max, s->in_flight,
+			s->depth[0], s->depth[1], s->depth[2], s->depth[3], s->depth[4], s->depth[5], s->depth[6], s->depth[7]);
+		debug_print(DC_WB, "     read us p50:%u p90:%u p99:%u max:%u, write us p50:%u p90:%u p99:%u max:%u",
+			block_latency_pct(dev, BLOCK_OP_READ, 50), block_latency_pct(dev, BLOCK_OP_READ, 90),
+			block_latency_pct(dev, BLOCK_OP_READ, 99), timer_ticks_to_us(s->lat_max[BLOCK_OP_READ]),
+			block_latency_pct(dev, BLOCK_OP_WRITE, 50), block_latency_pct(dev, BLOCK_OP_WRITE, 90),
+			block_latency_pct(dev, BLOCK_OP_WRITE, 99), timer_ticks_to_us(s->lat_max[BLOCK_OP_WRITE]));
+	}
+}
+#endif
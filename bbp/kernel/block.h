@@ -0,0 +1,320 @@
+/*
+
+Block device layer
+==================
+
+Generic block device interface. Drivers (AHCI, RAM disk, ...) register
+a device with an operation table, everything above (caches, partitions,
+benchmarks) talks to the block layer only.
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef __block_h
+#define __block_h
+
+#include "common.h"
+#include "../config.h"
+
+// Maximum number of block devices
+#define BLOCK_MAX_DEV		32
+// Maximum block device name length (including terminating zero)
+#define BLOCK_NAME_LEN		16
+
+// Request operations
+#define BLOCK_OP_READ		0
+#define BLOCK_OP_WRITE		1
+
+// Request flags
+#define BLOCK_REQ_FUA		(1 << 0)	// Write reaches persistent media before it completes
+#define BLOCK_REQ_BARRIER	(1 << 1)	// Starts after all earlier requests completed, later ones start after it
+
+// Statistics histograms (log2 buckets)
+#define BLOCK_LAT_BUCKETS	48			// Latency in TSC ticks
+#define BLOCK_DEPTH_BUCKETS	8			// Requests in flight (1, 2-3, 4-7, ... 128+)
+
+typedef struct block_dev_struct block_dev_t;
+typedef struct block_req_struct block_req_t;
+
+/**
+* Scatter-gather entry
+*/
+typedef struct {
+	uint64 addr;				// Buffer address
+	uint64 len;					// Buffer length in bytes
+} block_sg_t;
+/**
+* Request completion callback
+* @param req - completed request
+*/
+typedef void (*block_done_t)(block_req_t *req);
+/**
+* Read/write request
+*/
+struct block_req_struct {
+	uint8 op;					// BLOCK_OP_*
+	uint8 flags;				// BLOCK_REQ_*
+	uint64 lba;					// First sector
+	uint64 count;				// Number of sectors
+	block_sg_t *sg;				// Data buffers (must stay valid until completion)
+	uint64 sg_count;			// Number of scatter-gather entries
+	block_done_t done;			// Completion callback (optional)
+	void *priv;					// Caller data
+	volatile bool complete;		// Set when the request has completed
+	bool ok;					// Completion status
+	block_req_t *next;			// Queue link for the owner of the request
+	// Scheduler private
+	uint64 deadline;			// Dispatch deadline (TSC ticks)
+	block_req_t *merged;		// Requests completed together with this one
+	uint64 epoch;				// Barrier interval the request belongs to
+	// Statistics private
+	block_dev_t *dev;			// Device the request was submitted to
+	uint64 start;				// Submission time (TSC ticks)
+};
+/**
+* Per device I/O counters
+* Counted from block_submit() to block_complete(), so requests of
+* layered devices show up on the members too.
+*/
+typedef struct {
+	uint64 since;				// Counting started (TSC ticks)
+	uint64 ops[2];				// Completed requests (indexed by BLOCK_OP_*)
+	uint64 bytes[2];			// Bytes transferred
+	uint64 errors;				// Requests completed with an error
+	uint64 flushes;
+	uint64 discards;
+	uint64 in_flight;			// Submitted and not completed yet
+	uint64 depth_sum;			// Sum of in_flight sampled at each submission
+	uint64 depth_max;
+	uint64 depth[BLOCK_DEPTH_BUCKETS];	// In flight at submission
+	uint64 lat_sum[2];			// Latency sum (TSC ticks)
+	uint64 lat_max[2];
+	uint64 lat[2][BLOCK_LAT_BUCKETS];	// Latency, bucket n counts [2^n, 2^(n+1)) ticks
+} block_stats_t;
+/**
+* Block device operations
+*/
+typedef struct {
+	/**
+	* Queue a read or write request
+	* Drivers honour BLOCK_REQ_FUA natively or by flushing their cache
+	* before the request completes. Devices that complete requests in
+	* order may ignore BLOCK_REQ_BARRIER.
+	* @param dev - block device
+	* @param req - request (completed with block_complete())
+	* @return false if the device queue is full - poll and retry
+	*/
+	bool (*submit)(block_dev_t *dev, block_req_t *req);
+	/**
+	* Push submitted requests to the hardware (optional)
+	* Lets drivers ring a doorbell once per batch instead of once per
+	* request. Drivers that have one must also push from poll.
+	* @param dev - block device
+	*/
+	void (*commit)(block_dev_t *dev);
+	/**
+	* Reap completed requests
+	* @param dev - block device
+	* @param wait - block until at least one request completes
+	*/
+	void (*poll)(block_dev_t *dev, bool wait);
+	/**
+	* Write volatile cache to persistent media
+	* @param dev - block device
+	* @return false on failure
+	*/
+	bool (*flush)(block_dev_t *dev);
+	/**
+	* Tell the device that a range of sectors is not used anymore
+	* @param dev - block device
+	* @param lba - first sector
+	* @param count - number of sectors
+	* @return false on failure
+	*/
+	bool (*discard)(block_dev_t *dev, uint64 lba, uint64 count);
+} block_ops_t;
+/**
+* Block device
+*/
+struct block_dev_struct {
+	char name[BLOCK_NAME_LEN];	// Device name
+	uint64 idx;					// Index in the device list
+	block_ops_t *ops;			// Driver operations
+	uint64 sector_size;			// Logical sector size in bytes
+	uint64 phys_sector_size;	// Physical sector size in bytes
+	uint64 align_offset;		// Logical sector offset of LBA 0 in the first physical sector
+	uint64 capacity;			// Number of sectors
+	uint64 queue_depth;			// Requests the device can have in flight
+	uint64 max_segments;		// Scatter-gather entries per request (0 - no limit)
+	uint64 max_sectors;			// Sectors per request (0 - no limit)
+	void *priv;					// Driver data
+	void *sched;				// I/O scheduler (null - requests go straight to the driver)
+	block_stats_t stats;		// I/O counters
+};
+
+/**
+* Register a block device
+* Devices that can queue more than one request get an I/O scheduler.
+* @param [in] name - device name
+* @param [in] ops - driver operations (submit and poll are mandatory)
+* @param sector_size - logical sector size in bytes
+* @param capacity - number of sectors
+* @param queue_depth - requests the device can have in flight
+* @param [in] priv - driver data
+* @return block device or null if the device list is full
+*/
+block_dev_t *block_register(const char *name, block_ops_t *ops, uint64 sector_size, uint64 capacity, uint64 queue_depth, void *priv);
+/**
+* Get the number of block devices registered
+* @return number of devices
+*/
+uint64 block_num_dev();
+/**
+* Get block device by index
+* @param idx - device index
+* @return block device or null
+*/
+block_dev_t *block_get(uint64 idx);
+/**
+* Find block device by name
+* @param [in] name - device name
+* @return block device or null
+*/
+block_dev_t *block_find(const char *name);
+/**
+* Submit a request (asynchronous)
+* Waits for room in the device queue if it is full.
+* @param dev - block device
+* @param req - request, completion is signaled with req->complete and req->done
+* @return false if the request is invalid
+*/
+bool block_submit(block_dev_t *dev, block_req_t *req);
+/**
+* Hold requests back so they can be sorted and merged (nests)
+* @param dev - block device
+*/
+void block_plug(block_dev_t *dev);
+/**
+* Release a plug, sending the held requests when the last one goes
+* @param dev - block device
+*/
+void block_unplug(block_dev_t *dev);
+/**
+* Complete a request - called by drivers
+* @param req - request
+* @param ok - completion status
+*/
+void block_complete(block_req_t *req, bool ok);
+/**
+* Reap completed requests of a device
+* @param dev - block device
+* @param wait - block until at least one request completes
+*/
+void block_poll(block_dev_t *dev, bool wait);
+/**
+* Wait for a request to complete
+* @param dev - block device the request was submitted to
+* @param req - request
+* @return request status
+*/
+bool block_wait(block_dev_t *dev, block_req_t *req);
+/**
+* Read sectors (synchronous)
+* @param dev - block device
+* @param lba - first sector
+* @param count - number of sectors
+* @param [out] buff - destination buffer
+* @return false on failure
+*/
+bool block_read(block_dev_t *dev, uint64 lba, uint64 count, uint8 *buff);
+/**
+* Write sectors (synchronous)
+* @param dev - block device
+* @param lba - first sector
+* @param count - number of sectors
+* @param [in] buff - source buffer
+* @return false on failure
+*/
+bool block_write(block_dev_t *dev, uint64 lba, uint64 count, uint8 *buff);
+/**
+* Write sectors straight to persistent media (synchronous)
+* Only this write pays for durability - unlike block_flush() it doesn't
+* wait for the rest of the device cache.
+* @see block_write
+*/
+bool block_write_fua(block_dev_t *dev, uint64 lba, uint64 count, uint8 *buff);
+/**
+* Write device cache to persistent media
+* @param dev - block device
+* @return false on failure (or if the device has no cache to flush)
+*/
+bool block_flush(block_dev_t *dev);
+/**
+* Discard a range of sectors
+* @param dev - block device
+* @param lba - first sector
+* @param count - number of sectors
+* @return false on failure or if the device does not support discard
+*/
+bool block_discard(block_dev_t *dev, uint64 lba, uint64 count);
+/**
+* Get I/O counters of a device
+* @param dev - block device
+* @param [out] stats - counters
+*/
+void block_get_stats(block_dev_t *dev, block_stats_t *stats);
+/**
+* Start counting from zero (requests in flight stay counted)
+* @param dev - block device
+*/
+void block_reset_stats(block_dev_t *dev);
+/**
+* Get a latency percentile from the histogram
+* @param dev - block device
+* @param op - BLOCK_OP_*
+* @param pct - percentile (1-100)
+* @return upper bound of the latency in microseconds (0 if nothing completed)
+*/
+uint64 block_latency_pct(block_dev_t *dev, uint8 op, uint64 pct);
+
+#if DEBUG == 1
+/**
+* List registered block devices
+*/
+void block_list();
+/**
+* Print I/O counters, throughput, queue depth and latency percentiles
+* of every device that has seen I/O
+*/
+void block_stats_list();
+#endif
+
+#endif /* __block_h */
@@ -0,0 +1,204 @@
+/*
+
+DMA memory pool
+===============
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "lib.h"
+#include "paging.h"
+#include "dma.h"
+#if DEBUG == 1
+	#include "debug_print.h"
+#endif
+
+// Units per zone
+#define DMA_UNITS_16M		(DMA_POOL_16M / DMA_UNIT)
+#define DMA_UNITS_4G		(DMA_POOL_4G / DMA_UNIT)
+#define DMA_UNITS_ANY		(DMA_POOL_ANY / DMA_UNIT)
+
+/**
+* Address zone pool
+* Every DMA_UNIT of the pool is tracked by a single bit
+*/
+typedef struct {
+	uint64 limit;					// Physical address the pool has to end below (0 - no limit)
+	uint64 base;					// Pool start (page aligned, 0 if not reserved)
+	uint64 units;					// Pool size in units
+	uint64 *map;					// Allocation bitmap (1 - used)
+	uint64 used;					// Units in use
+	uint64 peak;					// Most units ever in use
+	uint64 fails;					// Allocations the zone couldn't serve
+} dma_zone_t;
+
+static uint64 _dma_map_16m[(DMA_UNITS_16M + 63) / 64];
+static uint64 _dma_map_4g[(DMA_UNITS_4G + 63) / 64];
+static uint64 _dma_map_any[(DMA_UNITS_ANY + 63) / 64];
+
+static dma_zone_t _dma_zone[DMA_ZONE_COUNT] = {
+	{0x1000000, 0, DMA_UNITS_16M, _dma_map_16m, 0, 0, 0},
+	{0x100000000, 0, DMA_UNITS_4G, _dma_map_4g, 0, 0, 0},
+	{0, 0, DMA_UNITS_ANY, _dma_map_any, 0, 0, 0}
+};
+
+// Check if unit is used
+static bool dma_unit_used(dma_zone_t *zone, uint64 unit){
+	return ((zone->map[unit / 64] >> (unit % 64)) & 1);
+}
+// Mark a run of units used or free
+static void dma_unit_mark(dma_zone_t *zone, uint64 unit, uint64 count, bool used){
+	uint64 i;
+	for (i = unit; i < unit + count; i ++){
+		if (used){
+			zone->map[i / 64] |= ((uint64)1 << (i % 64));
+		} else {
+			zone->map[i / 64] &= ~((uint64)1 << (i % 64));
+		}
+	}
+}
+/**
+* Find and take a free aligned run of units (first fit)
+* @param zone - zone to allocate from
+* @param count - number of units
+* @param align - alignment in bytes (power of 2)
+* @return physical address or 0 if there is no room
+*/
+static uint64 dma_zone_alloc(dma_zone_t *zone, uint64 count, uint64 align){
+	uint64 unit = 0;
+	uint64 addr;
+	uint64 i;
+	if (zone->base == 0){
+		return 0;
+	}
+	while (true){
+		// Move up to the next aligned unit
+		addr = (zone->base + unit * DMA_UNIT + align - 1) & ~(align - 1);
+		unit = (addr - zone->base) / DMA_UNIT;
+		if (unit + count > zone->units){
+			return 0;
+		}
+		for (i = unit; i < unit + count; i ++){
+			if (dma_unit_used(zone, i)){
+				break;
+			}
+		}
+		if (i == unit + count){
+			break;
+		}
+		// Restart right after the used unit
+		unit = i + 1;
+	}
+	dma_unit_mark(zone, unit, count, true);
+	zone->used += count;
+	if (zone->used > zone->peak){
+		zone->peak = zone->used;
+	}
+	return addr;
+}
+
+bool dma_init(){
+	dma_zone_t *zone;
+	bool ok = true;
+	uint8 i;
+	// Strictest zone first, while low memory is still free
+	for (i = 0; i < DMA_ZONE_COUNT; i ++){
+		zone = &_dma_zone[i];
+		mem_fill((uint8 *)zone->map, ((zone->units + 63) / 64) * 8, 0);
+		zone->base = page_reserve_below(zone->units * DMA_UNIT, zone->limit);
+		if (zone->base == 0){
+			zone->units = 0;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+uint64 dma_alloc(uint64 size, uint64 align, uint8 zone){
+	uint64 count = (size + DMA_UNIT - 1) / DMA_UNIT;
+	uint64 addr;
+	uint8 i;
+	if (size == 0 || zone >= DMA_ZONE_COUNT || (align & (align - 1)) != 0){
+		return 0;
+	}
+	if (align < DMA_UNIT){
+		align = DMA_UNIT;
+	}
+	// Memory of a stricter zone fits any looser requirement
+	for (i = zone + 1; i > 0; i --){
+		addr = dma_zone_alloc(&_dma_zone[i - 1], count, align);
+		if (addr != 0){
+			mem_fill((uint8 *)addr, count * DMA_UNIT, 0);
+			return addr;
+		}
+		_dma_zone[i - 1].fails ++;
+	}
+	return 0;
+}
+
+void dma_free(uint64 addr, uint64 size){
+	uint64 count = (size + DMA_UNIT - 1) / DMA_UNIT;
+	dma_zone_t *zone;
+	uint8 i;
+	for (i = 0; i < DMA_ZONE_COUNT; i ++){
+		zone = &_dma_zone[i];
+		if (zone->base != 0 && addr >= zone->base && addr < zone->base + zone->units * DMA_UNIT){
+			dma_unit_mark(zone, (addr - zone->base) / DMA_UNIT, count, false);
+			zone->used -= count;
+			return;
+		}
+	}
+}
+
+uint8 dma_zone(uint64 addr){
+	if (addr < 0x1000000){
+		return DMA_ZONE_16M;
+	}
+	if (addr < 0x100000000){
+		return DMA_ZONE_4G;
+	}
+	return DMA_ZONE_ANY;
+}
+
+#if DEBUG == 1
+void dma_list(){
+	static const char *names[DMA_ZONE_COUNT] = {"16M", "4G", "any"};
+	dma_zone_t *zone;
+	uint8 i;
+	for (i = 0; i < DMA_ZONE_COUNT; i ++){
+		zone = &_dma_zone[i];
+		debug_print(DC_WB, "DMA %s: 0x%x, %uKB, used:%uKB, peak:%uKB, failed:%u", names[i],
+			zone->base, zone->units * DMA_UNIT / 1024, zone->used * DMA_UNIT / 1024,
+			zone->peak * DMA_UNIT / 1024, zone->fails);
+	}
+}
+#endif
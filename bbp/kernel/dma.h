@@ -0,0 +1,87 @@
+/*
+
+DMA memory pool
+===============
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef __dma_h
+#define __dma_h
+
+#include "common.h"
+#include "../config.h"
+
+// Address zones - a zone is an upper bound on the physical address
+#define DMA_ZONE_16M		0	// Below 16MB (ISA DMA)
+#define DMA_ZONE_4G			1	// Below 4GB (32-bit bus masters)
+#define DMA_ZONE_ANY		2	// Anywhere
+#define DMA_ZONE_COUNT		3
+
+// Allocation granularity (also the smallest alignment)
+#define DMA_UNIT			128
+
+/**
+* Reserve the zone pools from usable RAM
+* Has to run right after paging is initialized, while the low memory
+* is still free.
+* @return false if any of the zones couldn't be reserved
+*/
+bool dma_init();
+/**
+* Allocate physically contiguous, identity mapped and zeroed memory
+* If the zone is exhausted, a stricter one is used.
+* @param size - number of bytes
+* @param align - alignment in bytes (power of 2, rounded up to DMA_UNIT)
+* @param zone - highest zone the memory may come from (DMA_ZONE_*)
+* @return physical address or 0 if there is no room
+*/
+uint64 dma_alloc(uint64 size, uint64 align, uint8 zone);
+/**
+* Release memory returned by dma_alloc()
+* @param addr - physical address
+* @param size - number of bytes (same as allocated)
+*/
+void dma_free(uint64 addr, uint64 size);
+/**
+* Get the zone an address belongs to
+* @param addr - physical address
+* @return DMA_ZONE_* of the address
+*/
+uint8 dma_zone(uint64 addr);
+#if DEBUG == 1
+/**
+* List zone usage
+*/
+void dma_list();
+#endif
+
+#endif /* __dma_h */
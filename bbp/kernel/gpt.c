@@ -0,0 +1,359 @@
+/*
+
+GUID Partition Table reader
+===========================
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "lib.h"
+#include "paging.h"
+#include "block.h"
+#include "iosched.h"
+#include "gpt.h"
+#if DEBUG == 1
+	#include "debug_print.h"
+#endif
+
+#define GPT_SIGNATURE			0x5452415020494645	// "EFI PART"
+#define GPT_HEADER_SIZE			92					// Smallest valid header
+#define GPT_ENTRY_SIZE			128					// Smallest valid entry
+#define GPT_BUFFER_SIZE			0x4000				// Entry array is read in pieces this big
+#define GPT_MAX_PART			32					// Partitions on all devices
+#define GPT_QUEUE_DEPTH			32					// Requests in flight per partition
+
+/**
+* Partition table header
+*/
+typedef struct {
+	uint64 signature;			// GPT_SIGNATURE
+	uint32 revision;
+	uint32 header_size;			// Bytes covered by header_crc
+	uint32 header_crc;			// CRC32 of the header with this field zeroed
+	uint32 reserved;
+	uint64 my_lba;				// LBA of this header
+	uint64 alternate_lba;		// LBA of the other header
+	uint64 first_usable_lba;
+	uint64 last_usable_lba;
+	uint8 disk_guid[16];
+	uint64 entries_lba;			// First LBA of the entry array
+	uint32 entry_count;
+	uint32 entry_size;
+	uint32 entries_crc;			// CRC32 of the entry array
+} gpt_header_t;
+/**
+* Partition entry
+*/
+typedef struct {
+	uint8 type_guid[16];		// All zero - entry not used
+	uint8 unique_guid[16];
+	uint64 first_lba;
+	uint64 last_lba;			// Inclusive
+	uint64 attributes;
+	uint16 name[36];			// UTF-16LE
+} gpt_entry_t;
+
+typedef struct gpt_part_struct gpt_part_t;
+typedef struct gpt_slot_struct gpt_slot_t;
+
+/**
+* Request forwarded to the parent device
+*/
+struct gpt_slot_struct {
+	block_req_t req;			// Request with the LBA translated
+	block_req_t *orig;			// Request of the partition
+	gpt_part_t *part;			// Partition the slot belongs to
+	gpt_slot_t *next;			// Next free slot
+};
+/**
+* Partition
+*/
+struct gpt_part_struct {
+	block_dev_t *dev;			// Partition block device
+	block_dev_t *parent;		// Device the partition is on
+	uint64 start;				// First LBA on the parent
+	uint64 sectors;
+	uint64 entry;				// Entry index
+	uint8 type_guid[16];
+	uint64 attributes;
+	char name[37];				// ASCII part of the partition name
+	gpt_slot_t *slot;			// Request pool (GPT_QUEUE_DEPTH entries)
+	gpt_slot_t *free;			// Stack of free slots
+};
+
+static gpt_part_t _gpt_part[GPT_MAX_PART];
+static uint64 _gpt_part_count = 0;
+static uint8 _gpt_buf[GPT_BUFFER_SIZE];
+
+/**
+* Parent completed the translated request
+*/
+static void gpt_done(block_req_t *req){
+	gpt_slot_t *slot = (gpt_slot_t *)req->priv;
+	block_req_t *orig = slot->orig;
+	slot->next = slot->part->free;
+	slot->part->free = slot;
+	block_complete(orig, req->ok);
+}
+/**
+* Forward a request to the parent device
+* The partition offset is cached in the device, so translating is a
+* single add. The parent's scheduler sorts and merges the requests.
+*/
+static bool gpt_submit(block_dev_t *dev, block_req_t *req){
+	gpt_part_t *part = (gpt_part_t *)dev->priv;
+	gpt_slot_t *slot = part->free;
+	if (slot == null){
+		return false;
+	}
+	part->free = slot->next;
+	slot->orig = req;
+	mem_fill((uint8 *)&slot->req, sizeof(block_req_t), 0);
+	slot->req.op = req->op;
+	slot->req.flags = req->flags;
+	slot->req.lba = req->lba + part->start;
+	slot->req.count = req->count;
+	slot->req.sg = req->sg;
+	slot->req.sg_count = req->sg_count;
+	slot->req.done = gpt_done;
+	slot->req.priv = slot;
+	if (!block_submit(part->parent, &slot->req)){
+		slot->next = part->free;
+		part->free = slot;
+		block_complete(req, false);
+	}
+	return true;
+}
+static void gpt_poll(block_dev_t *dev, bool wait){
+	gpt_part_t *part = (gpt_part_t *)dev->priv;
+	// Don't wait on a request the parent holds back
+	if (part->parent->sched != null){
+		iosched_kick(part->parent);
+	}
+	block_poll(part->parent, wait);
+}
+static bool gpt_flush(block_dev_t *dev){
+	return block_flush(((gpt_part_t *)dev->priv)->parent);
+}
+static bool gpt_discard(block_dev_t *dev, uint64 lba, uint64 count){
+	gpt_part_t *part = (gpt_part_t *)dev->priv;
+	return block_discard(part->parent, lba + part->start, count);
+}
+
+static block_ops_t _gpt_ops = {
+	.submit = gpt_submit,
+	.poll = gpt_poll,
+	.flush = gpt_flush,
+	.discard = gpt_discard
+};
+
+/**
+* Check if a GUID is all zero
+*/
+static bool gpt_guid_empty(uint8 *guid){
+	uint64 i;
+	for (i = 0; i < 16; i ++){
+		if (guid[i] != 0){
+			return false;
+		}
+	}
+	return true;
+}
+/**
+* Read and validate a partition table header
+* @param dev - block device
+* @param lba - header location
+* @param [out] hdr - header
+* @return false if the header is damaged or doesn't describe this device
+*/
+static bool gpt_read_header(block_dev_t *dev, uint64 lba, gpt_header_t *hdr){
+	gpt_header_t *raw = (gpt_header_t *)_gpt_buf;
+	uint32 crc;
+	if (lba == 0 || lba >= dev->capacity || dev->sector_size > GPT_BUFFER_SIZE || !block_read(dev, lba, 1, _gpt_buf)){
+		return false;
+	}
+	if (raw->signature != GPT_SIGNATURE || raw->header_size < GPT_HEADER_SIZE || raw->header_size > dev->sector_size){
+		return false;
+	}
+	crc = raw->header_crc;
+	raw->header_crc = 0;
+	if (crc32(0, _gpt_buf, raw->header_size) != crc){
+		return false;
+	}
+	mem_copy((uint8 *)hdr, sizeof(gpt_header_t), _gpt_buf);
+	hdr->header_crc = crc;
+	// Entry size is 128 times a power of 2
+	if (hdr->my_lba != lba || hdr->entry_size < GPT_ENTRY_SIZE || hdr->entry_size > GPT_BUFFER_SIZE
+		|| (hdr->entry_size & (hdr->entry_size - 1)) != 0 || hdr->entry_count == 0){
+		return false;
+	}
+	if (hdr->first_usable_lba > hdr->last_usable_lba || hdr->last_usable_lba >= dev->capacity){
+		return false;
+	}
+	return (hdr->entries_lba + ((uint64)hdr->entry_count * hdr->entry_size + dev->sector_size - 1) / dev->sector_size <= dev->capacity);
+}
+/**
+* Read the entry array and stage the used entries after the registered
+* partitions
+* Nothing is registered until the whole array has passed its CRC.
+* @param dev - block device
+* @param hdr - validated header
+* @return number of partitions staged or -1 if the array is damaged
+*/
+static int64 gpt_read_entries(block_dev_t *dev, gpt_header_t *hdr){
+	gpt_entry_t *entry;
+	gpt_part_t *part;
+	uint64 total = (uint64)hdr->entry_count * hdr->entry_size;
+	uint64 per_read = GPT_BUFFER_SIZE / dev->sector_size;
+	uint64 lba = hdr->entries_lba;
+	uint64 idx = 0;
+	uint64 staged = 0;
+	uint64 count;
+	uint64 len;
+	uint64 off;
+	uint64 i;
+	uint32 crc = 0;
+	if (dev->max_sectors != 0 && per_read > dev->max_sectors){
+		per_read = dev->max_sectors;
+	}
+	while (total > 0){
+		count = (total + dev->sector_size - 1) / dev->sector_size;
+		if (count > per_read){
+			count = per_read;
+		}
+		if (!block_read(dev, lba, count, _gpt_buf)){
+			return -1;
+		}
+		len = count * dev->sector_size;
+		if (len > total){
+			len = total;
+		}
+		crc = crc32(crc, _gpt_buf, len);
+		// Entries never straddle a read - sizes are powers of 2
+		for (off = 0; off + hdr->entry_size <= len; off += hdr->entry_size, idx ++){
+			entry = (gpt_entry_t *)(_gpt_buf + off);
+			if (gpt_guid_empty(entry->type_guid) || entry->first_lba > entry->last_lba
+				|| entry->first_lba < hdr->first_usable_lba || entry->last_lba > hdr->last_usable_lba){
+				continue;
+			}
+			if (_gpt_part_count + staged >= GPT_MAX_PART){
+				continue;
+			}
+			part = &_gpt_part[_gpt_part_count + staged];
+			mem_fill((uint8 *)part, sizeof(gpt_part_t), 0);
+			part->parent = dev;
+			part->start = entry->first_lba;
+			part->sectors = entry->last_lba - entry->first_lba + 1;
+			part->entry = idx;
+			part->attributes = entry->attributes;
+			mem_copy(part->type_guid, 16, entry->type_guid);
+			for (i = 0; i < 36 && entry->name[i] != 0; i ++){
+				part->name[i] = (entry->name[i] < 0x80 ? (char)entry->name[i] : '?');
+			}
+			staged ++;
+		}
+		lba += count;
+		total -= len;
+	}
+	return (crc == hdr->entries_crc ? (int64)staged : -1);
+}
+
+uint64 gpt_scan(block_dev_t *dev){
+	gpt_header_t hdr;
+	gpt_part_t *part;
+	char name[BLOCK_NAME_LEN];
+	uint64 backup = dev->capacity - 1;
+	int64 staged = -1;
+	uint64 found = 0;
+	uint64 ratio;
+	uint64 i;
+	uint64 j;
+	if (dev->capacity < 3){
+		return 0;
+	}
+	if (gpt_read_header(dev, 1, &hdr)){
+		staged = gpt_read_entries(dev, &hdr);
+		// Intact primary header knows where the backup is
+		backup = hdr.alternate_lba;
+	}
+	if (staged < 0){
+		if (!gpt_read_header(dev, backup, &hdr) || (staged = gpt_read_entries(dev, &hdr)) < 0){
+			return 0;
+		}
+#if DEBUG == 1
+		debug_print(DC_WB, "%s: primary GPT damaged, using the backup", dev->name);
+#endif
+	}
+	for (i = 0; i < (uint64)staged; i ++){
+		part = &_gpt_part[_gpt_part_count];
+		part->slot = (gpt_slot_t *)page_reserve(GPT_QUEUE_DEPTH * sizeof(gpt_slot_t));
+		if (part->slot == null){
+			break;
+		}
+		mem_fill((uint8 *)part->slot, GPT_QUEUE_DEPTH * sizeof(gpt_slot_t), 0);
+		part->free = null;
+		for (j = GPT_QUEUE_DEPTH; j > 0; j --){
+			part->slot[j - 1].part = part;
+			part->slot[j - 1].next = part->free;
+			part->free = &part->slot[j - 1];
+		}
+		mem_fill((uint8 *)name, BLOCK_NAME_LEN, 0);
+		str_write_f(name, BLOCK_NAME_LEN - 1, "%sp%u", dev->name, part->entry + 1);
+		// No scheduler of its own - the parent's sees requests of all partitions
+		part->dev = block_register(name, &_gpt_ops, dev->sector_size, part->sectors, 1, (void *)part);
+		if (part->dev == null){
+			break;
+		}
+		part->dev->max_sectors = dev->max_sectors;
+		part->dev->max_segments = dev->max_segments;
+		part->dev->phys_sector_size = dev->phys_sector_size;
+		ratio = dev->phys_sector_size / dev->sector_size;
+		part->dev->align_offset = (ratio > 1 ? (dev->align_offset + part->start) % ratio : 0);
+		_gpt_part_count ++;
+		found ++;
+	}
+	return found;
+}
+
+#if DEBUG == 1
+void gpt_list(){
+	uint64 i;
+	gpt_part_t *part;
+	for (i = 0; i < _gpt_part_count; i ++){
+		part = &_gpt_part[i];
+		debug_print(DC_WB, "%s: start:%u, sectors:%u, type:%x-%x, attr:%x, %s",
+			part->dev->name, part->start, part->sectors,
+			(uint64)*((uint32 *)part->type_guid), (uint64)*((uint16 *)(part->type_guid + 4)),
+			part->attributes, part->name);
+	}
+}
+#endif
@@ -41,6 +41,42 @@
 [extern irq_handler]							; Import irq_handler from C
 [global idt_set]								; Export void idt_set(idt_ptr_t *idt) to C
 
+; Macro to call a C handler and return from the interrupt
+; Saves the registers C code may clobber, copies the interrupt number, error
+; code and CPU frame below them as the handler's int_stack_t argument and keeps
+; RSP 16-byte aligned at the call (CPU aligns it before pushing the frame)
+%macro INT_CALL 1
+	push rax									; save caller-saved registers
+	push rcx
+	push rdx
+	push rsi
+	push rdi
+	push r8
+	push r9
+	push r10
+	push r11
+	sub rsp, 64									; int_stack_t copy (7 qwords) + alignment
+	mov rsi, rsp
+	add rsi, 136								; interrupt number pushed by the stub
+	mov rdi, rsp
+	mov rcx, 7
+	cld
+	rep movsq
+	call %1										; call void handler(int_stack_t args)
+	add rsp, 64
+	pop r11										; restore registers
+	pop r10
+	pop r9
+	pop r8
+	pop rdi
+	pop rsi
+	pop rdx
+	pop rcx
+	pop rax
+	add rsp, 16									; cleanup stack
+	iretq										; return from interrupt handler (restores IF)
+%endmacro
+
 ; Macro to create an intterupt service routine for interrupts that do not pass error codes 
 %macro INT_NO_ERR 1
 [global isr%1]
@@ -48,10 +84,7 @@ isr%1:
 	cli											; disable interrupts
 	push qword 0								; set error code to 0
 	push qword %1								; set interrupt number
-	call isr_handler							; call void isr_handler(int_stack_t args)
-	sti											; enable interrupts
-	add rsp, 16									; cleanup stack
-	iretq										; return from interrupt handler
+	INT_CALL isr_handler
 %endmacro
 
 ; Macro to create an interrupt service routine for interrupts that DO pass an error code
@@ -60,10 +93,7 @@ isr%1:
 isr%1:
 	cli											; disable interrupts
 	push qword %1								; set interrupt number
-	call isr_handler							; call void isr_handler(int_stack_t args)
-	sti											; enable interrupts
-	add rsp, 16									; cleanup stack
-	iretq										; return from interrupt handler
+	INT_CALL isr_handler
 %endmacro
 
 ; Macro to create an IRQ interrupt service routine
@@ -75,10 +105,7 @@ irq%1:
 	cli											; disable interrupts
 	push qword %1								; set IRQ number in the place of error code (see registers_t in interrupts.h)
 	push qword %2								; set interrupt number
-	call irq_handler							; calls void irq_handler(int_stack_t args)
-	sti											; enable interrupts
-	add rsp, 16									; cleanup stack
-	iretq										; return from interrupt handler
+	INT_CALL irq_handler
 %endmacro
 
 idt_set:										; prototype: void idt_set(uint32 idt_ptr)
@@ -136,3 +163,11 @@ IRQ 12, 44
 IRQ 13, 45
 IRQ 14, 46
 IRQ 15, 47
+IRQ 16, 48										; Message signalled interrupts (MSI/MSI-X)
+IRQ 17, 49
+IRQ 18, 50
+IRQ 19, 51
+IRQ 20, 52
+IRQ 21, 53
+IRQ 22, 54
+IRQ 23, 55
@@ -42,6 +42,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "lib.h"
 #include "io.h"
 #include "paging.h"
+#include "apic.h"
 #if DEBUG == 1
 	#include "debug_print.h"
 #endif
@@ -70,6 +71,12 @@ static char *ints[] = {
   "Alignament check exception",
   "Machine check exception"
 };
+// Maximum number of handlers sharing one IRQ line
+#define IRQ_MAX_HANDLERS 4
+/**
+* IRQ handlers
+*/
+static irq_callback_t _irq_callback[IRQ_MSI_FIRST + IRQ_MSI_COUNT][IRQ_MAX_HANDLERS];
 /**
 * Interrupt Descriptor Table
 */
@@ -90,6 +97,7 @@ static void idt_set_entry(uint8 num, uint64 addr, uint16 flags){
 
 void interrupt_init(){
 	mem_fill((uint8 *)&idt, sizeof(idt_entry_t) * 256, 0);
+	mem_fill((uint8 *)&_irq_callback, sizeof(_irq_callback), 0);
 
 	// Remap the IRQ table.
 	outb(0x20, 0x11); // Initialize master PIC
@@ -100,8 +108,8 @@ void interrupt_init(){
 	outb(0xA1, 0x02); // Tell Slave PIC that it's cascaded to IRQ2
 	outb(0x21, 0x01); // Enable 8085 mode (whatever that means)
 	outb(0xA1, 0x01); // Enable 8085 mode (whatever that means)
-	outb(0x21, 0x0); // Clear masks
-	outb(0xA1, 0x0); // Clear masks
+	outb(0x21, 0xFB); // Mask everything but the cascade (see irq_register)
+	outb(0xA1, 0xFF); // Mask everything
 
 	idt_set_entry( 0, (uint64)isr0 , 0x8E00);  // Division by zero exception
 	idt_set_entry( 1, (uint64)isr1 , 0x8E00);  // Debug exception
@@ -153,6 +161,15 @@ void interrupt_init(){
 	idt_set_entry(46, (uint64)irq14, 0x8E00);  // IRQ14 - Primary ATA Hard Disk
 	idt_set_entry(47, (uint64)irq15, 0x8E00);  // IRQ15 - Secondary ATA Hard Disk
 
+	idt_set_entry(48, (uint64)irq16, 0x8E00);  // MSI 0
+	idt_set_entry(49, (uint64)irq17, 0x8E00);  // MSI 1
+	idt_set_entry(50, (uint64)irq18, 0x8E00);  // MSI 2
+	idt_set_entry(51, (uint64)irq19, 0x8E00);  // MSI 3
+	idt_set_entry(52, (uint64)irq20, 0x8E00);  // MSI 4
+	idt_set_entry(53, (uint64)irq21, 0x8E00);  // MSI 5
+	idt_set_entry(54, (uint64)irq22, 0x8E00);  // MSI 6
+	idt_set_entry(55, (uint64)irq23, 0x8E00);  // MSI 7
+
 	idt_ptr.limit = (sizeof(idt_entry_t) * 256) - 1;
 	idt_ptr.base = (uint64)&idt;
 	idt_set(&idt_ptr);
@@ -195,8 +212,67 @@ void isr_handler(int_stack_t stack){
 	}
 }
 
+bool irq_register(uint8 irq, irq_callback_t callback){
+	uint8 i;
+	if (irq >= 16){
+		return false;
+	}
+	for (i = 0; i < IRQ_MAX_HANDLERS; i ++){
+		if (_irq_callback[irq][i] == null || _irq_callback[irq][i] == callback){
+			_irq_callback[irq][i] = callback;
+			// Unmask the line
+			if (irq >= 8){
+				outb(0xA1, inb(0xA1) & ~(1 << (irq - 8)));
+			} else {
+				outb(0x21, inb(0x21) & ~(1 << irq));
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+uint8 irq_alloc_msi(irq_callback_t callback, uint64 *addr, uint32 *data){
+	uint8 irq;
+	if (apic_num_cpu() == 0){
+		return 0xFF;
+	}
+	for (irq = IRQ_MSI_FIRST; irq < IRQ_MSI_FIRST + IRQ_MSI_COUNT; irq ++){
+		if (_irq_callback[irq][0] == null){
+			_irq_callback[irq][0] = callback;
+			// Local APIC has to be software enabled to accept messages
+			apic_write_reg(APIC_SIVR, apic_read_reg(APIC_SIVR) | APIC_SIVR_ENABLE);
+			// Fixed delivery, physical destination, edge triggered
+			*addr = APIC_MSI_ADDR | ((uint64)(apic_read_reg(APIC_LAPIC_ID) >> 24) << 12);
+			*data = IRQ0 + irq;
+			return irq;
+		}
+	}
+	return 0xFF;
+}
+
 void irq_handler(int_stack_t stack){
+	uint8 irq = (uint8)stack.err_code;
+	uint8 i;
+	bool handled = false;
+	for (i = 0; i < IRQ_MAX_HANDLERS; i ++){
+		if (_irq_callback[irq][i] != null){
+			_irq_callback[irq][i](irq);
+			handled = true;
+		}
+	}
 #if DEBUG == 1
-	debug_print(DC_WB, "IRQ %d", stack.err_code);
+	if (!handled){
+		debug_print(DC_WB, "IRQ %d", stack.err_code);
+	}
 #endif
+	// End Of Interrupt
+	if (irq >= IRQ_MSI_FIRST){
+		apic_write_reg(APIC_EOIR, 0);
+		return;
+	}
+	if (irq >= 8){
+		outb(0xA0, 0x20);
+	}
+	outb(0x20, 0x20);
 }
\ No newline at end of file
@@ -59,6 +59,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define IRQ13 45
 #define IRQ14 46
 #define IRQ15 47
+// Message signalled interrupts are delivered through the local APIC
+#define IRQ_MSI_FIRST 16				// First MSI IRQ number (interrupt 48)
+#define IRQ_MSI_COUNT 8					// Number of MSI IRQs
 
 /**
 * Register stack passed from assembly
@@ -109,10 +112,33 @@ struct idt_ptr_struct {
 */
 typedef struct idt_ptr_struct idt_ptr_t;
 /**
+* IRQ callback
+* @param irq - IRQ number (0-15 PIC lines, 16-23 MSI)
+* @return void
+*/
+typedef void (*irq_callback_t)(uint8 irq);
+/**
 * Initialize interrupt handlers
 */
 void interrupt_init();
 /**
+* Attach a handler to an IRQ line and unmask it
+* Several handlers can share a single (PCI) IRQ line
+* @param irq - IRQ number (0-15)
+* @param callback - handler to call
+* @return false if the IRQ number is invalid or the line has no free handler entries
+*/
+bool irq_register(uint8 irq, irq_callback_t callback);
+/**
+* Allocate a message signalled interrupt and attach a handler to it
+* The interrupt is delivered to the boot CPU's local APIC.
+* @param callback - handler to call
+* @param [out] addr - message address to program into the device
+* @param [out] data - message data to program into the device
+* @return IRQ number or 0xFF if there is no free MSI or no local APIC
+*/
+uint8 irq_alloc_msi(irq_callback_t callback, uint64 *addr, uint32 *data);
+/**
 * Set IDT pointer
 * @see interrupts.asm
 * @param idt_ptr - an address of IDT pointer structure in memory
@@ -184,6 +210,14 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void irq16();
+extern void irq17();
+extern void irq18();
+extern void irq19();
+extern void irq20();
+extern void irq21();
+extern void irq22();
+extern void irq23();
 
 
 #endif
\ No newline at end of file
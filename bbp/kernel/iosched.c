@@ -0,0 +1,409 @@
+/*
+
+Block I/O scheduler
+===================
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "lib.h"
+#include "paging.h"
+#include "timer.h"
+#include "block.h"
+#include "iosched.h"
+#if DEBUG == 1
+	#include "debug_print.h"
+#endif
+
+#define IOSCHED_READ_EXPIRE_US	500000		// Read deadline
+#define IOSCHED_WRITE_EXPIRE_US	5000000		// Write deadline
+#define IOSCHED_MAX_SG			64			// Scatter-gather entries per merged command
+
+typedef struct iosched_struct iosched_t;
+
+/**
+* Command sent to the driver - one or more merged requests
+*/
+typedef struct {
+	block_req_t req;				// Request handed to the driver
+	block_sg_t sg[IOSCHED_MAX_SG];	// Merged scatter-gather list
+	block_req_t *head;				// Caller requests served (linked with next)
+	iosched_t *sched;
+	bool used;
+} iosched_cmd_t;
+/**
+* Per device scheduler
+*/
+struct iosched_struct {
+	block_dev_t *dev;
+	block_req_t *pending;			// Queued requests sorted by LBA
+	uint64 pos;						// Elevator position (end of last dispatch)
+	uint64 plug;					// Plug nesting
+	uint64 in_flight;				// Commands at the driver
+	uint64 depth;					// Commands the driver may hold
+	uint64 epoch;					// Barrier interval of new requests
+	uint64 epoch_out;				// Barrier interval of the commands in flight
+	bool dispatching;				// Dispatch loop is running
+	iosched_cmd_t *cmd;				// Command pool (depth entries)
+	iosched_stats_t stats;
+};
+
+static iosched_t _iosched[BLOCK_MAX_DEV];
+
+/**
+* Copy the sectors a piggybacked read wants from the request that read them
+* @param src - request covering dst
+* @param dst - piggybacked request
+* @param sector_size - sector size
+*/
+static void iosched_copy(block_req_t *src, block_req_t *dst, uint64 sector_size){
+	uint64 soff = (dst->lba - src->lba) * sector_size;
+	uint64 doff;
+	uint64 si = 0;
+	uint64 di;
+	uint64 n;
+	while (si < src->sg_count && soff >= src->sg[si].len){
+		soff -= src->sg[si].len;
+		si ++;
+	}
+	for (di = 0; di < dst->sg_count; di ++){
+		doff = 0;
+		while (doff < dst->sg[di].len){
+			n = dst->sg[di].len - doff;
+			if (n > src->sg[si].len - soff){
+				n = src->sg[si].len - soff;
+			}
+			mem_copy((uint8 *)dst->sg[di].addr + doff, n, (uint8 *)src->sg[si].addr + soff);
+			doff += n;
+			soff += n;
+			if (soff == src->sg[si].len){
+				si ++;
+				soff = 0;
+			}
+		}
+	}
+}
+/**
+* Driver completed a command - complete every request it served
+*/
+static void iosched_done(block_req_t *creq){
+	iosched_cmd_t *cmd = (iosched_cmd_t *)creq->priv;
+	iosched_t *s = cmd->sched;
+	block_req_t *req = cmd->head;
+	block_req_t *child;
+	block_req_t *next;
+	cmd->head = null;
+	cmd->used = false;
+	s->in_flight --;
+	while (req != null){
+		next = req->next;
+		child = req->merged;
+		while (child != null){
+			req->merged = child->next;
+			if (child->op == BLOCK_OP_READ && creq->ok){
+				iosched_copy(req, child, s->dev->sector_size);
+			}
+			block_complete(child, creq->ok);
+			child = req->merged;
+		}
+		block_complete(req, creq->ok);
+		req = next;
+	}
+	// Freed a command - keep the driver busy
+	if (s->plug == 0){
+		iosched_kick(s->dev);
+	}
+}
+/**
+* Get the oldest barrier interval that still has requests pending
+*/
+static uint64 iosched_epoch(iosched_t *s){
+	uint64 epoch = s->epoch;
+	block_req_t *req;
+	for (req = s->pending; req != null; req = req->next){
+		if (req->epoch < epoch){
+			epoch = req->epoch;
+		}
+	}
+	return epoch;
+}
+/**
+* Pick the next request to dispatch - expired deadlines first (reads
+* before writes), then the next one up from the elevator position
+* Only requests of the given barrier interval are considered.
+*/
+static block_req_t *iosched_pick(iosched_t *s, uint64 epoch){
+	uint64 now = timer_ticks();
+	block_req_t *best = null;
+	block_req_t *first = null;
+	block_req_t *req;
+	for (req = s->pending; req != null; req = req->next){
+		if (req->epoch == epoch && req->deadline <= now){
+			if (best == null || (req->op == BLOCK_OP_READ && best->op != BLOCK_OP_READ)
+				|| (req->op == best->op && req->deadline < best->deadline)){
+				best = req;
+			}
+		}
+	}
+	if (best != null){
+		s->stats.expired ++;
+		return best;
+	}
+	for (req = s->pending; req != null; req = req->next){
+		if (req->epoch != epoch){
+			continue;
+		}
+		if (req->lba >= s->pos){
+			return req;
+		}
+		if (first == null){
+			first = req;
+		}
+	}
+	// Wrap around to the lowest LBA
+	return first;
+}
+/**
+* Unlink a request from the pending list
+*/
+static void iosched_unlink(iosched_t *s, block_req_t *req){
+	block_req_t **link = &s->pending;
+	while (*link != null && *link != req){
+		link = &(*link)->next;
+	}
+	if (*link == req){
+		*link = req->next;
+		req->next = null;
+	}
+}
+/**
+* Turn a request plus the adjacent requests that follow it into a command
+*/
+static void iosched_build(iosched_t *s, iosched_cmd_t *cmd, block_req_t *req){
+	block_dev_t *dev = s->dev;
+	block_req_t *tail = req;
+	block_req_t *next;
+	uint64 max_sg = IOSCHED_MAX_SG;
+	uint64 i;
+	if (dev->max_segments != 0 && dev->max_segments < max_sg){
+		max_sg = dev->max_segments;
+	}
+	next = req->next;
+	iosched_unlink(s, req);
+	mem_fill((uint8 *)&cmd->req, sizeof(block_req_t), 0);
+	cmd->req.op = req->op;
+	cmd->req.flags = req->flags;
+	cmd->req.lba = req->lba;
+	cmd->req.count = req->count;
+	cmd->req.sg = cmd->sg;
+	cmd->req.done = iosched_done;
+	cmd->req.priv = cmd;
+	cmd->head = req;
+	// A single request always fits - block_submit checked the limits
+	for (i = 0; i < req->sg_count; i ++){
+		cmd->sg[cmd->req.sg_count ++] = req->sg[i];
+	}
+	// Back merges (never across a barrier or between FUA and cached writes)
+	while (next != null && next->op == req->op && next->flags == req->flags && next->epoch == req->epoch
+		&& (req->flags & BLOCK_REQ_BARRIER) == 0 && next->lba == cmd->req.lba + cmd->req.count
+		&& cmd->req.sg_count + next->sg_count <= max_sg
+		&& (dev->max_sectors == 0 || cmd->req.count + next->count <= dev->max_sectors)){
+		req = next;
+		next = req->next;
+		iosched_unlink(s, req);
+		for (i = 0; i < req->sg_count; i ++){
+			cmd->sg[cmd->req.sg_count ++] = req->sg[i];
+		}
+		cmd->req.count += req->count;
+		tail->next = req;
+		tail = req;
+		s->stats.merged ++;
+	}
+	s->pos = cmd->req.lba + cmd->req.count;
+}
+
+bool iosched_attach(block_dev_t *dev){
+	iosched_t *s = &_iosched[dev->idx];
+	uint64 depth = dev->queue_depth;
+	mem_fill((uint8 *)s, sizeof(iosched_t), 0);
+	s->dev = dev;
+	s->depth = depth;
+	s->cmd = (iosched_cmd_t *)page_reserve(depth * sizeof(iosched_cmd_t));
+	if (s->cmd == null){
+		return false;
+	}
+	dev->sched = s;
+	return true;
+}
+
+void iosched_add(block_dev_t *dev, block_req_t *req){
+	iosched_t *s = (iosched_t *)dev->sched;
+	block_req_t **link;
+	block_req_t *cur;
+	block_req_t *child;
+	uint64 end = req->lba + req->count;
+	s->stats.requests ++;
+	req->next = null;
+	req->merged = null;
+	req->deadline = timer_ticks() + timer_us_to_ticks(req->op == BLOCK_OP_READ ? IOSCHED_READ_EXPIRE_US : IOSCHED_WRITE_EXPIRE_US);
+	if ((req->flags & BLOCK_REQ_BARRIER) != 0){
+		// Barrier gets an interval of its own, requests after it start the next one
+		s->epoch ++;
+		req->epoch = s->epoch;
+		s->epoch ++;
+		s->stats.barriers ++;
+	} else if (req->op == BLOCK_OP_READ){
+		req->epoch = s->epoch;
+		// Read inside a queued read rides along with it
+		for (cur = s->pending; cur != null; cur = cur->next){
+			if (cur->op == BLOCK_OP_READ && cur->epoch == req->epoch && req->lba >= cur->lba && end <= cur->lba + cur->count){
+				req->next = cur->merged;
+				cur->merged = req;
+				if (req->deadline < cur->deadline){
+					cur->deadline = req->deadline;
+				}
+				s->stats.piggybacked ++;
+				return;
+			}
+		}
+	} else {
+		req->epoch = s->epoch;
+		// Queued writes this one overwrites completely complete with it
+		// (a cached write can't stand in for a FUA one)
+		link = &s->pending;
+		while (*link != null){
+			cur = *link;
+			if (cur->op == BLOCK_OP_WRITE && cur->epoch == req->epoch && cur->lba >= req->lba && cur->lba + cur->count <= end
+				&& ((cur->flags & BLOCK_REQ_FUA) == 0 || (req->flags & BLOCK_REQ_FUA) != 0)){
+				*link = cur->next;
+				// Writes it superseded itself come along
+				while (cur->merged != null){
+					child = cur->merged;
+					cur->merged = child->next;
+					child->next = req->merged;
+					req->merged = child;
+				}
+				cur->next = req->merged;
+				req->merged = cur;
+				if (cur->deadline < req->deadline){
+					req->deadline = cur->deadline;
+				}
+				s->stats.superseded ++;
+			} else {
+				link = &cur->next;
+			}
+		}
+	}
+	// Insert sorted by LBA
+	link = &s->pending;
+	while (*link != null && (*link)->lba <= req->lba){
+		link = &(*link)->next;
+	}
+	req->next = *link;
+	*link = req;
+	if (s->plug == 0){
+		iosched_kick(dev);
+	}
+}
+
+void iosched_plug(block_dev_t *dev){
+	((iosched_t *)dev->sched)->plug ++;
+}
+
+void iosched_unplug(block_dev_t *dev){
+	iosched_t *s = (iosched_t *)dev->sched;
+	if (s->plug > 0){
+		s->plug --;
+	}
+	if (s->plug == 0){
+		iosched_kick(dev);
+	}
+}
+
+void iosched_kick(block_dev_t *dev){
+	iosched_t *s = (iosched_t *)dev->sched;
+	iosched_cmd_t *cmd;
+	uint64 epoch;
+	uint64 i;
+	bool sent = false;
+	// Completions of synchronous drivers re-enter from submit
+	if (s->dispatching){
+		return;
+	}
+	s->dispatching = true;
+	while (s->pending != null && s->in_flight < s->depth){
+		// Next barrier interval starts when the previous one has completed
+		epoch = iosched_epoch(s);
+		if (s->in_flight > 0 && epoch != s->epoch_out){
+			break;
+		}
+		for (i = 0; i < s->depth && s->cmd[i].used; i ++);
+		if (i == s->depth){
+			break;
+		}
+		cmd = &s->cmd[i];
+		cmd->used = true;
+		cmd->sched = s;
+		s->epoch_out = epoch;
+		iosched_build(s, cmd, iosched_pick(s, epoch));
+		s->in_flight ++;
+		s->stats.dispatched ++;
+		while (!dev->ops->submit(dev, &cmd->req)){
+			dev->ops->poll(dev, true);
+		}
+		sent = true;
+	}
+	// One doorbell for the whole batch
+	if (sent && dev->ops->commit != null){
+		dev->ops->commit(dev);
+	}
+	s->dispatching = false;
+}
+
+void iosched_get_stats(block_dev_t *dev, iosched_stats_t *stats){
+	mem_copy((uint8 *)stats, sizeof(iosched_stats_t), (uint8 *)&((iosched_t *)dev->sched)->stats);
+}
+
+#if DEBUG == 1
+void iosched_list(){
+	uint64 i;
+	iosched_t *s;
+	for (i = 0; i < BLOCK_MAX_DEV; i ++){
+		s = &_iosched[i];
+		if (s->dev != null){
+			debug_print(DC_WB, "%s: requests:%u, commands:%u, merged:%u, piggybacked:%u, superseded:%u, expired:%u, barriers:%u",
+				s->dev->name, s->stats.requests, s->stats.dispatched, s->stats.merged,
+				s->stats.piggybacked, s->stats.superseded, s->stats.expired, s->stats.barriers);
+		}
+	}
+}
+#endif
@@ -0,0 +1,103 @@
+/*
+
+Block I/O scheduler
+===================
+
+Sits between block layer callers and the driver queue: holds requests
+back while plugged, keeps them sorted by LBA, merges adjacent and
+overlapping ones and dispatches in elevator order unless a request
+deadline expires.
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef __iosched_h
+#define __iosched_h
+
+#include "common.h"
+#include "../config.h"
+#include "block.h"
+
+/**
+* Scheduler counters
+*/
+typedef struct {
+	uint64 requests;			// Requests submitted
+	uint64 dispatched;			// Commands sent to the driver
+	uint64 merged;				// Requests appended to an adjacent request
+	uint64 piggybacked;			// Reads served by an overlapping read
+	uint64 superseded;			// Writes overwritten before they were dispatched
+	uint64 expired;				// Requests dispatched out of order on deadline
+	uint64 barriers;			// Barrier requests submitted
+} iosched_stats_t;
+
+/**
+* Put a scheduler in front of a device
+* @param dev - block device
+* @return false if there's no memory for it
+*/
+bool iosched_attach(block_dev_t *dev);
+/**
+* Queue a validated request
+* @param dev - block device with a scheduler
+* @param req - request
+*/
+void iosched_add(block_dev_t *dev, block_req_t *req);
+/**
+* Hold back dispatching (nests)
+* @param dev - block device with a scheduler
+*/
+void iosched_plug(block_dev_t *dev);
+/**
+* Release a plug, dispatching queued requests when the last one goes
+* @param dev - block device with a scheduler
+*/
+void iosched_unplug(block_dev_t *dev);
+/**
+* Dispatch queued requests even while plugged (someone is waiting)
+* @param dev - block device with a scheduler
+*/
+void iosched_kick(block_dev_t *dev);
+/**
+* Get scheduler counters
+* @param dev - block device with a scheduler
+* @param [out] stats - counters
+*/
+void iosched_get_stats(block_dev_t *dev, iosched_stats_t *stats);
+
+#if DEBUG == 1
+/**
+* Print merge and dispatch counters of every scheduled device
+*/
+void iosched_list();
+#endif
+
+#endif /* __iosched_h */
@@ -41,10 +41,20 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "io.h"
 #include "interrupts.h"
 #include "paging.h"
+#include "slab.h"
+#include "dma.h"
+#include "timer.h"
 #include "acpi.h"
 #include "apic.h"
 #include "pci.h"
+#include "block.h"
+#include "iosched.h"
+#include "bcache.h"
 #include "ahci.h"
+#include "nvme.h"
+#include "virtio.h"
+#include "raid0.h"
+#include "gpt.h"
 #if DEBUG == 1
 	#include "debug_print.h"
 #endif
@@ -53,6 +63,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 * Kernel entry point
 */
 void kmain(){
+	block_dev_t *members[RAID0_MAX_MEMBERS];
+	uint64 striped = 0;
+	block_dev_t *bdev;
+	uint64 count;
+	uint64 i;
+	uint64 j;
+#ifdef RAID0_MEMBERS
+	const char *raid0_names[] = RAID0_MEMBERS;
+#endif
 
 #if DEBUG == 1
 	// Clear the screen
@@ -63,8 +82,14 @@ void kmain(){
 
 	// Initialize paging (well, actually re-initialize)
 	page_init();
+	// Set DMA zone pools aside while low memory is still free
+	dma_init();
 	// Initialize interrupts
 	interrupt_init();
+	// Calibrate timer
+	timer_init();
+	// Set up block buffer cache
+	bcache_init(BCACHE_SIZE);
 	
 #if DEBUG == 1
 	// Show memory ammount
@@ -79,6 +104,10 @@ void kmain(){
 #endif
 		// Initialize APIC
 		apic_init();
+		// Give every CPU its own frame cache
+		page_mag_init();
+		// Set up kernel heap
+		slab_init();
 		// Initialize PCI
 		pci_init();
 #if DEBUG == 1
@@ -87,8 +116,56 @@ void kmain(){
 #endif
 		// Initialize AHCI
 		if (ahci_init()){
-
+#if DEBUG == 1
+			//dma_list();
+			//block_list();
+			//iosched_list();
+			//bcache_list();
+#endif
+		}
+		// Initialize NVMe
+		if (nvme_init()){
+#if DEBUG == 1
+			//nvme_list();
+#endif
+		}
+		// Initialize virtio-blk
+		if (virtio_init()){
+#if DEBUG == 1
+			//virtio_list();
+#endif
+		}
+#ifdef RAID0_MEMBERS
+		// Stripe the configured devices together
+		for (i = 0; i < sizeof(raid0_names) / sizeof(raid0_names[0]) && striped < RAID0_MAX_MEMBERS; i ++){
+			members[striped] = block_find(raid0_names[i]);
+			if (members[striped] != null){
+				striped ++;
+			}
+		}
+		if (striped < 2 || raid0_create("raid0", members, striped, RAID0_CHUNK_SIZE) == null){
+			striped = 0;
 		}
+#if DEBUG == 1
+		//raid0_list();
+#endif
+#endif
+		// Register partitions of every disk found - members of the striped
+		// set are skipped, their first chunk is the set's partition table
+		count = block_num_dev();
+		for (i = 0; i < count; i ++){
+			bdev = block_get(i);
+			for (j = 0; j < striped && members[j] != bdev; j ++){}
+			if (j == striped){
+				gpt_scan(bdev);
+			}
+		}
+#if DEBUG == 1
+		//gpt_list();
+		//block_stats_list();
+		//page_mag_list();
+		//slab_list();
+#endif
 	}
 
 	// Test interrupt exceptions
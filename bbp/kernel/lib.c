@@ -61,6 +61,34 @@ bool mem_compare(const uint8 *buff1, const uint8 *buff2, uint64 len){
 	return true;
 }
 
+//
+// Checksum functions
+//
+
+uint32 crc32(uint32 crc, const uint8 *buff, uint64 len){
+	static uint32 table[256];
+	static bool table_ready = false;
+	uint32 c;
+	uint32 i;
+	uint32 k;
+	if (!table_ready){
+		// Reflected polynomial 0x04C11DB7
+		for (i = 0; i < 256; i ++){
+			c = i;
+			for (k = 0; k < 8; k ++){
+				c = ((c & 1) != 0 ? 0xEDB88320 ^ (c >> 1) : (c >> 1));
+			}
+			table[i] = c;
+		}
+		table_ready = true;
+	}
+	crc = ~crc;
+	while (len--){
+		crc = table[(crc ^ *(buff++)) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
 //
 // String functions
 //
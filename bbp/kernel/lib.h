@@ -81,6 +81,20 @@ void mem_fill(uint8 *dest, uint64 len, uint8 val);
 */
 bool mem_compare(const uint8 *buff1, const uint8 *buff2, uint64 len);
 
+//
+// Checksum functions
+//
+
+/**
+* Calculate CRC32 (IEEE 802.3, as used by GPT)
+* Pass the result back in to continue over the next block of data.
+* @param crc - CRC of the data so far (0 to start)
+* @param [in] buff - data
+* @param len - data length
+* @return CRC32 including this block
+*/
+uint32 crc32(uint32 crc, const uint8 *buff, uint64 len);
+
 //
 // String functions
 //
@@ -53,6 +53,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define MSR_IA32_SYSENTER_ESP 0x175
 #define MSR_IA32_SYSENTER_EIP 0x176
 #define MSR_IA32_MISC_ENABLE 0x1A0
+#define MSR_IA32_PAT 0x277
 #define MSR_IA32_X2APIC_APICID 0x802
 #define MSR_IA32_X2APIC_VERSION 0x803
 #define MSR_IA32_X2APIC_TPR 0x808
@@ -0,0 +1,1099 @@
+/*
+
+NVMe driver
+===========
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "lib.h"
+#include "paging.h"
+#include "slab.h"
+#include "dma.h"
+#include "timer.h"
+#include "interrupts.h"
+#include "apic.h"
+#include "pci.h"
+#include "block.h"
+#include "nvme.h"
+#if DEBUG == 1
+	#include "debug_print.h"
+#endif
+
+// Controller registers
+#define NVME_REG_CAP		0x00	// Controller capabilities (64-bit)
+#define NVME_REG_VS			0x08	// Version
+#define NVME_REG_INTMS		0x0C	// Interrupt mask set
+#define NVME_REG_INTMC		0x10	// Interrupt mask clear
+#define NVME_REG_CC			0x14	// Controller configuration
+#define NVME_REG_CSTS		0x1C	// Controller status
+#define NVME_REG_AQA		0x24	// Admin queue attributes
+#define NVME_REG_ASQ		0x28	// Admin submission queue base (64-bit)
+#define NVME_REG_ACQ		0x30	// Admin completion queue base (64-bit)
+#define NVME_REG_DBS		0x1000	// First doorbell
+
+// Controller configuration bits
+#define NVME_CC_EN			(1 << 0)
+#define NVME_CC_IOSQES		(6 << 16)	// 64 byte submission entries
+#define NVME_CC_IOCQES		(4 << 20)	// 16 byte completion entries
+#define NVME_CSTS_RDY		(1 << 0)
+#define NVME_CSTS_CFS		(1 << 1)	// Controller fatal status
+
+// Admin commands
+#define NVME_ADM_CREATE_SQ	0x01
+#define NVME_ADM_CREATE_CQ	0x05
+#define NVME_ADM_IDENTIFY	0x06
+#define NVME_ADM_SET_FEATURES	0x09
+
+// NVM commands
+#define NVME_CMD_FLUSH		0x00
+#define NVME_CMD_WRITE		0x01
+#define NVME_CMD_READ		0x02
+#define NVME_CMD_DSM		0x09	// Dataset Management
+
+// Command fields
+#define NVME_CNS_NS			0x00	// Identify namespace
+#define NVME_CNS_CTRL		0x01	// Identify controller
+#define NVME_FEAT_QUEUES	0x07	// Number of queues feature
+#define NVME_QUEUE_PC		(1 << 0)	// Physically contiguous queue
+#define NVME_CQ_IEN			(1 << 1)	// Completion queue interrupts enabled
+#define NVME_RW_FUA			(1 << 30)	// Forced Unit Access
+#define NVME_DSM_AD			(1 << 2)	// Deallocate ranges
+
+// Identify controller data (byte offsets)
+#define NVME_ID_MDTS		77		// maximum transfer size (power of 2 in pages, 0 - no limit)
+#define NVME_ID_NN			516		// number of namespaces
+#define NVME_ID_ONCS		520		// bit 2 - Dataset Management supported
+#define NVME_ID_VWC			525		// bit 0 - volatile write cache present
+
+// Identify namespace data (byte offsets)
+#define NVME_ID_NSZE		0		// namespace size in logical blocks
+#define NVME_ID_FLBAS		26		// bits 3:0 - LBA format in use
+#define NVME_ID_LBAF		128		// LBA formats (bits 15:0 - metadata size, bits 23:16 - log2 LBA size)
+
+// Driver limits
+#define NVME_MAX_CTRL		4			// Controllers
+#define NVME_MAX_NS			8			// Namespaces over all controllers
+#define NVME_MAX_QUEUES		8			// I/O queue pairs per controller
+#define NVME_ADMIN_DEPTH	16			// Admin queue entries
+#define NVME_QUEUE_DEPTH	64			// I/O queue entries (one always stays empty)
+#define NVME_PRP_ENTRIES	32			// PRP list entries per command (256 bytes)
+#define NVME_MAX_BYTES		0x20000		// 128KiB per command (fits PRP1 and the list at any offset)
+#define NVME_DSM_RANGES		256			// Ranges per Dataset Management command (4KiB)
+#define NVME_DSM_RANGE_MAX	0xFFFFFFFF	// Blocks per range
+#define NVME_TIMEOUT_US		5000000		// Command timeout
+#define NVME_READY_UNIT_US	500000		// CAP.TO unit
+
+typedef struct nvme_ctrl_struct nvme_ctrl_t;
+
+/**
+* Submission queue entry
+*/
+typedef volatile struct {
+	uint8 opcode;
+	uint8 flags;
+	uint16 cid;					// Command identifier
+	uint32 nsid;				// Namespace
+	uint64 reserved;
+	uint64 mptr;				// Metadata pointer
+	uint64 prp1;				// First data page
+	uint64 prp2;				// Second data page or PRP list
+	uint32 cdw10;
+	uint32 cdw11;
+	uint32 cdw12;
+	uint32 cdw13;
+	uint32 cdw14;
+	uint32 cdw15;
+} nvme_sqe_t; // 64 bytes
+/**
+* Completion queue entry
+*/
+typedef volatile struct {
+	uint32 result;				// Command specific
+	uint32 reserved;
+	uint16 sq_head;				// Submission queue head pointer
+	uint16 sq_id;
+	uint16 cid;
+	uint16 status;				// bit 0 - phase tag, bits 15:1 - status
+} nvme_cqe_t; // 16 bytes
+/**
+* Dataset Management range
+*/
+typedef volatile struct {
+	uint32 attr;				// Context attributes
+	uint32 nlb;					// Number of logical blocks
+	uint64 slba;				// Starting LBA
+} nvme_dsm_range_t; // 16 bytes
+/**
+* Command slot - indexed by command identifier
+*/
+typedef struct {
+	bool busy;
+	bool done;					// Driver commands - completion arrived
+	uint16 status;				// Driver commands - completion status
+	uint32 result;				// Driver commands - completion result
+	block_req_t *req;			// Block request (null for driver commands)
+	uint64 bounce;				// Bounce buffer (0 if the request buffers are used)
+	uint64 bounce_len;
+} nvme_cmd_t;
+/**
+* Submission/completion queue pair
+*/
+typedef struct {
+	nvme_ctrl_t *ctrl;
+	uint16 qid;					// Queue identifier (0 - admin)
+	uint16 depth;				// Entries in each queue
+	nvme_sqe_t *sq;
+	nvme_cqe_t *cq;
+	volatile uint64 *prp;		// PRP lists, NVME_PRP_ENTRIES per command
+	uint16 sq_tail;				// Next free submission entry
+	uint16 sq_bell;				// Tail the controller has been told about
+	uint16 cq_head;				// Next completion entry
+	uint8 phase;				// Phase tag of new completions
+	uint16 in_flight;			// Busy command slots
+	uint16 barrier;				// Barrier requests in flight
+	uint8 irq;					// MSI-X IRQ (0xFF - none)
+	nvme_cmd_t cmd[NVME_QUEUE_DEPTH];
+	// Statistics
+	uint64 cmd_count;			// Commands submitted
+	uint64 sq_bells;			// Submission doorbell writes
+	uint64 cq_bells;			// Completion doorbell writes
+	uint64 irq_count;			// Interrupts
+	uint64 bounce_count;		// Bounced requests
+} nvme_queue_t;
+/**
+* Controller
+*/
+struct nvme_ctrl_struct {
+	uint64 index;
+	pci_addr_t pci;
+	uint64 regs;				// Register base
+	uint64 stride;				// Doorbell stride in bytes
+	uint64 ready_timeout;		// Enable/disable timeout (us)
+	uint64 max_bytes;			// Largest transfer per command
+	nvme_queue_t admin;
+	nvme_queue_t io[NVME_MAX_QUEUES];
+	uint64 queue_count;			// I/O queue pairs
+	uint8 irq;					// INTx IRQ (0xFF - none or MSI-X)
+	bool msix;
+	bool vwc;					// Volatile write cache present
+	bool dsm;					// Dataset Management supported
+	bool failed;
+	uint8 *buf;					// Identify and DSM buffer (4KiB)
+};
+/**
+* Namespace - private data of a block device
+*/
+typedef struct {
+	nvme_ctrl_t *ctrl;
+	uint32 nsid;
+	uint64 sectors;
+	uint64 sector_size;
+} nvme_ns_t;
+
+// Only controllers actually found get allocated
+static nvme_ctrl_t *_nvme_ctrl[NVME_MAX_CTRL];
+static uint64 _nvme_ctrl_count = 0;
+static nvme_ns_t _nvme_ns[NVME_MAX_NS];
+static uint64 _nvme_ns_count = 0;
+
+static uint32 nvme_read_reg(nvme_ctrl_t *ctrl, uint64 reg){
+	return *((uint32 volatile *)(ctrl->regs + reg));
+}
+static void nvme_write_reg(nvme_ctrl_t *ctrl, uint64 reg, uint32 value){
+	*((uint32 volatile *)(ctrl->regs + reg)) = value;
+}
+/**
+* 64-bit registers are accessed as two halves, lower one first
+*/
+static uint64 nvme_read_reg64(nvme_ctrl_t *ctrl, uint64 reg){
+	uint64 lo = nvme_read_reg(ctrl, reg);
+	return lo | ((uint64)nvme_read_reg(ctrl, reg + 4) << 32);
+}
+static void nvme_write_reg64(nvme_ctrl_t *ctrl, uint64 reg, uint64 value){
+	nvme_write_reg(ctrl, reg, (uint32)value);
+	nvme_write_reg(ctrl, reg + 4, (uint32)(value >> 32));
+}
+/**
+* Wait for the ready bit to follow the enable bit
+* @param ctrl - controller
+* @param ready - expected state
+* @return false on timeout or fatal controller status
+*/
+static bool nvme_wait_ready(nvme_ctrl_t *ctrl, bool ready){
+	uint64 start = timer_ticks();
+	uint64 timeout = timer_us_to_ticks(ctrl->ready_timeout);
+	uint32 csts;
+	while (true){
+		csts = nvme_read_reg(ctrl, NVME_REG_CSTS);
+		if (csts == 0xFFFFFFFF || (ready && (csts & NVME_CSTS_CFS) != 0)){
+			return false;
+		}
+		if (((csts & NVME_CSTS_RDY) != 0) == ready){
+			return true;
+		}
+		if (timer_ticks() - start > timeout){
+			return false;
+		}
+		asm volatile ("pause");
+	}
+}
+/**
+* Get the queue pair of the current CPU
+* Each CPU only touches its own pair, so queues need no locking.
+*/
+static nvme_queue_t *nvme_queue(nvme_ctrl_t *ctrl){
+	return &ctrl->io[apic_cpu_index() % ctrl->queue_count];
+}
+/**
+* Tell the controller about new submission entries
+* Entries are written by submit and pushed here once per batch.
+* @param q - queue pair
+*/
+static void nvme_sq_ring(nvme_queue_t *q){
+	if (q->sq_tail != q->sq_bell){
+		nvme_write_reg(q->ctrl, NVME_REG_DBS + (2 * q->qid) * q->ctrl->stride, q->sq_tail);
+		q->sq_bell = q->sq_tail;
+		q->sq_bells ++;
+	}
+}
+/**
+* Allocate a command slot
+* The number of slots in use also bounds the submission queue, which
+* always keeps one entry empty.
+* @param q - queue pair
+* @return command identifier or -1 if the queue is full
+*/
+static int64 nvme_cid_alloc(nvme_queue_t *q){
+	uint16 i;
+	nvme_cmd_t *cmd;
+	if (q->in_flight >= q->depth - 1){
+		return -1;
+	}
+	for (i = 0; i < q->depth; i ++){
+		cmd = &q->cmd[i];
+		if (!cmd->busy){
+			cmd->busy = true;
+			cmd->done = false;
+			cmd->status = 0;
+			cmd->result = 0;
+			cmd->req = null;
+			cmd->bounce = 0;
+			cmd->bounce_len = 0;
+			q->in_flight ++;
+			return i;
+		}
+	}
+	return -1;
+}
+/**
+* Release a command slot
+*/
+static void nvme_cid_free(nvme_queue_t *q, uint16 cid){
+	q->cmd[cid].busy = false;
+	q->in_flight --;
+}
+/**
+* Take the next submission entry
+* @param q - queue pair
+* @param cid - command identifier
+* @param opcode - command opcode
+* @param nsid - namespace (0 for admin commands)
+* @return cleared submission entry
+*/
+static nvme_sqe_t *nvme_sq_entry(nvme_queue_t *q, uint16 cid, uint8 opcode, uint32 nsid){
+	nvme_sqe_t *sqe = &q->sq[q->sq_tail];
+	mem_fill((uint8 *)sqe, sizeof(nvme_sqe_t), 0);
+	sqe->opcode = opcode;
+	sqe->cid = cid;
+	sqe->nsid = nsid;
+	q->sq_tail = (q->sq_tail + 1 == q->depth ? 0 : q->sq_tail + 1);
+	q->cmd_count ++;
+	return sqe;
+}
+/**
+* Finish a command whose completion has arrived
+* @param q - queue pair
+* @param cid - command identifier
+* @param status - status field (phase tag shifted out)
+* @param result - command specific result
+*/
+static void nvme_cmd_done(nvme_queue_t *q, uint16 cid, uint16 status, uint32 result){
+	nvme_cmd_t *cmd = &q->cmd[cid];
+	block_req_t *req = cmd->req;
+	// Status code and status code type
+	bool ok = ((status & 0x7FF) == 0);
+	uint64 off = 0;
+	uint64 i;
+	if (cmd->bounce != 0){
+		if (ok && req->op == BLOCK_OP_READ){
+			for (i = 0; i < req->sg_count; i ++){
+				mem_copy((uint8 *)req->sg[i].addr, req->sg[i].len, (uint8 *)(cmd->bounce + off));
+				off += req->sg[i].len;
+			}
+		}
+		dma_free(cmd->bounce, cmd->bounce_len);
+		cmd->bounce = 0;
+	}
+	if (req == null){
+		// Driver command - the waiter releases the slot
+		cmd->status = status;
+		cmd->result = result;
+		cmd->done = true;
+		return;
+	}
+	if ((req->flags & BLOCK_REQ_BARRIER) != 0){
+		q->barrier --;
+	}
+	nvme_cid_free(q, cid);
+	block_complete(req, ok);
+}
+/**
+* Reap new completion entries
+* The completion doorbell is written once for the whole batch.
+* @param q - queue pair
+* @return number of entries reaped
+*/
+static uint64 nvme_cq_reap(nvme_queue_t *q){
+	nvme_cqe_t *cqe;
+	uint16 status;
+	uint16 cid;
+	uint32 result;
+	uint64 n = 0;
+	while (true){
+		cqe = &q->cq[q->cq_head];
+		status = cqe->status;
+		if ((status & 1) != q->phase){
+			break;
+		}
+		cid = cqe->cid;
+		result = cqe->result;
+		q->cq_head ++;
+		if (q->cq_head == q->depth){
+			q->cq_head = 0;
+			q->phase ^= 1;
+		}
+		n ++;
+		if (cid < q->depth && q->cmd[cid].busy){
+			nvme_cmd_done(q, cid, status >> 1, result);
+		}
+	}
+	if (n > 0){
+		nvme_write_reg(q->ctrl, NVME_REG_DBS + (2 * q->qid + 1) * q->ctrl->stride, q->cq_head);
+		q->cq_bells ++;
+	}
+	return n;
+}
+/**
+* Give up on a controller that stopped responding
+* Disabling the controller drops every command it holds, so all busy
+* slots are completed with an error.
+* @param ctrl - controller
+*/
+static void nvme_fail(nvme_ctrl_t *ctrl){
+	nvme_queue_t *q;
+	uint64 i;
+	uint16 cid;
+	ctrl->failed = true;
+	nvme_write_reg(ctrl, NVME_REG_CC, nvme_read_reg(ctrl, NVME_REG_CC) & ~NVME_CC_EN);
+	nvme_wait_ready(ctrl, false);
+	for (i = 0; i <= ctrl->queue_count; i ++){
+		q = (i == 0 ? &ctrl->admin : &ctrl->io[i - 1]);
+		for (cid = 0; cid < q->depth; cid ++){
+			if (q->cmd[cid].busy && !q->cmd[cid].done){
+				// Generic command status: internal error
+				nvme_cmd_done(q, cid, 0x06, 0);
+			}
+		}
+	}
+}
+/**
+* Sleep until the next interrupt, unless completions are waiting already
+* @param q - queue pair
+*/
+static void nvme_sleep(nvme_queue_t *q){
+	nvme_ctrl_t *ctrl = q->ctrl;
+	if (q->irq == 0xFF && ctrl->irq == 0xFF){
+		asm volatile ("pause");
+		return;
+	}
+	asm volatile ("cli");
+	if (ctrl->irq != 0xFF){
+		// INTx handler masks the controller, unmask it to get woken up
+		nvme_write_reg(ctrl, NVME_REG_INTMC, 1);
+	}
+	if ((q->cq[q->cq_head].status & 1) != q->phase){
+		// STI takes effect after HLT starts, so the wake-up can't slip in between
+		asm volatile ("sti\n\thlt");
+	} else {
+		asm volatile ("sti");
+	}
+}
+/**
+* Push pending submissions and reap completions
+* @param q - queue pair
+* @param wait - block until at least one command completes
+*/
+static void nvme_poll(nvme_queue_t *q, bool wait){
+	uint64 start = timer_ticks();
+	uint64 timeout = timer_us_to_ticks(NVME_TIMEOUT_US);
+	nvme_sq_ring(q);
+	while (nvme_cq_reap(q) == 0 && wait && q->in_flight > 0 && !q->ctrl->failed){
+		if (timer_ticks() - start > timeout){
+			nvme_fail(q->ctrl);
+			return;
+		}
+		if (q->qid == 0){
+			asm volatile ("pause");
+		} else {
+			nvme_sleep(q);
+		}
+	}
+}
+/**
+* Get a free command slot, reaping completions while the queue is full
+* @param q - queue pair
+* @return command identifier or -1 if the controller has failed
+*/
+static int64 nvme_cid_wait(nvme_queue_t *q){
+	int64 cid;
+	while ((cid = nvme_cid_alloc(q)) < 0 && !q->ctrl->failed){
+		nvme_poll(q, true);
+	}
+	return (q->ctrl->failed ? -1 : cid);
+}
+/**
+* Send a driver command and wait for its completion
+* @param q - queue pair
+* @param cid - command identifier (filled in with nvme_sq_entry)
+* @param [out] result - command specific result (optional)
+* @return false on error or timeout
+*/
+static bool nvme_exec(nvme_queue_t *q, uint16 cid, uint32 *result){
+	nvme_cmd_t *cmd = &q->cmd[cid];
+	bool ok;
+	while (!cmd->done && !q->ctrl->failed){
+		nvme_poll(q, true);
+	}
+	ok = (cmd->done && (cmd->status & 0x7FF) == 0);
+	if (result != null){
+		*result = cmd->result;
+	}
+	nvme_cid_free(q, cid);
+	return ok;
+}
+/**
+* Translate a buffer address for DMA, mapping the page in if needed
+* @param vaddr - virtual address
+* @return physical address or 0 if the page can't be mapped
+*/
+static uint64 nvme_resolve(uint64 vaddr){
+	uint64 paddr = page_resolve(vaddr);
+	if (paddr == 0 && (vaddr & PAGE_MASK) != 0){
+		// Touch the page so the page fault handler maps it in
+		*((volatile uint8 *)vaddr);
+		paddr = page_resolve(vaddr);
+	}
+	return paddr;
+}
+/**
+* Describe buffers with PRP entries
+* Only the first page may start at an offset and only the last one may
+* end early - buffers that break the rules have to be bounced.
+* @param q - queue pair
+* @param cid - command identifier (selects the PRP list)
+* @param sg - data buffers
+* @param sg_count - number of scatter-gather entries
+* @param [out] prp1 - first PRP entry
+* @param [out] prp2 - second PRP entry or PRP list address
+* @return false if the buffers can't be described
+*/
+static bool nvme_build_prp(nvme_queue_t *q, uint16 cid, block_sg_t *sg, uint64 sg_count, uint64 *prp1, uint64 *prp2){
+	volatile uint64 *list = &q->prp[(uint64)cid * NVME_PRP_ENTRIES];
+	uint64 n = 0;
+	uint64 addr;
+	uint64 len;
+	uint64 chunk;
+	uint64 paddr;
+	uint64 i;
+	bool page_end = true;
+	for (i = 0; i < sg_count; i ++){
+		addr = sg[i].addr;
+		len = sg[i].len;
+		while (len > 0){
+			paddr = nvme_resolve(addr);
+			chunk = PAGE_SIZE - (addr & PAGE_IMASK);
+			if (chunk > len){
+				chunk = len;
+			}
+			if ((paddr == 0 && (addr & PAGE_MASK) != 0) || (paddr & 0x3) != 0 || !page_end || (n > 0 && (paddr & PAGE_IMASK) != 0)){
+				return false;
+			}
+			if (n == 0){
+				*prp1 = paddr;
+			} else if (n <= NVME_PRP_ENTRIES){
+				list[n - 1] = paddr;
+			} else {
+				return false;
+			}
+			page_end = (((addr + chunk) & PAGE_IMASK) == 0);
+			addr += chunk;
+			len -= chunk;
+			n ++;
+		}
+	}
+	if (n <= 1){
+		*prp2 = 0;
+	} else if (n == 2){
+		*prp2 = list[0];
+	} else {
+		*prp2 = (uint64)list;
+	}
+	return (n > 0);
+}
+/**
+* Copy request buffers into a physically contiguous bounce buffer
+* @param q - queue pair
+* @param cid - command identifier
+* @param req - block request
+* @param len - transfer length in bytes
+* @param [out] prp1 - first PRP entry
+* @param [out] prp2 - second PRP entry or PRP list address
+* @return false if there is no DMA memory left
+*/
+static bool nvme_bounce_map(nvme_queue_t *q, uint16 cid, block_req_t *req, uint64 len, uint64 *prp1, uint64 *prp2){
+	nvme_cmd_t *cmd = &q->cmd[cid];
+	block_sg_t sg;
+	uint64 off = 0;
+	uint64 i;
+	cmd->bounce = dma_alloc(len, PAGE_SIZE, DMA_ZONE_ANY);
+	if (cmd->bounce == 0){
+		return false;
+	}
+	cmd->bounce_len = len;
+	if (req->op == BLOCK_OP_WRITE){
+		for (i = 0; i < req->sg_count; i ++){
+			mem_copy((uint8 *)(cmd->bounce + off), req->sg[i].len, (uint8 *)req->sg[i].addr);
+			off += req->sg[i].len;
+		}
+	}
+	sg.addr = cmd->bounce;
+	sg.len = len;
+	q->bounce_count ++;
+	return nvme_build_prp(q, cid, &sg, 1, prp1, prp2);
+}
+
+/**
+* Block layer glue - the namespace travels in the private pointer
+* Submit only writes the submission entry, the doorbell is rung by
+* commit (or poll) once for the whole batch.
+*/
+static bool nvme_block_submit(block_dev_t *bdev, block_req_t *req){
+	nvme_ns_t *ns = (nvme_ns_t *)bdev->priv;
+	nvme_queue_t *q = nvme_queue(ns->ctrl);
+	uint64 len = req->count * ns->sector_size;
+	uint64 prp1 = 0;
+	uint64 prp2 = 0;
+	nvme_sqe_t *sqe;
+	int64 cid;
+	if (ns->ctrl->failed){
+		block_complete(req, false);
+		return true;
+	}
+	// Commands complete out of order - a barrier drains the queue on both sides
+	if (q->barrier > 0 || ((req->flags & BLOCK_REQ_BARRIER) != 0 && q->in_flight > 0)){
+		return false;
+	}
+	cid = nvme_cid_alloc(q);
+	if (cid < 0){
+		return false;
+	}
+	q->cmd[cid].req = req;
+	if (!nvme_build_prp(q, cid, req->sg, req->sg_count, &prp1, &prp2) && !nvme_bounce_map(q, cid, req, len, &prp1, &prp2)){
+		q->cmd[cid].req = null;
+		nvme_cid_free(q, cid);
+		block_complete(req, false);
+		return true;
+	}
+	if ((req->flags & BLOCK_REQ_BARRIER) != 0){
+		q->barrier ++;
+	}
+	sqe = nvme_sq_entry(q, cid, (req->op == BLOCK_OP_WRITE ? NVME_CMD_WRITE : NVME_CMD_READ), ns->nsid);
+	sqe->prp1 = prp1;
+	sqe->prp2 = prp2;
+	sqe->cdw10 = (uint32)req->lba;
+	sqe->cdw11 = (uint32)(req->lba >> 32);
+	sqe->cdw12 = (uint32)(req->count - 1);
+	if (req->op == BLOCK_OP_WRITE && (req->flags & BLOCK_REQ_FUA) != 0){
+		sqe->cdw12 |= NVME_RW_FUA;
+	}
+	return true;
+}
+static void nvme_block_commit(block_dev_t *bdev){
+	nvme_sq_ring(nvme_queue(((nvme_ns_t *)bdev->priv)->ctrl));
+}
+static void nvme_block_poll(block_dev_t *bdev, bool wait){
+	nvme_poll(nvme_queue(((nvme_ns_t *)bdev->priv)->ctrl), wait);
+}
+static bool nvme_block_flush(block_dev_t *bdev){
+	nvme_ns_t *ns = (nvme_ns_t *)bdev->priv;
+	nvme_queue_t *q = nvme_queue(ns->ctrl);
+	int64 cid;
+	// Writes go straight to the media without a volatile cache
+	if (!ns->ctrl->vwc){
+		return !ns->ctrl->failed;
+	}
+	cid = nvme_cid_wait(q);
+	if (cid < 0){
+		return false;
+	}
+	nvme_sq_entry(q, cid, NVME_CMD_FLUSH, ns->nsid);
+	return nvme_exec(q, cid, null);
+}
+static bool nvme_block_discard(block_dev_t *bdev, uint64 lba, uint64 count){
+	nvme_ns_t *ns = (nvme_ns_t *)bdev->priv;
+	nvme_queue_t *q = nvme_queue(ns->ctrl);
+	nvme_dsm_range_t *range = (nvme_dsm_range_t *)ns->ctrl->buf;
+	nvme_sqe_t *sqe;
+	uint64 n;
+	uint64 r;
+	int64 cid;
+	if (!ns->ctrl->dsm){
+		return false;
+	}
+	while (count > 0){
+		cid = nvme_cid_wait(q);
+		if (cid < 0){
+			return false;
+		}
+		for (r = 0; r < NVME_DSM_RANGES && count > 0; r ++){
+			n = (count > NVME_DSM_RANGE_MAX ? NVME_DSM_RANGE_MAX : count);
+			range[r].attr = 0;
+			range[r].nlb = (uint32)n;
+			range[r].slba = lba;
+			lba += n;
+			count -= n;
+		}
+		sqe = nvme_sq_entry(q, cid, NVME_CMD_DSM, ns->nsid);
+		sqe->prp1 = (uint64)range;
+		sqe->cdw10 = (uint32)(r - 1);
+		sqe->cdw11 = NVME_DSM_AD;
+		if (!nvme_exec(q, cid, null)){
+			return false;
+		}
+	}
+	return true;
+}
+
+static block_ops_t _nvme_block_ops = {
+	.submit = nvme_block_submit,
+	.commit = nvme_block_commit,
+	.poll = nvme_block_poll,
+	.flush = nvme_block_flush,
+	.discard = nvme_block_discard
+};
+
+/**
+* Interrupt handler - completions are reaped by whoever waits for them
+*/
+static void nvme_irq(uint8 irq){
+	nvme_ctrl_t *ctrl;
+	uint64 i;
+	uint64 q;
+	for (i = 0; i < _nvme_ctrl_count; i ++){
+		ctrl = _nvme_ctrl[i];
+		if (ctrl->irq == irq){
+			// Level triggered line stays asserted until the queues are reaped
+			nvme_write_reg(ctrl, NVME_REG_INTMS, 1);
+			nvme_queue(ctrl)->irq_count ++;
+		}
+		for (q = 0; q < ctrl->queue_count; q ++){
+			if (ctrl->io[q].irq == irq){
+				ctrl->io[q].irq_count ++;
+			}
+		}
+	}
+}
+/**
+* Allocate queue memory and reset the queue state
+* @param ctrl - controller
+* @param q - queue pair
+* @param qid - queue identifier
+* @param depth - entries in each queue
+* @return false if there is no DMA memory left
+*/
+static bool nvme_queue_init(nvme_ctrl_t *ctrl, nvme_queue_t *q, uint16 qid, uint16 depth){
+	mem_fill((uint8 *)q, sizeof(nvme_queue_t), 0);
+	q->ctrl = ctrl;
+	q->qid = qid;
+	q->depth = depth;
+	q->phase = 1;
+	q->irq = 0xFF;
+	q->sq = (nvme_sqe_t *)dma_alloc(sizeof(nvme_sqe_t) * depth, PAGE_SIZE, DMA_ZONE_ANY);
+	q->cq = (nvme_cqe_t *)dma_alloc(sizeof(nvme_cqe_t) * depth, PAGE_SIZE, DMA_ZONE_ANY);
+	q->prp = (volatile uint64 *)dma_alloc(sizeof(uint64) * NVME_PRP_ENTRIES * depth, PAGE_SIZE, DMA_ZONE_ANY);
+	return (q->sq != null && q->cq != null && q->prp != null);
+}
+/**
+* Send an Identify command
+* @param ctrl - controller
+* @param cns - data structure to return
+* @param nsid - namespace
+* @return false on failure (data goes to ctrl->buf)
+*/
+static bool nvme_identify(nvme_ctrl_t *ctrl, uint8 cns, uint32 nsid){
+	nvme_sqe_t *sqe;
+	int64 cid = nvme_cid_wait(&ctrl->admin);
+	if (cid < 0){
+		return false;
+	}
+	sqe = nvme_sq_entry(&ctrl->admin, cid, NVME_ADM_IDENTIFY, nsid);
+	sqe->prp1 = (uint64)ctrl->buf;
+	sqe->cdw10 = cns;
+	return nvme_exec(&ctrl->admin, cid, null);
+}
+/**
+* Ask for I/O queue pairs
+* @param ctrl - controller
+* @param count - queue pairs wanted
+* @return queue pairs granted (0 on failure)
+*/
+static uint64 nvme_set_queues(nvme_ctrl_t *ctrl, uint64 count){
+	nvme_sqe_t *sqe;
+	uint32 result;
+	uint64 granted;
+	int64 cid = nvme_cid_wait(&ctrl->admin);
+	if (cid < 0){
+		return 0;
+	}
+	sqe = nvme_sq_entry(&ctrl->admin, cid, NVME_ADM_SET_FEATURES, 0);
+	sqe->cdw10 = NVME_FEAT_QUEUES;
+	sqe->cdw11 = (uint32)((count - 1) | ((count - 1) << 16));
+	if (!nvme_exec(&ctrl->admin, cid, &result)){
+		return 0;
+	}
+	// Allocated counts are zero based
+	granted = (result & 0xFFFF) + 1;
+	if ((result >> 16) + 1 < granted){
+		granted = (result >> 16) + 1;
+	}
+	return (granted < count ? granted : count);
+}
+/**
+* Create an I/O completion queue and the submission queue feeding it
+* @param ctrl - controller
+* @param q - queue pair (memory allocated)
+* @param vector - interrupt vector (MSI-X entry)
+* @return false on failure
+*/
+static bool nvme_create_queue(nvme_ctrl_t *ctrl, nvme_queue_t *q, uint16 vector){
+	nvme_sqe_t *sqe;
+	int64 cid = nvme_cid_wait(&ctrl->admin);
+	if (cid < 0){
+		return false;
+	}
+	sqe = nvme_sq_entry(&ctrl->admin, cid, NVME_ADM_CREATE_CQ, 0);
+	sqe->prp1 = (uint64)q->cq;
+	sqe->cdw10 = q->qid | ((uint32)(q->depth - 1) << 16);
+	sqe->cdw11 = NVME_QUEUE_PC | ((uint32)vector << 16);
+	if (q->irq != 0xFF || ctrl->irq != 0xFF){
+		sqe->cdw11 |= NVME_CQ_IEN;
+	}
+	if (!nvme_exec(&ctrl->admin, cid, null)){
+		return false;
+	}
+	cid = nvme_cid_wait(&ctrl->admin);
+	if (cid < 0){
+		return false;
+	}
+	sqe = nvme_sq_entry(&ctrl->admin, cid, NVME_ADM_CREATE_SQ, 0);
+	sqe->prp1 = (uint64)q->sq;
+	sqe->cdw10 = q->qid | ((uint32)(q->depth - 1) << 16);
+	sqe->cdw11 = NVME_QUEUE_PC | ((uint32)q->qid << 16);
+	return nvme_exec(&ctrl->admin, cid, null);
+}
+/**
+* Route queue interrupts - one MSI-X vector per queue pair, or the
+* INTx line shared by all of them, or none (queues are polled)
+* @param ctrl - controller
+* @param dev - PCI configuration
+*/
+static void nvme_init_irq(nvme_ctrl_t *ctrl, pci_device_t *dev){
+	uint16 vectors = pci_msix_count(ctrl->pci);
+	uint64 msg_addr;
+	uint32 msg_data;
+	uint64 i;
+	ctrl->irq = 0xFF;
+	ctrl->msix = false;
+	if (vectors > 0){
+		for (i = 0; i < ctrl->queue_count && i < vectors; i ++){
+			ctrl->io[i].irq = irq_alloc_msi(nvme_irq, &msg_addr, &msg_data);
+			if (ctrl->io[i].irq == 0xFF){
+				break;
+			}
+			pci_msix_set(ctrl->pci, i, msg_addr, msg_data);
+			ctrl->msix = true;
+		}
+		if (ctrl->msix){
+			pci_msix_enable(ctrl->pci);
+			return;
+		}
+	}
+	if (dev->int_line < 16 && irq_register(dev->int_line, nvme_irq)){
+		ctrl->irq = dev->int_line;
+	}
+}
+/**
+* Reset a controller and bring up its admin queue
+* @param ctrl - controller (registers mapped)
+* @return false on failure
+*/
+static bool nvme_enable(nvme_ctrl_t *ctrl){
+	uint64 cap = nvme_read_reg64(ctrl, NVME_REG_CAP);
+	uint64 depth = NVME_ADMIN_DEPTH;
+	uint64 page;
+	ctrl->stride = (4 << ((cap >> 32) & 0xF));
+	// Map the doorbells of the admin and every I/O queue pair
+	for (page = PAGE_SIZE; page < NVME_REG_DBS + (2 * (NVME_MAX_QUEUES + 1)) * ctrl->stride; page += PAGE_SIZE){
+		page_map_mmio(ctrl->regs + page);
+	}
+	ctrl->ready_timeout = ((cap >> 24) & 0xFF) * NVME_READY_UNIT_US;
+	if (ctrl->ready_timeout == 0){
+		ctrl->ready_timeout = NVME_READY_UNIT_US;
+	}
+	// NVM command set and 4KiB memory pages have to be supported
+	if (((cap >> 37) & 0x1) == 0 || ((cap >> 48) & 0xF) != 0){
+		return false;
+	}
+	if ((cap & 0xFFFF) + 1 < depth){
+		depth = (cap & 0xFFFF) + 1;
+	}
+	nvme_write_reg(ctrl, NVME_REG_CC, nvme_read_reg(ctrl, NVME_REG_CC) & ~NVME_CC_EN);
+	if (!nvme_wait_ready(ctrl, false)){
+		return false;
+	}
+	if (!nvme_queue_init(ctrl, &ctrl->admin, 0, depth)){
+		return false;
+	}
+	nvme_write_reg(ctrl, NVME_REG_AQA, (uint32)((depth - 1) | ((depth - 1) << 16)));
+	nvme_write_reg64(ctrl, NVME_REG_ASQ, (uint64)ctrl->admin.sq);
+	nvme_write_reg64(ctrl, NVME_REG_ACQ, (uint64)ctrl->admin.cq);
+	// NVM command set, 4KiB pages, round robin arbitration
+	nvme_write_reg(ctrl, NVME_REG_CC, NVME_CC_IOCQES | NVME_CC_IOSQES | NVME_CC_EN);
+	return nvme_wait_ready(ctrl, true);
+}
+/**
+* Register the active namespaces of a controller
+* @param ctrl - controller
+* @param count - number of namespaces reported by the controller
+*/
+static void nvme_init_ns(nvme_ctrl_t *ctrl, uint32 count){
+	nvme_ns_t *ns;
+	block_dev_t *bdev;
+	char name[BLOCK_NAME_LEN];
+	uint32 nsid;
+	uint32 lbaf;
+	uint64 lbads;
+	for (nsid = 1; nsid <= count && _nvme_ns_count < NVME_MAX_NS; nsid ++){
+		if (!nvme_identify(ctrl, NVME_CNS_NS, nsid)){
+			continue;
+		}
+		lbaf = *((uint32 *)&ctrl->buf[NVME_ID_LBAF + 4 * (ctrl->buf[NVME_ID_FLBAS] & 0xF)]);
+		lbads = ((lbaf >> 16) & 0xFF);
+		// Inactive namespaces have no size, metadata formats are not supported
+		if (*((uint64 *)&ctrl->buf[NVME_ID_NSZE]) == 0 || (lbaf & 0xFFFF) != 0 || lbads < 9 || lbads > 12){
+			continue;
+		}
+		ns = &_nvme_ns[_nvme_ns_count];
+		ns->ctrl = ctrl;
+		ns->nsid = nsid;
+		ns->sectors = *((uint64 *)&ctrl->buf[NVME_ID_NSZE]);
+		ns->sector_size = (1 << lbads);
+		mem_fill((uint8 *)name, BLOCK_NAME_LEN, 0);
+		str_write_f(name, BLOCK_NAME_LEN - 1, "nvme%un%u", ctrl->index, (uint64)nsid);
+		// Each CPU submits to its own queue pair, so the depth is per queue
+		bdev = block_register(name, &_nvme_block_ops, ns->sector_size, ns->sectors, ctrl->io[0].depth - 1, (void *)ns);
+		if (bdev != null){
+			bdev->max_sectors = ctrl->max_bytes / ns->sector_size;
+			_nvme_ns_count ++;
+		}
+	}
+}
+/**
+* Bring up a controller
+* @param ctrl - controller (PCI address and registers set)
+* @param dev - PCI configuration
+* @return false on failure
+*/
+static bool nvme_init_ctrl(nvme_ctrl_t *ctrl, pci_device_t *dev){
+	uint64 count;
+	uint64 depth;
+	uint64 i;
+	uint32 nn;
+	uint8 mdts;
+	if (!nvme_enable(ctrl)){
+		return false;
+	}
+	ctrl->buf = (uint8 *)dma_alloc(PAGE_SIZE, PAGE_SIZE, DMA_ZONE_ANY);
+	if (ctrl->buf == null || !nvme_identify(ctrl, NVME_CNS_CTRL, 0)){
+		return false;
+	}
+	mdts = ctrl->buf[NVME_ID_MDTS];
+	ctrl->max_bytes = NVME_MAX_BYTES;
+	if (mdts != 0 && mdts < 16 && ((uint64)PAGE_SIZE << mdts) < ctrl->max_bytes){
+		ctrl->max_bytes = ((uint64)PAGE_SIZE << mdts);
+	}
+	nn = *((uint32 *)&ctrl->buf[NVME_ID_NN]);
+	ctrl->dsm = ((ctrl->buf[NVME_ID_ONCS] & 0x4) != 0);
+	ctrl->vwc = ((ctrl->buf[NVME_ID_VWC] & 0x1) != 0);
+	// One queue pair per CPU
+	count = apic_num_cpu();
+	if (count == 0){
+		count = 1;
+	}
+	if (count > NVME_MAX_QUEUES){
+		count = NVME_MAX_QUEUES;
+	}
+	ctrl->queue_count = nvme_set_queues(ctrl, count);
+	if (ctrl->queue_count == 0){
+		return false;
+	}
+	depth = NVME_QUEUE_DEPTH;
+	if ((nvme_read_reg64(ctrl, NVME_REG_CAP) & 0xFFFF) + 1 < depth){
+		depth = (nvme_read_reg64(ctrl, NVME_REG_CAP) & 0xFFFF) + 1;
+	}
+	for (i = 0; i < ctrl->queue_count; i ++){
+		if (!nvme_queue_init(ctrl, &ctrl->io[i], i + 1, depth)){
+			ctrl->queue_count = i;
+			break;
+		}
+	}
+	nvme_init_irq(ctrl, dev);
+	if (ctrl->irq != 0xFF){
+		// Stay masked until somebody waits
+		nvme_write_reg(ctrl, NVME_REG_INTMS, 1);
+	}
+	for (i = 0; i < ctrl->queue_count; i ++){
+		if (!nvme_create_queue(ctrl, &ctrl->io[i], (ctrl->io[i].irq != 0xFF ? i : 0))){
+			break;
+		}
+	}
+	ctrl->queue_count = i;
+	if (ctrl->queue_count == 0){
+		return false;
+	}
+	nvme_init_ns(ctrl, nn);
+	return true;
+}
+
+bool nvme_init(){
+	pci_device_t dev;
+	pci_addr_t addr;
+	nvme_ctrl_t *ctrl;
+	uint64 regs;
+	uint8 dev_count;
+	uint8 i;
+	dev_count = pci_num_device(0x1, 0x8);
+#if DEBUG == 1
+	if (dev_count == 0){
+		debug_print(DC_WB, "NVMe controller was not found");
+	}
+#endif
+	for (i = 0; i < dev_count && _nvme_ctrl_count < NVME_MAX_CTRL; i ++){
+		addr = pci_get_device(0x1, 0x8, i);
+		if (addr.raw == 0){
+			continue;
+		}
+		pci_get_config(&dev, addr);
+		regs = pci_get_bar(addr, 0);
+		if (regs == 0){
+			continue;
+		}
+		ctrl = (nvme_ctrl_t *)kmalloc(sizeof(nvme_ctrl_t));
+		if (ctrl == null){
+			break;
+		}
+		mem_fill((uint8 *)ctrl, sizeof(nvme_ctrl_t), 0);
+		_nvme_ctrl[_nvme_ctrl_count] = ctrl;
+		ctrl->index = _nvme_ctrl_count;
+		ctrl->pci = addr;
+		ctrl->regs = regs;
+		ctrl->irq = 0xFF;
+		// Map the registers, doorbells follow once their stride is known
+		page_map_mmio(regs);
+		pci_enable_device(addr);
+#if DEBUG == 1
+		debug_print(DC_WB, "NVMe controller at %u:%u", (uint64)addr.s.bus, (uint64)addr.s.device);
+		debug_print(DC_WB, "     BAR:0x%x", regs);
+		debug_print(DC_WB, "     Version:%x", (uint64)nvme_read_reg(ctrl, NVME_REG_VS));
+#endif
+		_nvme_ctrl_count ++;
+		if (!nvme_init_ctrl(ctrl, &dev)){
+			ctrl->failed = true;
+#if DEBUG == 1
+			debug_print(DC_WB, "     Initialization failed");
+#endif
+		}
+	}
+	return (_nvme_ns_count > 0);
+}
+
+uint64 nvme_num_dev(){
+	return _nvme_ns_count;
+}
+
+#if DEBUG == 1
+void nvme_list(){
+	uint64 i;
+	uint64 q;
+	nvme_ctrl_t *ctrl;
+	nvme_queue_t *queue;
+	nvme_ns_t *ns;
+	for (i = 0; i < _nvme_ctrl_count; i ++){
+		ctrl = _nvme_ctrl[i];
+		debug_print(DC_WB, "nvme%u: queues:%u, %s, max:%uKB, cache:%u, dsm:%u%s",
+			i, ctrl->queue_count, (ctrl->msix ? "MSI-X" : (ctrl->irq != 0xFF ? "INTx" : "polled")),
+			ctrl->max_bytes / 1024, (uint64)ctrl->vwc, (uint64)ctrl->dsm, (ctrl->failed ? ", failed" : ""));
+		for (q = 0; q < ctrl->queue_count; q ++){
+			queue = &ctrl->io[q];
+			debug_print(DC_WB, "     q%u: depth:%u, cmds:%u, sq bells:%u, cq bells:%u, irqs:%u, bounced:%u",
+				(uint64)queue->qid, (uint64)queue->depth, queue->cmd_count, queue->sq_bells, queue->cq_bells,
+				queue->irq_count, queue->bounce_count);
+		}
+	}
+	for (i = 0; i < _nvme_ns_count; i ++){
+		ns = &_nvme_ns[i];
+		debug_print(DC_WB, "nvme%un%u: %uMB, sector:%u",
+			ns->ctrl->index, (uint64)ns->nsid, (ns->sectors * ns->sector_size) / 1024 / 1024, ns->sector_size);
+	}
+}
+#endif
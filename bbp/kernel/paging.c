@@ -36,6 +36,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "../config.h"
 #include "paging.h"
 #include "lib.h"
+#include "apic.h"
+#include "cpuid.h"
+#include "msr.h"
 #if DEBUG == 1
 	#include "debug_print.h"
 #endif
@@ -70,55 +73,424 @@ struct e820map_struct {
 } __PACKED;
 typedef struct e820map_struct e820map_t;
 
+// Per-CPU frame magazines
+#define PAGE_MAG_SIZE		64		// Frames cached per CPU
+#define PAGE_MAG_BATCH		32		// Frames moved per refill or drain
+#define PAGE_MAG_BATCH_ORDER	5	// Order of a block holding a whole batch
+
+// Bit 7 of PML2/PML3 entries - entry maps a 2MB/1GB page instead of pointing to a table
+#define PAGE_LARGE			0x80
+// PAT index bits of a leaf entry (PAT moves to bit 12 in 2MB/1GB page entries)
+#define PAGE_PWT			0x08
+#define PAGE_PCD			0x10
+#define PAGE_PAT			0x80
+#define PAGE_PAT_LARGE		0x1000
+// IA32_PAT - power-on types in PA0-PA3 (WB, WT, UC-, UC) so PWT/PCD keep
+// their legacy meaning, PA4 (PAT bit alone) switched to write-combining
+#define PAGE_PAT_VALUE		0x0007040100070406
+
+// Size mapped by a single entry of a level (0 - PML1, 1 - PML2, 2 - PML3)
+#define PAGE_LEVEL_SIZE(l)	((uint64)PAGE_SIZE << (9 * (l)))
+
+// Frame map entry bits
+#define PAGE_META_ORDER		0x3F	// Order of the block the frame starts
+#define PAGE_META_FREE		0x40	// Frame starts a free block
+#define PAGE_META_USED		0x80	// Frame starts an allocated block
+
+/**
+* Free list link - kept in the first bytes of the free block itself
+*/
+typedef struct page_block_struct page_block_t;
+struct page_block_struct {
+	page_block_t *next;
+	page_block_t *prev;
+};
+
+/**
+* Single frame cache of one CPU - only touched by its own CPU with
+* interrupts off, the allocator lock is taken for refills and drains only
+*/
+typedef struct {
+	uint64 count;					// Frames cached
+	uint64 frame[PAGE_MAG_SIZE];	// Frame stack, top is the most recently freed
+	page_mag_stats_t stats;
+} __ALIGN(64) page_mag_t;
+
 /**
 * Page table structures
 */
 static pm_t *_pml4 = (pm_t *)PT_LOC;
+// Boot time page tables until the buddy allocator takes over
 static uint64 _page_offset = PT_LOC;
 
 static uint64 _total_mem = 0;
 static uint64 _available_mem = 0;
+static bool _page_1gb = false;				// CPU supports 1GB pages
+static bool _page_pat = false;				// CPU supports PAT (write-combining available)
 
-static uint64 *_page_frames;
-static uint64 _page_count = 0;
+/**
+* Buddy allocator
+*/
+static uint8 *_page_meta = null;			// Frame map, one byte per frame
+static uint64 _page_count = 0;				// Frames in the frame map
+static page_block_t *_page_free[PAGE_MAX_ORDER + 1];	// Free lists per order
+static uint64 _page_free_count[PAGE_MAX_ORDER + 1];		// Free blocks per order
+static bool _page_ready = false;
+static volatile uint64 _page_lock = 0;
 
-// Get bitset index
-#define BIT_INDEX(b) (b / 64)
-// Get bit offset in bitset
-#define BIT_OFFSET(b) (b % 64)
+static page_mag_t *_page_mag = null;		// Magazines, one per CPU
+static uint64 _page_mag_count = 0;
 
 /**
-* Mark frame allocated
-* @param paddr - physical address to mark
+* Disable interrupts
+* @return previous RFLAGS
+*/
+static uint64 page_irq_save(){
+	uint64 flags;
+	asm volatile ("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+	return flags;
+}
+/**
+* Restore interrupt state
+* @param flags - RFLAGS from page_irq_save()
+*/
+static void page_irq_restore(uint64 flags){
+	asm volatile ("pushq %0\n\tpopfq" : : "r"(flags) : "memory", "cc");
+}
+/**
+* Take the allocator lock with interrupts off
+* @return previous RFLAGS
+*/
+static uint64 page_lock(){
+	uint64 flags = page_irq_save();
+	uint64 busy = 1;
+	while (true){
+		asm volatile ("xchgq %0, %1" : "+r"(busy), "+m"(_page_lock) : : "memory");
+		if (busy == 0){
+			break;
+		}
+		asm volatile ("pause");
+	}
+	return flags;
+}
+/**
+* Release the allocator lock
+* @param flags - RFLAGS from page_lock()
+*/
+static void page_unlock(uint64 flags){
+	asm volatile ("" : : : "memory");
+	_page_lock = 0;
+	page_irq_restore(flags);
+}
+
+/**
+* Put a block on its free list
+* @param paddr - block address
+* @param order - block order
+*/
+static void page_push(uint64 paddr, uint8 order){
+	page_block_t *block = (page_block_t *)paddr;
+	block->prev = null;
+	block->next = _page_free[order];
+	if (block->next != null){
+		block->next->prev = block;
+	}
+	_page_free[order] = block;
+	_page_free_count[order] ++;
+	_page_meta[paddr / PAGE_SIZE] = PAGE_META_FREE | order;
+}
+/**
+* Take a block off its free list
+* @param paddr - block address
+* @param order - block order
+*/
+static void page_unlink(uint64 paddr, uint8 order){
+	page_block_t *block = (page_block_t *)paddr;
+	if (block->prev != null){
+		block->prev->next = block->next;
+	} else {
+		_page_free[order] = block->next;
+	}
+	if (block->next != null){
+		block->next->prev = block->prev;
+	}
+	_page_free_count[order] --;
+	_page_meta[paddr / PAGE_SIZE] = 0;
+}
+/**
+* Get the smallest order that holds a number of pages
+* @return order or PAGE_MAX_ORDER + 1 if it's too big
+*/
+static uint8 page_order(uint64 pages){
+	uint8 order = 0;
+	while (order <= PAGE_MAX_ORDER && ((uint64)1 << order) < pages){
+		order ++;
+	}
+	return order;
+}
+/**
+* Split a free block down to the order asked for, freeing the upper halves
+* @param paddr - block address (taken off the free list already)
+* @param order - block order
+* @param want - order needed
+*/
+static void page_split(uint64 paddr, uint8 order, uint8 want){
+	while (order > want){
+		order --;
+		page_push(paddr + (PAGE_SIZE << order), order);
+	}
+	_page_meta[paddr / PAGE_SIZE] = PAGE_META_USED | want;
+}
+/**
+* Take a block from the free lists
+* Caller holds the allocator lock.
+* @param order - block order
+* @return block address or 0
+*/
+static uint64 page_buddy_alloc(uint8 order){
+	uint64 paddr;
+	uint8 o = order;
+	if (!_page_ready || order > PAGE_MAX_ORDER){
+		return 0;
+	}
+	// Smallest free block that fits
+	while (o <= PAGE_MAX_ORDER && _page_free[o] == null){
+		o ++;
+	}
+	if (o > PAGE_MAX_ORDER){
+		return 0;
+	}
+	paddr = (uint64)_page_free[o];
+	page_unlink(paddr, o);
+	page_split(paddr, o, order);
+	return paddr;
+}
+/**
+* Return a block to the free lists and merge it with its buddies
+* Caller holds the allocator lock.
+* @param paddr - block address
+*/
+static void page_buddy_free(uint64 paddr){
+	uint64 idx = paddr / PAGE_SIZE;
+	uint64 buddy;
+	uint8 order;
+	if ((paddr & PAGE_IMASK) != 0 || idx >= _page_count || (_page_meta[idx] & PAGE_META_USED) == 0){
+		return;
+	}
+	order = (_page_meta[idx] & PAGE_META_ORDER);
+	_page_meta[idx] = 0;
+	// Merge with the buddy for as long as it is free and whole
+	while (order < PAGE_MAX_ORDER){
+		buddy = paddr ^ (PAGE_SIZE << order);
+		if (buddy / PAGE_SIZE >= _page_count || _page_meta[buddy / PAGE_SIZE] != (PAGE_META_FREE | order)){
+			break;
+		}
+		page_unlink(buddy, order);
+		paddr &= ~(PAGE_SIZE << order);
+		order ++;
+	}
+	page_push(paddr, order);
+}
+/**
+* Get the magazine of the current CPU
+*/
+static page_mag_t *page_mag_get(){
+	return &_page_mag[apic_cpu_index() % _page_mag_count];
+}
+/**
+* Fill an empty magazine with a batch of frames
+* @param mag - magazine
+*/
+static void page_mag_refill(page_mag_t *mag){
+	uint64 flags = page_lock();
+	uint64 paddr = page_buddy_alloc(PAGE_MAG_BATCH_ORDER);
+	uint64 i;
+	if (paddr != 0){
+		// One block split into frames, lowest frame ends on top
+		for (i = PAGE_MAG_BATCH; i > 0; i --){
+			_page_meta[paddr / PAGE_SIZE + i - 1] = PAGE_META_USED;
+			mag->frame[mag->count ++] = paddr + (i - 1) * PAGE_SIZE;
+		}
+	} else {
+		// Fragmented - pick up whatever single frames are left
+		for (i = 0; i < PAGE_MAG_BATCH; i ++){
+			paddr = page_buddy_alloc(0);
+			if (paddr == 0){
+				break;
+			}
+			mag->frame[mag->count ++] = paddr;
+		}
+	}
+	page_unlock(flags);
+	mag->stats.refills ++;
+}
+/**
+* Give the oldest batch of a full magazine back to the buddy allocator
+* @param mag - magazine
 */
-static void page_set_frame(uint64 paddr){
-    uint64 page = paddr / 4069;
-    uint64 idx = BIT_INDEX(page);
-    uint64 offset = BIT_OFFSET(page);
-	_page_frames[idx] |= (0x1 << offset);
+static void page_mag_drain(page_mag_t *mag){
+	uint64 flags = page_lock();
+	uint64 i;
+	for (i = 0; i < PAGE_MAG_BATCH; i ++){
+		page_buddy_free(mag->frame[i]);
+	}
+	page_unlock(flags);
+	mag->count -= PAGE_MAG_BATCH;
+	mem_copy((uint8 *)mag->frame, mag->count * sizeof(uint64), (uint8 *)&mag->frame[PAGE_MAG_BATCH]);
+	mag->stats.drains ++;
 }
 /**
-* Mark frame free
-* @param paddr - physical address to mark
+* Free a page aligned range as the largest aligned blocks that fit
+* @param from - first address
+* @param to - end address (exclusive)
 */
-static void page_clear_frame(uint64 paddr){
-    uint64 page = paddr / 4069;
-    uint64 idx = BIT_INDEX(page);
-    uint64 offset = BIT_OFFSET(page);
-	_page_frames[idx] &= ~(0x1 << offset);
+static void page_free_range(uint64 from, uint64 to){
+	uint8 order;
+	while (from < to){
+		order = 0;
+		while (order < PAGE_MAX_ORDER && (from & ((PAGE_SIZE << (order + 1)) - 1)) == 0 && from + (PAGE_SIZE << (order + 1)) <= to){
+			order ++;
+		}
+		_page_meta[from / PAGE_SIZE] = PAGE_META_USED | order;
+		page_buddy_free(from);
+		from += (PAGE_SIZE << order);
+	}
 }
 /**
-* Check if frame is allocated or free
-* @param paddr - physical address to check
-* @return true if set false if not
+* Hand back the pages of a block past the ones needed
+* The block can't be freed as a whole after that.
+* @param paddr - allocated block
+* @param order - block order
+* @param pages - pages kept
 */
-static bool page_check_frame(uint64 paddr){
-    uint64 page = paddr / 4069;
-    uint64 idx = BIT_INDEX(page);
-    uint64 offset = BIT_OFFSET(page);
-    return (_page_frames[idx] & (0x1 << offset));
+static void page_trim(uint64 paddr, uint8 order, uint64 pages){
+	if (pages < ((uint64)1 << order)){
+		_page_meta[paddr / PAGE_SIZE] = PAGE_META_USED;
+		page_free_range(paddr + pages * PAGE_SIZE, paddr + (PAGE_SIZE << order));
+	}
+}
+/**
+* Get a zeroed frame for a page table
+* Boot time tables are taken from the memory right after the boot page
+* tables, so they are always within the part that is mapped already.
+* @return table address or null if memory ran out
+*/
+static pm_t *page_new_table(){
+	uint64 paddr;
+	if (_page_ready){
+		paddr = page_alloc(0);
+	} else {
+		paddr = _page_offset;
+		_page_offset += PAGE_SIZE;
+	}
+	if (paddr != 0){
+		mem_fill((uint8 *)paddr, PAGE_SIZE, 0);
+	}
+	return (pm_t *)paddr;
 }
 
+/**
+* Get the entry index of a level from a virtual address
+* @param vaddr - virtual address
+* @param level - zero based level (0-3 for PML4 paging)
+* @return index in the table of that level
+*/
+static uint64 page_index(uint64 vaddr, uint8 level){
+	return (vaddr >> (12 + 9 * level)) & 0x1FF;
+}
+/**
+* Invalidate TLB entry of a virtual address
+* @param vaddr - virtual address
+*/
+static void page_invalidate(uint64 vaddr){
+	asm volatile ("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
+/**
+* Replace a large page entry with a table of smaller pages mapping the same range
+* @param entry - PML2 or PML3 entry with a large page
+* @param level - level of the entry (1 or 2)
+* @return false if memory ran out
+*/
+static bool page_split_large(pm_t *entry, uint8 level){
+	pm_t *table = page_new_table();
+	uint64 base = entry->raw & PAGE_MASK & ~(PAGE_LEVEL_SIZE(level) - 1);
+	uint64 flags = entry->raw & PAGE_IMASK;
+	uint64 i;
+	if (table == null){
+		return false;
+	}
+	if (level == 1){
+		// 4KB entries keep the PAT bit where the page size bit was
+		flags &= ~(uint64)PAGE_LARGE;
+		if ((entry->raw & PAGE_PAT_LARGE) != 0){
+			flags |= PAGE_PAT;
+		}
+	} else {
+		flags |= (entry->raw & PAGE_PAT_LARGE);
+	}
+	for (i = 0; i < 512; i ++){
+		table[i].raw = (base + i * PAGE_LEVEL_SIZE(level - 1)) | flags;
+	}
+	// Same translation as before, so no TLB flush is needed
+	entry->raw = (uint64)table;
+	entry->s.present = 1;
+	entry->s.writable = 1;
+	return true;
+}
+/**
+* Get the table holding the entries of a level for a virtual address
+* Missing tables are created and large pages on the way are split.
+* @param vaddr - virtual address
+* @param level - zero based level of the entries (0-2)
+* @return table or null if memory ran out
+*/
+static pm_t *page_table(uint64 vaddr, uint8 level){
+	pm_t *table = _pml4;
+	pm_t *entry;
+	pm_t *next;
+	uint8 l;
+	for (l = 3; l > level; l --){
+		entry = &table[page_index(vaddr, l)];
+		if (!entry->s.present){
+			next = page_new_table();
+			if (next == null){
+				return null;
+			}
+			entry->raw = (uint64)next;
+			entry->s.present = 1;
+			entry->s.writable = 1;
+		} else if (l < 3 && (entry->raw & PAGE_LARGE) != 0){
+			if (!page_split_large(entry, l)){
+				return null;
+			}
+		}
+		table = (pm_t *)(entry->raw & PAGE_MASK);
+	}
+	return table;
+}
+/**
+* Find the entry that maps a virtual address
+* @param vaddr - virtual address
+* @param [out] level - level of the entry (0 - 4KB, 1 - 2MB, 2 - 1GB page)
+* @return entry or null if the address is not mapped
+*/
+static pm_t *page_lookup(uint64 vaddr, uint8 *level){
+	pm_t *table = _pml4;
+	pm_t *entry;
+	uint8 l = 3;
+	while (true){
+		entry = &table[page_index(vaddr, l)];
+		if (!entry->s.present){
+			return null;
+		}
+		if (l == 0 || (l < 3 && (entry->raw & PAGE_LARGE) != 0)){
+			*level = l;
+			return entry;
+		}
+		table = (pm_t *)(entry->raw & PAGE_MASK);
+		l --;
+	}
+}
 /**
 * Sort memory map in ascending order
 */
@@ -158,6 +530,22 @@ static void sort_e820(e820map_t *mem_map){
 	}
 }
 
+void page_pat_init(){
+	uint32 eax;
+	uint32 ebx;
+	uint32 ecx;
+	uint32 edx;
+	// PAT support (CPUID 1, EDX bit 16)
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	if ((edx & (1 << 16)) == 0){
+		return;
+	}
+	// Caches and TLBs may hold lines of the old types, flush them after the switch
+	msr_write(MSR_IA32_PAT, PAGE_PAT_VALUE);
+	asm volatile ("wbinvd" : : : "memory");
+	asm volatile ("movq %%cr3, %%rax\n\tmovq %%rax, %%cr3" : : : "rax", "memory");
+	_page_pat = true;
+}
 void page_init(){
 	// Read E820 memory map and mark used regions
 	e820map_t *mem_map = (e820map_t *)E820_LOC;
@@ -187,39 +575,192 @@ void page_init(){
 
 	// Determine the end of PMLx structures to add new ones
 	_page_offset += (sizeof(pm_t) * 512) * (1 + drawer_count + directory_count + table_count);
-	// Calculate total frame count
-	_page_count = _total_mem / PAGE_SIZE;
-	// Allocate frame bitset at the next page boundary
-	_page_frames = (uint64 *)_page_offset;
-	// Clear bitset
-	mem_fill((uint8 *)_page_count, _page_count / 8, 0);
-	// Move offset further
-	_page_offset += (_page_count / 8);
-	// Align the offset
-	if ((_page_offset & PAGE_MASK) != _page_offset){
-		_page_offset &= PAGE_MASK;
-		_page_offset += PAGE_SIZE;
-	}
 
-#if DEBUG == 1
-	debug_print(DC_WB, "Frames: %d", _page_count);
-#endif
+	// Check for 1GB page support (CPUID 0x80000001, EDX bit 26)
+	uint32 eax;
+	uint32 ebx;
+	uint32 ecx;
+	uint32 edx;
+	cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+	if (eax >= 0x80000001){
+		cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+		_page_1gb = ((edx & (1 << 26)) != 0);
+	}
+	// Memory types before anything gets mapped with them
+	page_pat_init();
 
-	// Determine unsuable memory regions
+	// Identity map all usable RAM up front, so free blocks can hold their
+	// free list links and new page tables are always reachable. Large pages
+	// keep the few tables needed within the boot time mapping.
 	uint64 i;
 	uint64 paddr_from;
 	uint64 paddr_to;
 	for (i = 0; i < mem_map->size; i ++){
-		if (mem_map->entries[i].type != kMemOk){
-			// Mark all unusable regions used
-			paddr_from = (mem_map->entries[i].base & PAGE_MASK);
-			paddr_to = ((mem_map->entries[i].base + mem_map->entries[i].length) & PAGE_MASK);
-			while (paddr_from < paddr_to){
-				page_set_frame(paddr_from);
-				paddr_from += PAGE_SIZE;
+		if (mem_map->entries[i].type == kMemOk){
+			paddr_from = (mem_map->entries[i].base + PAGE_IMASK) & PAGE_MASK;
+			paddr_to = (mem_map->entries[i].base + mem_map->entries[i].length) & PAGE_MASK;
+			if (paddr_from < INIT_MEM){
+				paddr_from = INIT_MEM;
+			}
+			if (paddr_from < paddr_to){
+				page_map_range(paddr_from, paddr_to - paddr_from, PAGE_ATTR_WRITE);
 			}
 		}
 	}
+
+	// Calculate total frame count
+	_page_count = _total_mem / PAGE_SIZE;
+	// Frame map goes into the first usable RAM above the page tables that
+	// holds it whole - it is too big to trust the space right after them
+	uint64 meta_size = (_page_count + PAGE_IMASK) & PAGE_MASK;
+	uint64 meta_from = 0;
+	for (i = 0; i < mem_map->size && meta_from == 0; i ++){
+		if (mem_map->entries[i].type == kMemOk){
+			paddr_from = (mem_map->entries[i].base + PAGE_IMASK) & PAGE_MASK;
+			paddr_to = (mem_map->entries[i].base + mem_map->entries[i].length) & PAGE_MASK;
+			if (paddr_from < _page_offset){
+				paddr_from = _page_offset;
+			}
+			if (paddr_from < paddr_to && paddr_to - paddr_from >= meta_size){
+				meta_from = paddr_from;
+			}
+		}
+	}
+	if (meta_from != 0){
+		_page_meta = (uint8 *)meta_from;
+		mem_fill(_page_meta, _page_count, 0);
+	} else {
+		// Buddy allocator stays empty, every lookup is out of range
+		_page_count = 0;
+#if DEBUG == 1
+		debug_print(DC_WB, "No room for the frame map (%dKB)", meta_size / 1024);
+#endif
+	}
+
+	// Everything usable above the page tables, except the frame map, goes
+	// to the buddy allocator
+	for (i = 0; i < mem_map->size && _page_meta != null; i ++){
+		if (mem_map->entries[i].type == kMemOk){
+			paddr_from = (mem_map->entries[i].base + PAGE_IMASK) & PAGE_MASK;
+			paddr_to = (mem_map->entries[i].base + mem_map->entries[i].length) & PAGE_MASK;
+			if (paddr_from < _page_offset){
+				paddr_from = _page_offset;
+			}
+			if (paddr_from < paddr_to && meta_from >= paddr_from && meta_from < paddr_to){
+				if (paddr_from < meta_from){
+					page_free_range(paddr_from, meta_from);
+				}
+				paddr_from = meta_from + meta_size;
+			}
+			if (paddr_from < paddr_to){
+				page_free_range(paddr_from, paddr_to);
+			}
+		}
+	}
+	_page_ready = (_page_meta != null);
+
+#if VIDEOMODE == 1 || VIDEOMODE == 2
+	// Video memory takes lots of small writes, let them combine
+	page_map_range(VIDEOMEM_LOC, 0xC0000 - VIDEOMEM_LOC, PAGE_ATTR_WRITE | PAGE_ATTR_WC);
+#endif
+
+#if DEBUG == 1
+	debug_print(DC_WB, "Frames: %d, free: %dMB", _page_count, page_free_mem() / 1024 / 1024);
+#endif
+}
+void page_mag_init(){
+	uint64 count = apic_num_cpu();
+	page_mag_t *mag;
+	if (count == 0){
+		count = 1;
+	}
+	mag = (page_mag_t *)page_reserve(count * sizeof(page_mag_t));
+	if (mag != null){
+		_page_mag_count = count;
+		_page_mag = mag;
+	}
+}
+bool page_mag_stats(uint64 cpu, page_mag_stats_t *stats){
+	if (cpu >= _page_mag_count){
+		return false;
+	}
+	mem_copy((uint8 *)stats, sizeof(page_mag_stats_t), (uint8 *)&_page_mag[cpu].stats);
+	stats->cached = _page_mag[cpu].count;
+	return true;
+}
+uint64 page_alloc(uint8 order){
+	page_mag_t *mag;
+	uint64 flags;
+	uint64 paddr = 0;
+	if (order == 0 && _page_mag != null){
+		// Interrupts off keep us on this CPU's magazine, no lock needed
+		flags = page_irq_save();
+		mag = page_mag_get();
+		mag->stats.allocs ++;
+		if (mag->count == 0){
+			page_mag_refill(mag);
+		} else {
+			mag->stats.alloc_hits ++;
+		}
+		if (mag->count > 0){
+			paddr = mag->frame[-- mag->count];
+		}
+		page_irq_restore(flags);
+		return paddr;
+	}
+	flags = page_lock();
+	paddr = page_buddy_alloc(order);
+	page_unlock(flags);
+	return paddr;
+}
+void page_free(uint64 paddr){
+	uint64 idx = paddr / PAGE_SIZE;
+	page_mag_t *mag;
+	uint64 flags;
+	if ((paddr & PAGE_IMASK) != 0 || idx >= _page_count){
+		return;
+	}
+	if (_page_meta[idx] == PAGE_META_USED && _page_mag != null){
+		flags = page_irq_save();
+		mag = page_mag_get();
+		mag->stats.frees ++;
+		if (mag->count == PAGE_MAG_SIZE){
+			page_mag_drain(mag);
+		} else {
+			mag->stats.free_hits ++;
+		}
+		mag->frame[mag->count ++] = paddr;
+		page_irq_restore(flags);
+		return;
+	}
+	flags = page_lock();
+	page_buddy_free(paddr);
+	page_unlock(flags);
+}
+bool page_is_block(uint64 paddr){
+	uint64 idx = paddr / PAGE_SIZE;
+	if ((paddr & PAGE_IMASK) != 0 || idx >= _page_count){
+		return false;
+	}
+	return ((_page_meta[idx] & PAGE_META_USED) != 0);
+}
+uint64 page_free_blocks(uint8 order){
+	if (order > PAGE_MAX_ORDER){
+		return 0;
+	}
+	return _page_free_count[order];
+}
+uint64 page_free_mem(){
+	uint64 total = 0;
+	uint8 order;
+	uint64 i;
+	for (order = 0; order <= PAGE_MAX_ORDER; order ++){
+		total += _page_free_count[order] * (PAGE_SIZE << order);
+	}
+	for (i = 0; i < _page_mag_count; i ++){
+		total += _page_mag[i].count * PAGE_SIZE;
+	}
+	return total;
 }
 uint64 page_total_mem(){
 	return _total_mem;
@@ -238,128 +779,127 @@ uint64 page_normalize_vaddr(uint64 vaddr){
 	return va.raw;
 }
 uint64 page_map(uint64 paddr){
-	// Do the identity map
-	vaddr_t va;
-	pm_t *pml3;
-	pm_t *pml2;
-	pm_t *pml1;
-	va.raw = page_normalize_vaddr(paddr);
-	if (!_pml4[va.s.drawer_idx].s.present){
-		page_set_frame(_page_offset);
-		pml3 = (pm_t *)_page_offset;
-		mem_fill((uint8 *)pml3, sizeof(pm_t) * 512, 0);
-		_pml4[va.s.drawer_idx].raw = (uint64)pml3;
-		_pml4[va.s.drawer_idx].s.present = 1;
-		_pml4[va.s.drawer_idx].s.writable = 1;
-		//_pml4[va.s.drawer_idx].s.write_through = 1;
-		//_pml4[va.s.drawer_idx].s.cache_disable = 1;
-		_page_offset += (sizeof(pm_t) * 512);
-	}
-	pml3 = (pm_t *)(_pml4[va.s.drawer_idx].raw & PAGE_MASK);
-	if (!pml3[va.s.directory_idx].s.present){
-		page_set_frame(_page_offset);
-		pml2 = (pm_t *)_page_offset;
-		mem_fill((uint8 *)pml2, sizeof(pm_t) * 512, 0);
-		pml3[va.s.directory_idx].raw = (uint64)pml2;
-		pml3[va.s.directory_idx].s.present = 1;
-		pml3[va.s.directory_idx].s.writable = 1;
-		//pml3[va.s.directory_idx].s.write_through = 1;
-		//pml3[va.s.directory_idx].s.cache_disable = 1;
-		_page_offset += (sizeof(pm_t) * 512);
-	}
-	pml2 = (pm_t *)(pml3[va.s.directory_idx].raw & PAGE_MASK);
-	if (!pml2[va.s.table_idx].s.present){
-		page_set_frame(_page_offset);
-		pml1 = (pm_t *)_page_offset;
-		mem_fill((uint8 *)pml1, sizeof(pm_t) * 512, 0);
-		pml2[va.s.table_idx].raw = (uint64)pml1;
-		pml2[va.s.table_idx].s.present = 1;
-		pml2[va.s.table_idx].s.writable = 1;
-		//pml2[va.s.table_idx].s.write_through = 1;
-		//pml2[va.s.table_idx].s.cache_disable = 1;
-		_page_offset += (sizeof(pm_t) * 512);
-	}
-	pml1 = (pm_t *)(pml2[va.s.table_idx].raw & PAGE_MASK);
-	if (!pml1[va.s.page_idx].s.present){
-		pml1[va.s.page_idx].raw = (paddr & PAGE_MASK);
-		pml1[va.s.page_idx].s.present = 1;
-		pml1[va.s.page_idx].s.writable = 1;
-		//pml1[va.s.page_idx].s.write_through = 1;
-		//pml1[va.s.page_idx].s.cache_disable = 1;
-	}	
-	return va.raw;
+	uint8 level;
+	// Leave existing mappings (and their cache policy) alone
+	if (page_lookup(paddr, &level) != null){
+		return page_normalize_vaddr(paddr);
+	}
+	return page_map_range(paddr, PAGE_SIZE, PAGE_ATTR_WRITE);
 }
 uint64 page_map_mmio(uint64 paddr){
-	// Do the identity map
-	vaddr_t va;
-	pm_t *pml3;
-	pm_t *pml2;
-	pm_t *pml1;
-	va.raw = page_normalize_vaddr(paddr);
-	if (!_pml4[va.s.drawer_idx].s.present){
-		page_set_frame(_page_offset);
-		pml3 = (pm_t *)_page_offset;
-		mem_fill((uint8 *)pml3, sizeof(pm_t) * 512, 0);
-		_pml4[va.s.drawer_idx].raw = (uint64)pml3;
-		_pml4[va.s.drawer_idx].s.present = 1;
-		_pml4[va.s.drawer_idx].s.writable = 1;
-		_pml4[va.s.drawer_idx].s.write_through = 1;
-		_pml4[va.s.drawer_idx].s.cache_disable = 1;
-		_page_offset += (sizeof(pm_t) * 512);
-	}
-	pml3 = (pm_t *)(_pml4[va.s.drawer_idx].raw & PAGE_MASK);
-	if (!pml3[va.s.directory_idx].s.present){
-		page_set_frame(_page_offset);
-		pml2 = (pm_t *)_page_offset;
-		mem_fill((uint8 *)pml2, sizeof(pm_t) * 512, 0);
-		pml3[va.s.directory_idx].raw = (uint64)pml2;
-		pml3[va.s.directory_idx].s.present = 1;
-		pml3[va.s.directory_idx].s.writable = 1;
-		pml3[va.s.directory_idx].s.write_through = 1;
-		pml3[va.s.directory_idx].s.cache_disable = 1;
-		_page_offset += (sizeof(pm_t) * 512);
-	}
-	pml2 = (pm_t *)(pml3[va.s.directory_idx].raw & PAGE_MASK);
-	if (!pml2[va.s.table_idx].s.present){
-		page_set_frame(_page_offset);
-		pml1 = (pm_t *)_page_offset;
-		mem_fill((uint8 *)pml1, sizeof(pm_t) * 512, 0);
-		pml2[va.s.table_idx].raw = (uint64)pml1;
-		pml2[va.s.table_idx].s.present = 1;
-		pml2[va.s.table_idx].s.writable = 1;
-		pml2[va.s.table_idx].s.write_through = 1;
-		pml2[va.s.table_idx].s.cache_disable = 1;
-		_page_offset += (sizeof(pm_t) * 512);
-	}
-	pml1 = (pm_t *)(pml2[va.s.table_idx].raw & PAGE_MASK);
-	if (!pml1[va.s.page_idx].s.present){
-		pml1[va.s.page_idx].raw = (paddr & PAGE_MASK);
-		pml1[va.s.page_idx].s.present = 1;
-		pml1[va.s.page_idx].s.writable = 1;
-		pml1[va.s.page_idx].s.write_through = 1;
-		pml1[va.s.page_idx].s.cache_disable = 1;
-	}	
-	return va.raw;
+	return page_map_range(paddr, PAGE_SIZE, PAGE_ATTR_WRITE | PAGE_ATTR_UC);
 }
-uint64 page_resolve(uint64 vaddr){
-	vaddr_t va;
-	uint64 paddr = 0;
-	pm_t *table;
-	va.raw = vaddr;
-	if (_pml4[va.s.drawer_idx].s.present){
-		table = (pm_t *)(_pml4[va.s.drawer_idx].raw & PAGE_MASK);
-		if (table[va.s.directory_idx].s.present){
-			table = (pm_t *)(table[va.s.directory_idx].raw & PAGE_MASK);
-			if (table[va.s.table_idx].s.present){
-				table = (pm_t *)(table[va.s.table_idx].raw & PAGE_MASK);
-				if (table[va.s.page_idx].s.present){
-					paddr = va.s.offset; // set offset
-					paddr |= (table[va.s.page_idx].raw & PAGE_MASK); // merge page aligned address
+uint64 page_map_range(uint64 paddr, uint64 len, uint64 attrs){
+	uint64 addr = paddr & PAGE_MASK;
+	uint64 end = (paddr + len + PAGE_IMASK) & PAGE_MASK;
+	uint64 flags;
+	pm_t *table = null;
+	uint64 table_end = 0;
+	uint8 table_level = 0;
+	pm_t *entry;
+	uint8 level;
+	bool present;
+	bool pat = false;
+	flags = 0x1; // present
+	if ((attrs & PAGE_ATTR_WRITE) != 0){
+		flags |= 0x2;
+	}
+	switch (attrs & PAGE_ATTR_TYPE){
+		case PAGE_ATTR_WT:
+			flags |= PAGE_PWT;
+			break;
+		case PAGE_ATTR_UC_MINUS:
+			flags |= PAGE_PCD;
+			break;
+		case PAGE_ATTR_UC:
+			flags |= PAGE_PCD | PAGE_PWT;
+			break;
+		case PAGE_ATTR_WC:
+			if (_page_pat){
+				pat = true;
+			} else {
+				// Closest thing without PAT - still lets MTRR WC through
+				flags |= PAGE_PCD;
+			}
+			break;
+	}
+	while (addr < end){
+		// Largest page the alignment and the remaining length allow
+		level = 0;
+		if (_page_1gb && (addr & (PAGE_LEVEL_SIZE(2) - 1)) == 0 && end - addr >= PAGE_LEVEL_SIZE(2)){
+			level = 2;
+		} else if ((addr & (PAGE_LEVEL_SIZE(1) - 1)) == 0 && end - addr >= PAGE_LEVEL_SIZE(1)){
+			level = 1;
+		}
+		while (true){
+			// Walk the tables only when leaving the last one
+			if (table == null || level != table_level || addr >= table_end){
+				table = page_table(addr, level);
+				if (table == null){
+					return 0;
 				}
+				table_level = level;
+				table_end = (addr | (PAGE_LEVEL_SIZE(level + 1) - 1)) + 1;
 			}
+			entry = &table[page_index(addr, level)];
+			// Don't throw away a table of smaller pages, fill it instead
+			if (level > 0 && entry->s.present && (entry->raw & PAGE_LARGE) == 0){
+				level --;
+				continue;
+			}
+			break;
+		}
+		present = entry->s.present;
+		if (level > 0){
+			entry->raw = addr | flags | PAGE_LARGE | (pat ? PAGE_PAT_LARGE : 0);
+		} else {
+			entry->raw = addr | flags | (pat ? PAGE_PAT : 0);
+		}
+		if (present){
+			page_invalidate(addr);
 		}
+		addr += PAGE_LEVEL_SIZE(level);
 	}
-	return paddr;
+	return page_normalize_vaddr(paddr);
+}
+uint64 page_reserve(uint64 size){
+	// All usable RAM is identity mapped already
+	return page_reserve_below(size, 0);
+}
+uint64 page_reserve_below(uint64 size, uint64 limit){
+	uint64 pages = (size + PAGE_IMASK) / PAGE_SIZE;
+	uint8 order = page_order(pages);
+	uint8 o;
+	page_block_t *block;
+	uint64 flags;
+	if (order > PAGE_MAX_ORDER){
+		return 0;
+	}
+	flags = page_lock();
+	// Any free block at least as big whose lower part ends below the limit
+	for (o = order; o <= PAGE_MAX_ORDER; o ++){
+		for (block = _page_free[o]; block != null; block = block->next){
+			if (limit == 0 || (uint64)block + (PAGE_SIZE << order) <= limit){
+				page_unlink((uint64)block, o);
+				page_split((uint64)block, o, order);
+				page_trim((uint64)block, order, pages);
+				page_unlock(flags);
+				mem_fill((uint8 *)block, pages * PAGE_SIZE, 0);
+				return (uint64)block;
+			}
+		}
+	}
+	page_unlock(flags);
+	return 0;
+}
+uint64 page_resolve(uint64 vaddr){
+	uint8 level;
+	pm_t *entry = page_lookup(vaddr, &level);
+	if (entry == null){
+		return 0;
+	}
+	// Merge the page (or large page) aligned address with the offset in it
+	return (entry->raw & PAGE_MASK & ~(PAGE_LEVEL_SIZE(level) - 1)) | (vaddr & (PAGE_LEVEL_SIZE(level) - 1));
 }
 
 pm_t page_get_pml_entry(uint64 vaddr, uint8 level){
@@ -399,3 +939,22 @@ void page_set_pml_entry(uint64 vaddr, uint8 level, pm_t pe){
 	table = (pm_t *)(table[va.s.table_idx].raw & PAGE_MASK);
 	table[va.s.page_idx].raw = pe.raw;
 }
+
+#if DEBUG == 1
+void page_list(){
+	uint8 order;
+	for (order = 0; order <= PAGE_MAX_ORDER; order ++){
+		if (_page_free_count[order] > 0){
+			debug_print(DC_WB, "page:order %u (%uKB), free: %u", (uint64)order, (uint64)(PAGE_SIZE << order) / 1024, _page_free_count[order]);
+		}
+	}
+	debug_print(DC_WB, "page:free %uMB", page_free_mem() / 1024 / 1024);
+}
+void page_mag_list(){
+	page_mag_stats_t stats;
+	uint64 cpu;
+	for (cpu = 0; page_mag_stats(cpu, &stats); cpu ++){
+		debug_print(DC_WB, "page:cpu%u, allocs: %u (hit %u), frees: %u (hit %u), refills: %u, drains: %u, cached: %u", cpu, stats.allocs, stats.alloc_hits, stats.frees, stats.free_hits, stats.refills, stats.drains, stats.cached);
+	}
+}
+#endif
@@ -37,6 +37,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define __paging_h
 
 #include "common.h"
+#include "../config.h"
 
 typedef union {
 	struct {
@@ -69,12 +70,41 @@ typedef union {
 
 #define PAGE_MASK		0xFFFFFFFFFFFFF000
 #define PAGE_IMASK		0x0000000000000FFF // Inverse mask
+#define PAGE_MAX_ORDER	18 // Largest physical block (2^18 pages, 1GB)
+
+// page_map_range() attributes
+#define PAGE_ATTR_WRITE		0x01 // Writable
+// Memory types (one of)
+#define PAGE_ATTR_WB		0x00 // Write-back (normal RAM)
+#define PAGE_ATTR_WT		0x02 // Write-through
+#define PAGE_ATTR_UC_MINUS	0x04 // Uncached, MTRRs may still make it write-combining
+#define PAGE_ATTR_UC		0x06 // Uncached (memory mapped IO registers)
+#define PAGE_ATTR_WC		0x08 // Write-combining (framebuffers, prefetchable BARs)
+#define PAGE_ATTR_TYPE		0x0E // Memory type mask
+
+/**
+* Per-CPU frame magazine counters
+*/
+typedef struct {
+	uint64 allocs;			// Single frame allocations
+	uint64 alloc_hits;		// ...served from the magazine
+	uint64 frees;			// Single frame releases
+	uint64 free_hits;		// ...kept without a drain
+	uint64 refills;			// Batches taken from the buddy allocator
+	uint64 drains;			// Batches given back to it
+	uint64 cached;			// Frames in the magazine right now
+} page_mag_stats_t;
 
 /**
 * Initialize paging
 */
 void page_init();
 /**
+* Program IA32_PAT on the calling CPU so PAGE_ATTR_WC works
+* page_init() does it for the boot CPU, every other CPU has to do it too.
+*/
+void page_pat_init();
+/**
 * Get total installed RAM
 * @return RAM size in bytes
 */
@@ -104,6 +134,74 @@ uint64 page_map(uint64 paddr);
 */
 uint64 page_map_mmio(uint64 paddr);
 /**
+* Identity map a physical range with the largest pages alignment allows
+* 1GB pages are used when the CPU has them, then 2MB and 4KB pages.
+* Existing mappings in the range are replaced.
+* @param paddr - physical address of the first byte
+* @param len - range length in bytes
+* @param attrs - PAGE_ATTR_* flags
+* @return virtual address of paddr or 0 if memory for page tables ran out
+*/
+uint64 page_map_range(uint64 paddr, uint64 len, uint64 attrs);
+/**
+* Set up per-CPU frame magazines (call once APIC knows the CPU count)
+* Single frame allocations and releases don't touch the shared allocator
+* after this, apart from batched refills and drains.
+*/
+void page_mag_init();
+/**
+* Get frame magazine counters of a CPU
+* @param cpu - CPU index
+* @param [out] stats - counters
+* @return false if there's no such CPU
+*/
+bool page_mag_stats(uint64 cpu, page_mag_stats_t *stats);
+/**
+* Allocate a physically contiguous block of 2^order frames
+* Block is aligned to its own size, identity mapped and not zeroed
+* @param order - block order (0 - single page, 9 - 2MB)
+* @return physical address or 0 if there's no free block that big
+*/
+uint64 page_alloc(uint8 order);
+/**
+* Release a block from page_alloc() and merge it with its free buddies
+* @param paddr - block address
+*/
+void page_free(uint64 paddr);
+/**
+* Check if an address starts an allocated block
+* @param paddr - physical address
+* @return true if it's a block from page_alloc() or page_reserve()
+*/
+bool page_is_block(uint64 paddr);
+/**
+* Get the number of free blocks of an order
+* @param order - block order
+* @return free block count
+*/
+uint64 page_free_blocks(uint8 order);
+/**
+* Get free RAM held by the frame allocator (magazines included)
+* @return RAM size in bytes
+*/
+uint64 page_free_mem();
+/**
+* Reserve physically contiguous, identity mapped memory
+* Memory is zeroed and never released (unused tail of the block is
+* returned to the frame allocator right away)
+* @param size - number of bytes to reserve (rounded up to PAGE_SIZE)
+* @return address of the reserved region (page aligned) or 0 if it doesn't fit
+*/
+uint64 page_reserve(uint64 size);
+/**
+* Reserve physically contiguous, identity mapped memory below an address
+* Only usable RAM from the E820 memory map is handed out
+* @param size - number of bytes to reserve (rounded up to PAGE_SIZE)
+* @param limit - physical address the region has to end below (0 - no limit)
+* @return address of the reserved region (page aligned) or 0 if it doesn't fit
+*/
+uint64 page_reserve_below(uint64 size, uint64 limit);
+/**
 * Resolve physical address from virtual addres
 * @param vaddr - virtual address to resolve
 * @return physical address
@@ -125,4 +223,15 @@ pm_t page_get_pml_entry(uint64 vaddr, uint8 level);
 */
 void page_set_pml_entry(uint64 vaddr, uint8 level, pm_t pe);
 
+#if DEBUG == 1
+/**
+* List free blocks per order
+*/
+void page_list();
+/**
+* List frame magazine counters per CPU
+*/
+void page_mag_list();
+#endif
+
 #endif /* __paging_h */
\ No newline at end of file
@@ -38,6 +38,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "lib.h"
 #include "io.h"
 #include "pci.h"
+#include "paging.h"
 #if DEBUG == 1
 	#include "debug_print.h"
 #endif
@@ -157,6 +158,33 @@ pci_addr_t pci_get_device(uint8 class_id, uint8 subclass_id, uint8 idx){
 	return addr_none;
 }
 
+uint8 pci_num_device_id(uint16 vendor_id, uint16 device_id){
+	uint16 i = 0;
+	uint8 x = 0;
+	for (i = 0; i < _cache_len; i ++){
+		if (_cache[i].vendor_id == vendor_id && _cache[i].device_id == device_id){
+			x ++;
+		}
+	}
+	return x;
+}
+
+pci_addr_t pci_get_device_id(uint16 vendor_id, uint16 device_id, uint8 idx){
+	uint16 i = 0;
+	uint8 x = 0;
+	pci_addr_t addr_none;
+	addr_none.raw = 0;
+	for (i = 0; i < _cache_len; i ++){
+		if (_cache[i].vendor_id == vendor_id && _cache[i].device_id == device_id){
+			if (x == idx){
+				return _cache[i].address;
+			}
+			x ++;
+		}
+	}
+	return addr_none;
+}
+
 void pci_get_header(pci_header_t *header,pci_addr_t addr){
 	uint32 *rows = (uint32 *)header;
 	uint8 row;
@@ -175,6 +203,132 @@ void pci_get_config(pci_device_t *device, pci_addr_t addr){
 	}
 }
 
+void pci_enable_device(pci_addr_t addr){
+	uint32 cmd;
+	addr.s.reg = (PCI_REG_STATUS_CMD >> 2);
+	// Keep status half zero - it's write 1 to clear
+	cmd = (pci_read(addr) & 0xFFFF);
+	cmd |= (PCI_CMD_MEM_SPACE | PCI_CMD_BUS_MASTER);
+	cmd &= ~PCI_CMD_INT_DISABLE;
+	pci_write(addr, cmd);
+}
+
+uint8 pci_find_capability(pci_addr_t addr, uint8 cap_id){
+	return pci_next_capability(addr, 0, cap_id);
+}
+
+uint8 pci_next_capability(pci_addr_t addr, uint8 ptr, uint8 cap_id){
+	uint8 hops = 0;
+	uint32 val;
+	if (ptr == 0){
+		addr.s.reg = (PCI_REG_STATUS_CMD >> 2);
+		if (((pci_read(addr) >> 16) & PCI_STATUS_CAP_LIST) == 0){
+			return 0;
+		}
+		addr.s.reg = (PCI_REG_CAP_PTR >> 2);
+		ptr = (uint8)(pci_read(addr) & 0xFC);
+	} else {
+		addr.s.reg = (ptr >> 2);
+		ptr = (uint8)((pci_read(addr) >> 8) & 0xFC);
+	}
+	// Bounded walk - a broken list must not loop forever
+	while (ptr >= 0x40 && hops < 48){
+		addr.s.reg = (ptr >> 2);
+		val = pci_read(addr);
+		if ((val & 0xFF) == cap_id){
+			return ptr;
+		}
+		ptr = (uint8)((val >> 8) & 0xFC);
+		hops ++;
+	}
+	return 0;
+}
+
+uint64 pci_get_bar(pci_addr_t addr, uint8 bar){
+	uint64 base;
+	if (bar > 5){
+		return 0;
+	}
+	addr.s.reg = (PCI_REG_BAR0 >> 2) + bar;
+	base = pci_read(addr);
+	// I/O space BAR
+	if ((base & 0x1) != 0){
+		return 0;
+	}
+	// 64-bit BAR keeps the upper half in the next slot
+	if ((base & 0x6) == 0x4 && bar < 5){
+		addr.s.reg ++;
+		base |= ((uint64)pci_read(addr) << 32);
+	}
+	return (base & ~((uint64)0xF));
+}
+uint64 pci_map_bar(pci_addr_t addr, uint8 bar, uint64 len){
+	uint64 base = pci_get_bar(addr, bar);
+	uint64 type = PAGE_ATTR_UC;
+	if (base == 0){
+		return 0;
+	}
+	// Prefetchable memory has no read side effects, so writes may be combined
+	addr.s.reg = (PCI_REG_BAR0 >> 2) + bar;
+	if ((pci_read(addr) & 0x8) != 0){
+		type = PAGE_ATTR_WC;
+	}
+	return page_map_range(base, len, PAGE_ATTR_WRITE | type);
+}
+
+uint16 pci_msix_count(pci_addr_t addr){
+	uint8 cap = pci_find_capability(addr, PCI_CAP_MSIX);
+	if (cap == 0){
+		return 0;
+	}
+	addr.s.reg = (cap >> 2);
+	return (uint16)(((pci_read(addr) >> 16) & 0x7FF) + 1);
+}
+
+bool pci_msix_set(pci_addr_t addr, uint16 entry, uint64 msg_addr, uint32 msg_data){
+	uint8 cap = pci_find_capability(addr, PCI_CAP_MSIX);
+	uint32 table;
+	uint64 base;
+	uint32 volatile *ent;
+	if (cap == 0 || entry >= pci_msix_count(addr)){
+		return false;
+	}
+	// Table offset and BAR indicator
+	addr.s.reg = (cap >> 2) + 1;
+	table = pci_read(addr);
+	base = pci_get_bar(addr, (uint8)(table & 0x7));
+	if (base == 0){
+		return false;
+	}
+	base += (table & ~((uint32)0x7)) + ((uint64)entry * 16);
+	page_map_mmio(base & PAGE_MASK);
+	ent = (uint32 volatile *)base;
+	ent[0] = (uint32)msg_addr;
+	ent[1] = (uint32)(msg_addr >> 32);
+	ent[2] = msg_data;
+	// Vector control - clear the mask bit
+	ent[3] = 0;
+	return true;
+}
+
+bool pci_msix_enable(pci_addr_t addr){
+	uint8 cap = pci_find_capability(addr, PCI_CAP_MSIX);
+	uint32 val;
+	if (cap == 0){
+		return false;
+	}
+	addr.s.reg = (cap >> 2);
+	val = pci_read(addr);
+	val |= ((uint32)PCI_MSIX_ENABLE << 16);
+	val &= ~((uint32)PCI_MSIX_FUNC_MASK << 16);
+	pci_write(addr, val);
+	// INTx# is not used anymore
+	addr.s.reg = (PCI_REG_STATUS_CMD >> 2);
+	val = (pci_read(addr) & 0xFFFF);
+	pci_write(addr, val | PCI_CMD_INT_DISABLE);
+	return true;
+}
+
 uint32 pci_read(pci_addr_t addr){
 	uint32 data;
 	outd(PCI_CONFIG_ADDRESS, addr.raw);
@@ -47,6 +47,26 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define PCI_REG_STATUS_CMD	0x4
 #define PCI_REG_CLS_PRG_REV	0x8
 #define PCI_REG_BIST_TYPE	0xC
+#define PCI_REG_BAR0		0x10
+#define PCI_REG_CAP_PTR		0x34
+
+// Status register bits
+#define PCI_STATUS_CAP_LIST	0x0010	// Capability list is present
+
+// Capability IDs
+#define PCI_CAP_MSI			0x05	// Message Signalled Interrupts
+#define PCI_CAP_VENDOR		0x09	// Vendor specific
+#define PCI_CAP_MSIX		0x11	// MSI-X
+
+// MSI-X message control bits
+#define PCI_MSIX_ENABLE		0x8000
+#define PCI_MSIX_FUNC_MASK	0x4000
+
+// Command register bits
+#define PCI_CMD_IO_SPACE	0x0001	// Respond to I/O space accesses
+#define PCI_CMD_MEM_SPACE	0x0002	// Respond to memory space accesses
+#define PCI_CMD_BUS_MASTER	0x0004	// Allow device to initiate DMA
+#define PCI_CMD_INT_DISABLE	0x0400	// Disable INTx# interrupts
 
 /**
 * PCI address structure
@@ -118,6 +138,21 @@ uint8 pci_num_device(uint8 class_id, uint8 subclass_id);
 */
 pci_addr_t pci_get_device(uint8 class_id, uint8 subclass_id, uint8 idx);
 /**
+* Get the number of devices with a vendor and device ID
+* @param vendor_id - vendor ID
+* @param device_id - device ID
+* @return number of devices found
+*/
+uint8 pci_num_device_id(uint16 vendor_id, uint16 device_id);
+/**
+* Locate PCI device by vendor and device ID
+* @param vendor_id - vendor ID
+* @param device_id - device ID
+* @param idx - device index (@see pci_num_device_id)
+* @return PCI address (check if it's not 0!)
+*/
+pci_addr_t pci_get_device_id(uint16 vendor_id, uint16 device_id, uint8 idx);
+/**
 * Read PCI device header
 * @param header - a pointer to header structure that needs to be filled
 * @param addr - PCI address
@@ -130,6 +165,63 @@ void pci_get_header(pci_header_t *header, pci_addr_t addr);
 */
 void pci_get_config(pci_device_t *device, pci_addr_t addr);
 /**
+* Enable memory decoding, bus mastering (DMA) and INTx# interrupts
+* @param addr - PCI address
+*/
+void pci_enable_device(pci_addr_t addr);
+/**
+* Find a capability in device's capability list
+* @param addr - PCI address
+* @param cap_id - capability ID (PCI_CAP_*)
+* @return configuration space offset of the capability or 0 if not found
+*/
+uint8 pci_find_capability(pci_addr_t addr, uint8 cap_id);
+/**
+* Find the next capability with the same ID
+* @param addr - PCI address
+* @param ptr - offset of the previous capability
+* @param cap_id - capability ID (PCI_CAP_*)
+* @return configuration space offset of the capability or 0 if not found
+*/
+uint8 pci_next_capability(pci_addr_t addr, uint8 ptr, uint8 cap_id);
+/**
+* Get the address of a memory BAR (64-bit BARs take two slots)
+* @param addr - PCI address
+* @param bar - BAR index (0-5)
+* @return physical address or 0 if it's not a memory BAR
+*/
+uint64 pci_get_bar(pci_addr_t addr, uint8 bar);
+/**
+* Map a memory BAR - write-combining if it's prefetchable, uncached otherwise
+* Meant for framebuffers and other bulk memory, not for registers.
+* @param addr - PCI address
+* @param bar - BAR index (0-5)
+* @param len - bytes to map
+* @return virtual address or 0 if it's not a memory BAR
+*/
+uint64 pci_map_bar(pci_addr_t addr, uint8 bar, uint64 len);
+/**
+* Get the number of MSI-X table entries
+* @param addr - PCI address
+* @return number of vectors or 0 if the device can't do MSI-X
+*/
+uint16 pci_msix_count(pci_addr_t addr);
+/**
+* Program and unmask an MSI-X table entry
+* @param addr - PCI address
+* @param entry - table entry index
+* @param msg_addr - message address
+* @param msg_data - message data
+* @return false if the device can't do MSI-X
+*/
+bool pci_msix_set(pci_addr_t addr, uint16 entry, uint64 msg_addr, uint32 msg_data);
+/**
+* Switch device interrupts from INTx# to MSI-X
+* @param addr - PCI address
+* @return false if the device can't do MSI-X
+*/
+bool pci_msix_enable(pci_addr_t addr);
+/**
 * Read from PCI bus/device
 * @param addr - PCI address
 * @return register value
@@ -0,0 +1,402 @@
+/*
+
+Striped (RAID0) block device
+============================
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "lib.h"
+#include "paging.h"
+#include "block.h"
+#include "raid0.h"
+#if DEBUG == 1
+	#include "debug_print.h"
+#endif
+
+#define RAID0_MAX_DEV			4		// Striped sets
+#define RAID0_QUEUE_DEPTH		32		// Requests in flight per set
+#define RAID0_MAX_SG			32		// Scatter-gather entries per member request
+#define RAID0_MAX_ROWS			4		// Stripes per request
+#define RAID0_MAX_SECTORS		0x100	// Member request size when the member has no limit
+
+typedef struct raid0_struct raid0_t;
+
+/**
+* Request in flight - one member request per member it touches
+*/
+typedef struct {
+	raid0_t *raid;
+	block_req_t *req;				// Request of the striped device
+	uint64 pending;					// Member requests not completed yet
+	bool ok;
+	bool used;
+	block_req_t child[RAID0_MAX_MEMBERS];
+	block_sg_t sg[RAID0_MAX_MEMBERS][RAID0_MAX_SG];
+} raid0_slot_t;
+/**
+* Striped set
+*/
+struct raid0_struct {
+	block_dev_t *dev;
+	block_dev_t *member[RAID0_MAX_MEMBERS];
+	uint64 count;					// Members
+	uint64 chunk;					// Chunk size in sectors
+	uint64 max_sg;					// Scatter-gather entries per member request
+	raid0_slot_t *slot;				// Request pool (RAID0_QUEUE_DEPTH entries)
+	uint64 in_flight;				// Requests in flight
+	uint64 out[RAID0_MAX_MEMBERS];	// Member requests in flight
+	uint64 reaped;					// Member requests completed
+	bool plugged;					// Members hold requests until commit
+	// Statistics
+	uint64 requests;
+	uint64 full;					// Requests that kept every member busy
+	uint64 sent[RAID0_MAX_MEMBERS];	// Member requests
+	uint64 sectors[RAID0_MAX_MEMBERS];	// Member sectors transferred
+};
+
+static raid0_t _raid0[RAID0_MAX_DEV];
+static uint64 _raid0_count = 0;
+
+/**
+* Map a striped device position to a member position
+* Returns how many sectors of the member lie below the position, so
+* any range of the striped device maps to one contiguous range on
+* each member: [raid0_map(lba), raid0_map(lba + count)).
+* @param r - striped set
+* @param m - member index
+* @param lba - striped device sector
+* @return member sector
+*/
+static uint64 raid0_map(raid0_t *r, uint64 m, uint64 lba){
+	uint64 stripe = lba / r->chunk;
+	uint64 row = stripe / r->count;
+	uint64 col = stripe % r->count;
+	if (m < col){
+		return (row + 1) * r->chunk;
+	} else if (m == col){
+		return row * r->chunk + (lba % r->chunk);
+	}
+	return row * r->chunk;
+}
+/**
+* Member request completed - the striped one completes with the last
+*/
+static void raid0_child_done(block_req_t *child){
+	raid0_slot_t *slot = (raid0_slot_t *)child->priv;
+	raid0_t *r = slot->raid;
+	r->out[child - slot->child] --;
+	r->reaped ++;
+	if (!child->ok){
+		slot->ok = false;
+	}
+	slot->pending --;
+	if (slot->pending == 0){
+		slot->used = false;
+		r->in_flight --;
+		block_complete(slot->req, slot->ok);
+	}
+}
+/**
+* Let members send what they have been holding
+*/
+static void raid0_commit(block_dev_t *dev){
+	raid0_t *r = (raid0_t *)dev->priv;
+	uint64 m;
+	if (r->plugged){
+		r->plugged = false;
+		for (m = 0; m < r->count; m ++){
+			block_unplug(r->member[m]);
+		}
+	}
+}
+/**
+* Split a request into one request per member
+* Members stay plugged until commit, so every member of the stripe
+* starts its part together with the others.
+*/
+static bool raid0_submit(block_dev_t *dev, block_req_t *req){
+	raid0_t *r = (raid0_t *)dev->priv;
+	raid0_slot_t *slot = null;
+	block_req_t *child;
+	block_sg_t *sg;
+	uint64 end = req->lba + req->count;
+	uint64 lba;
+	uint64 m;
+	uint64 i;
+	uint64 n;
+	uint64 len;
+	uint64 si = 0;
+	uint64 soff = 0;
+	for (i = 0; i < RAID0_QUEUE_DEPTH; i ++){
+		if (!r->slot[i].used){
+			slot = &r->slot[i];
+			break;
+		}
+	}
+	if (slot == null){
+		return false;
+	}
+	slot->used = true;
+	slot->raid = r;
+	slot->req = req;
+	slot->pending = 0;
+	slot->ok = true;
+	for (m = 0; m < r->count; m ++){
+		child = &slot->child[m];
+		mem_fill((uint8 *)child, sizeof(block_req_t), 0);
+		child->op = req->op;
+		// The scheduler of the striped device already drains around barriers
+		child->flags = (req->flags & ~BLOCK_REQ_BARRIER);
+		child->lba = raid0_map(r, m, req->lba);
+		child->count = raid0_map(r, m, end) - child->lba;
+		child->sg = slot->sg[m];
+		child->done = raid0_child_done;
+		child->priv = slot;
+	}
+	// Deal the buffers out chunk by chunk
+	for (lba = req->lba; lba < end; lba += n){
+		m = (lba / r->chunk) % r->count;
+		n = r->chunk - (lba % r->chunk);
+		if (n > end - lba){
+			n = end - lba;
+		}
+		child = &slot->child[m];
+		len = n * dev->sector_size;
+		while (len > 0){
+			sg = (child->sg_count > 0 ? &child->sg[child->sg_count - 1] : null);
+			i = req->sg[si].len - soff;
+			if (i > len){
+				i = len;
+			}
+			if (sg != null && sg->addr + sg->len == req->sg[si].addr + soff){
+				sg->len += i;
+			} else if (child->sg_count < r->max_sg){
+				sg = &child->sg[child->sg_count ++];
+				sg->addr = req->sg[si].addr + soff;
+				sg->len = i;
+			} else {
+				// Can't happen within max_segments of the striped device
+				slot->used = false;
+				block_complete(req, false);
+				return true;
+			}
+			soff += i;
+			len -= i;
+			if (soff == req->sg[si].len){
+				si ++;
+				soff = 0;
+			}
+		}
+	}
+	r->in_flight ++;
+	r->requests ++;
+	if (!r->plugged){
+		r->plugged = true;
+		for (m = 0; m < r->count; m ++){
+			block_plug(r->member[m]);
+		}
+	}
+	// Count every part first - members may complete them right away
+	for (m = 0; m < r->count; m ++){
+		if (slot->child[m].count > 0){
+			slot->pending ++;
+		}
+	}
+	if (slot->pending == r->count){
+		r->full ++;
+	}
+	for (m = 0; m < r->count; m ++){
+		child = &slot->child[m];
+		if (child->count == 0){
+			continue;
+		}
+		r->out[m] ++;
+		r->sent[m] ++;
+		r->sectors[m] += child->count;
+		if (!block_submit(r->member[m], child)){
+			block_complete(child, false);
+		}
+	}
+	return true;
+}
+/**
+* Reap member requests
+* Waiting waits on the first busy member, the rest are only checked.
+*/
+static void raid0_poll(block_dev_t *dev, bool wait){
+	raid0_t *r = (raid0_t *)dev->priv;
+	uint64 reaped = r->reaped;
+	uint64 m;
+	raid0_commit(dev);
+	for (m = 0; m < r->count; m ++){
+		if (r->out[m] > 0){
+			block_poll(r->member[m], false);
+		}
+	}
+	if (!wait || r->reaped != reaped){
+		return;
+	}
+	for (m = 0; m < r->count; m ++){
+		if (r->out[m] > 0){
+			block_poll(r->member[m], true);
+			return;
+		}
+	}
+}
+/**
+* Flush every member with a cache
+*/
+static bool raid0_flush(block_dev_t *dev){
+	raid0_t *r = (raid0_t *)dev->priv;
+	bool ok = true;
+	uint64 m;
+	raid0_commit(dev);
+	for (m = 0; m < r->count; m ++){
+		// Members without a flush write through
+		if (r->member[m]->ops->flush != null && !block_flush(r->member[m])){
+			ok = false;
+		}
+	}
+	return ok;
+}
+/**
+* Discard the matching range on every member
+*/
+static bool raid0_discard(block_dev_t *dev, uint64 lba, uint64 count){
+	raid0_t *r = (raid0_t *)dev->priv;
+	bool ok = true;
+	uint64 start;
+	uint64 stop;
+	uint64 m;
+	for (m = 0; m < r->count; m ++){
+		start = raid0_map(r, m, lba);
+		stop = raid0_map(r, m, lba + count);
+		if (stop > start && !block_discard(r->member[m], start, stop - start)){
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+static block_ops_t _raid0_ops = {
+	.submit = raid0_submit,
+	.commit = raid0_commit,
+	.poll = raid0_poll,
+	.flush = raid0_flush,
+	.discard = raid0_discard
+};
+
+block_dev_t *raid0_create(const char *name, block_dev_t **members, uint64 count, uint64 chunk_size){
+	raid0_t *r;
+	block_dev_t *dev;
+	uint64 sector_size;
+	uint64 capacity = 0;
+	uint64 child_max = RAID0_MAX_SECTORS;
+	uint64 rows;
+	uint64 m;
+	if (_raid0_count >= RAID0_MAX_DEV || count == 0 || count > RAID0_MAX_MEMBERS || members[0] == null){
+		return null;
+	}
+	r = &_raid0[_raid0_count];
+	mem_fill((uint8 *)r, sizeof(raid0_t), 0);
+	sector_size = members[0]->sector_size;
+	if (chunk_size < sector_size || (chunk_size % sector_size) != 0){
+		return null;
+	}
+	r->count = count;
+	r->chunk = chunk_size / sector_size;
+	r->max_sg = RAID0_MAX_SG;
+	for (m = 0; m < count; m ++){
+		if (members[m] == null || members[m]->sector_size != sector_size){
+			return null;
+		}
+		r->member[m] = members[m];
+		if (m == 0 || members[m]->capacity < capacity){
+			capacity = members[m]->capacity;
+		}
+		if (members[m]->max_sectors != 0 && members[m]->max_sectors < child_max){
+			child_max = members[m]->max_sectors;
+		}
+		if (members[m]->max_segments != 0 && members[m]->max_segments < r->max_sg){
+			r->max_sg = members[m]->max_segments;
+		}
+	}
+	// Member requests have to take a whole chunk
+	rows = child_max / r->chunk;
+	if (rows > RAID0_MAX_ROWS){
+		rows = RAID0_MAX_ROWS;
+	}
+	if (rows == 0 || rows >= r->max_sg){
+		return null;
+	}
+	// Members are used up to the last whole chunk of the smallest one
+	capacity = (capacity / r->chunk) * r->chunk * count;
+	if (capacity == 0){
+		return null;
+	}
+	r->slot = (raid0_slot_t *)page_reserve(RAID0_QUEUE_DEPTH * sizeof(raid0_slot_t));
+	if (r->slot == null){
+		return null;
+	}
+	mem_fill((uint8 *)r->slot, RAID0_QUEUE_DEPTH * sizeof(raid0_slot_t), 0);
+	dev = block_register(name, &_raid0_ops, sector_size, capacity, RAID0_QUEUE_DEPTH, (void *)r);
+	if (dev == null){
+		return null;
+	}
+	// Any range of rows whole stripes long gives each member rows chunks,
+	// every chunk boundary inside a member request costs one more entry
+	dev->max_sectors = rows * r->chunk * count;
+	dev->max_segments = r->max_sg - rows;
+	dev->phys_sector_size = members[0]->phys_sector_size;
+	dev->align_offset = members[0]->align_offset;
+	r->dev = dev;
+	_raid0_count ++;
+	return dev;
+}
+
+#if DEBUG == 1
+void raid0_list(){
+	uint64 i;
+	uint64 m;
+	raid0_t *r;
+	for (i = 0; i < _raid0_count; i ++){
+		r = &_raid0[i];
+		debug_print(DC_WB, "%s: %uMB, members:%u, chunk:%uKB, requests:%u, full stripe:%u",
+			r->dev->name, (r->dev->capacity * r->dev->sector_size) / 1024 / 1024, r->count,
+			(r->chunk * r->dev->sector_size) / 1024, r->requests, r->full);
+		for (m = 0; m < r->count; m ++){
+			debug_print(DC_WB, "     %s: requests:%u, sectors:%u", r->member[m]->name, r->sent[m], r->sectors[m]);
+		}
+	}
+}
+#endif
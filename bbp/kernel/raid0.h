@@ -0,0 +1,67 @@
+/*
+
+Striped (RAID0) block device
+============================
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+
+#ifndef __raid0_h
+#define __raid0_h
+
+#include "common.h"
+#include "../config.h"
+#include "block.h"
+
+// Most member devices in a striped set
+#define RAID0_MAX_MEMBERS	8
+
+/**
+* Create a striped device over member block devices and register it
+* Consecutive chunks go to consecutive members, so a request spanning
+* a whole stripe keeps every member busy at once.
+* @param [in] name - device name
+* @param [in] members - member block devices (same sector size)
+* @param count - number of members (1 - RAID0_MAX_MEMBERS)
+* @param chunk_size - bytes written to one member before moving on to the next (multiple of the sector size)
+* @return block device or null on failure
+*/
+block_dev_t *raid0_create(const char *name, block_dev_t **members, uint64 count, uint64 chunk_size);
+
+#if DEBUG == 1
+/**
+* List striped devices and how the load spreads over their members
+*/
+void raid0_list();
+#endif
+
+#endif /* __raid0_h */
@@ -0,0 +1,98 @@
+/*
+
+RAM disk
+========
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "lib.h"
+#include "paging.h"
+#include "ramdisk.h"
+
+/**
+* Copy request data to/from the backing memory
+*/
+static bool ramdisk_submit(block_dev_t *dev, block_req_t *req){
+	uint8 *ptr = (uint8 *)dev->priv + (req->lba * dev->sector_size);
+	uint64 i;
+	for (i = 0; i < req->sg_count; i ++){
+		if (req->op == BLOCK_OP_WRITE){
+			mem_copy(ptr, req->sg[i].len, (uint8 *)req->sg[i].addr);
+		} else {
+			mem_copy((uint8 *)req->sg[i].addr, req->sg[i].len, ptr);
+		}
+		ptr += req->sg[i].len;
+	}
+	// Memory copies complete immediately
+	block_complete(req, true);
+	return true;
+}
+/**
+* Nothing is ever in flight
+*/
+static void ramdisk_poll(block_dev_t *dev, bool wait){
+	(void)dev;
+	(void)wait;
+}
+/**
+* Memory is as persistent as it gets
+*/
+static bool ramdisk_flush(block_dev_t *dev){
+	(void)dev;
+	return true;
+}
+/**
+* Zero discarded sectors (deterministic read after trim)
+*/
+static bool ramdisk_discard(block_dev_t *dev, uint64 lba, uint64 count){
+	mem_fill((uint8 *)dev->priv + (lba * dev->sector_size), count * dev->sector_size, 0);
+	return true;
+}
+
+static block_ops_t _ramdisk_ops = {
+	.submit = ramdisk_submit,
+	.poll = ramdisk_poll,
+	.flush = ramdisk_flush,
+	.discard = ramdisk_discard
+};
+
+block_dev_t *ramdisk_create(const char *name, uint8 *base, uint64 size){
+	uint64 sectors = size / RAMDISK_SECTOR_SIZE;
+	if (sectors == 0){
+		return null;
+	}
+	if (base == null){
+		base = (uint8 *)page_reserve(sectors * RAMDISK_SECTOR_SIZE);
+	}
+	return block_register(name, &_ramdisk_ops, RAMDISK_SECTOR_SIZE, sectors, 1, base);
+}
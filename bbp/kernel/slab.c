@@ -0,0 +1,472 @@
+/*
+
+Slab allocator (kernel heap)
+============================
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "lib.h"
+#include "paging.h"
+#include "apic.h"
+#include "slab.h"
+#if DEBUG == 1
+	#include "debug_print.h"
+#endif
+
+#define SLAB_ORDER			4		// Slab is a 2^4 page (64KB) block
+#define SLAB_SIZE			(PAGE_SIZE << SLAB_ORDER)
+#define SLAB_MIN_CLASS		16		// Smallest kmalloc() size class
+#define SLAB_MAX_CLASS		8192	// Biggest kmalloc() size class, page blocks above
+#define SLAB_CLASSES		10		// 16 - 8192
+#define SLAB_CPU_SIZE		16		// Objects in a per-CPU freelist
+#define SLAB_CPU_BATCH		8		// Objects moved per refill or flush
+
+typedef struct slab_struct slab_t;
+
+/**
+* Slab header - sits at the start of the slab block, so an object finds
+* its slab by masking the address
+*/
+struct slab_struct {
+	slab_cache_t *cache;
+	slab_t *next;
+	slab_t *prev;
+	slab_t **list;					// List the slab is on
+	void *free;						// Free objects
+	uint64 used;					// Objects taken from the slab
+};
+/**
+* Per-CPU freelist - only touched by its own CPU with interrupts off
+*/
+typedef struct {
+	uint64 count;
+	void *obj[SLAB_CPU_SIZE];		// Object stack, top is the most recently freed
+	uint64 allocs;
+	uint64 frees;
+	uint64 refills;
+	uint64 flushes;
+} __ALIGN(SLAB_ALIGN) slab_cpu_t;
+/**
+* Object cache
+*/
+struct slab_cache_struct {
+	char name[SLAB_NAME_LEN];
+	uint64 size;					// Object stride
+	uint64 link;					// Offset of the free list link in an object
+	uint64 offset;					// First object offset in a slab
+	uint64 per_slab;				// Objects per slab
+	slab_ctor_t ctor;
+	volatile uint64 lock;
+	slab_t *partial;				// Slabs with free and used objects
+	slab_t *full;					// Slabs with no free objects
+	slab_t *empty;					// Spare slab with no used objects
+	uint64 slabs;					// Slabs held
+	uint64 used;					// Objects taken from slabs (per-CPU freelists included)
+	slab_cpu_t *cpu;				// Per-CPU freelists
+	uint64 cpu_count;
+	slab_cache_t *next;				// Next cache
+};
+
+// kmalloc() size classes
+static slab_cache_t _slab_class[SLAB_CLASSES];
+// All caches
+static slab_cache_t *_slab_caches = null;
+static volatile uint64 _slab_caches_lock = 0;
+
+/**
+* Disable interrupts
+* @return previous RFLAGS
+*/
+static uint64 slab_irq_save(){
+	uint64 flags;
+	asm volatile ("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+	return flags;
+}
+/**
+* Restore interrupt state
+* @param flags - RFLAGS from slab_irq_save()
+*/
+static void slab_irq_restore(uint64 flags){
+	asm volatile ("pushq %0\n\tpopfq" : : "r"(flags) : "memory", "cc");
+}
+/**
+* Take a spinlock with interrupts off
+* @param lock - lock variable
+* @return previous RFLAGS
+*/
+static uint64 slab_lock(volatile uint64 *lock){
+	uint64 flags = slab_irq_save();
+	uint64 busy = 1;
+	while (true){
+		asm volatile ("xchgq %0, %1" : "+r"(busy), "+m"(*lock) : : "memory");
+		if (busy == 0){
+			break;
+		}
+		asm volatile ("pause");
+	}
+	return flags;
+}
+/**
+* Release a spinlock
+* @param lock - lock variable
+* @param flags - RFLAGS from slab_lock()
+*/
+static void slab_unlock(volatile uint64 *lock, uint64 flags){
+	asm volatile ("" : : : "memory");
+	(*lock) = 0;
+	slab_irq_restore(flags);
+}
+/**
+* Get the per-CPU freelist of the current CPU (interrupts off)
+*/
+static slab_cpu_t *slab_cpu(slab_cache_t *cache){
+	return &cache->cpu[apic_cpu_index() % cache->cpu_count];
+}
+/**
+* Take a slab off its list
+* @param slab - slab
+*/
+static void slab_unlink(slab_t *slab){
+	if (slab->list == null){
+		return;
+	}
+	if (slab->prev != null){
+		slab->prev->next = slab->next;
+	} else {
+		(*slab->list) = slab->next;
+	}
+	if (slab->next != null){
+		slab->next->prev = slab->prev;
+	}
+	slab->list = null;
+}
+/**
+* Put a slab on the list matching its state
+* @param cache - object cache
+* @param slab - slab
+*/
+static void slab_place(slab_cache_t *cache, slab_t *slab){
+	slab_t **list;
+	if (slab->free == null){
+		list = &cache->full;
+	} else if (slab->used == 0){
+		list = &cache->empty;
+	} else {
+		list = &cache->partial;
+	}
+	if (slab->list == list){
+		return;
+	}
+	slab_unlink(slab);
+	slab->prev = null;
+	slab->next = (*list);
+	if (slab->next != null){
+		slab->next->prev = slab;
+	}
+	(*list) = slab;
+	slab->list = list;
+}
+/**
+* Get a new slab and carve it into objects
+* Caller holds the cache lock.
+* @param cache - object cache
+* @return slab or null if memory ran out
+*/
+static slab_t *slab_grow(slab_cache_t *cache){
+	slab_t *slab = (slab_t *)page_alloc(SLAB_ORDER);
+	uint8 *obj;
+	uint64 i;
+	if (slab == null){
+		return null;
+	}
+	slab->cache = cache;
+	slab->next = null;
+	slab->prev = null;
+	slab->list = null;
+	slab->free = null;
+	slab->used = 0;
+	// Link backwards, so objects go out in address order
+	for (i = cache->per_slab; i > 0; i --){
+		obj = (uint8 *)slab + cache->offset + (i - 1) * cache->size;
+		if (cache->ctor != null){
+			cache->ctor(obj);
+		}
+		*(void **)(obj + cache->link) = slab->free;
+		slab->free = obj;
+	}
+	cache->slabs ++;
+	return slab;
+}
+/**
+* Move a batch of objects from slabs into a per-CPU freelist
+* @param cache - object cache
+* @param cpu - per-CPU freelist
+*/
+static void slab_refill(slab_cache_t *cache, slab_cpu_t *cpu){
+	uint64 flags = slab_lock(&cache->lock);
+	slab_t *slab;
+	void *obj;
+	while (cpu->count < SLAB_CPU_BATCH){
+		slab = cache->partial;
+		if (slab == null){
+			slab = cache->empty;
+		}
+		if (slab == null){
+			slab = slab_grow(cache);
+			if (slab == null){
+				break;
+			}
+		}
+		obj = slab->free;
+		slab->free = *(void **)((uint8 *)obj + cache->link);
+		slab->used ++;
+		slab_place(cache, slab);
+		cpu->obj[cpu->count ++] = obj;
+		cache->used ++;
+	}
+	slab_unlock(&cache->lock, flags);
+	cpu->refills ++;
+}
+/**
+* Return the oldest batch of a full per-CPU freelist to its slabs
+* Keeps one empty slab around, releases the others.
+* @param cache - object cache
+* @param cpu - per-CPU freelist
+*/
+static void slab_flush(slab_cache_t *cache, slab_cpu_t *cpu){
+	uint64 flags = slab_lock(&cache->lock);
+	slab_t *slab;
+	void *obj;
+	uint64 i;
+	for (i = 0; i < SLAB_CPU_BATCH; i ++){
+		obj = cpu->obj[i];
+		slab = (slab_t *)((uint64)obj & ~(uint64)(SLAB_SIZE - 1));
+		*(void **)((uint8 *)obj + cache->link) = slab->free;
+		slab->free = obj;
+		slab->used --;
+		cache->used --;
+		if (slab->used == 0 && cache->empty != null && cache->empty != slab){
+			// One spare is enough
+			slab_unlink(slab);
+			cache->slabs --;
+			page_free((uint64)slab);
+		} else {
+			slab_place(cache, slab);
+		}
+	}
+	slab_unlock(&cache->lock, flags);
+	cpu->count -= SLAB_CPU_BATCH;
+	mem_copy((uint8 *)cpu->obj, cpu->count * sizeof(void *), (uint8 *)&cpu->obj[SLAB_CPU_BATCH]);
+	cpu->flushes ++;
+}
+/**
+* Set up a cache
+* @param cache - cache structure
+* @param [in] name - cache name
+* @param size - object size
+* @param align - object alignment
+* @param ctor - object constructor
+* @param cpu - per-CPU freelists (one per CPU)
+* @param cpu_count - CPU count
+* @return false if the object doesn't fit in a slab
+*/
+static bool slab_setup(slab_cache_t *cache, const char *name, uint64 size, uint64 align, slab_ctor_t ctor, slab_cpu_t *cpu, uint64 cpu_count){
+	uint64 flags;
+	if (align < sizeof(void *)){
+		align = sizeof(void *);
+	}
+	mem_fill((uint8 *)cache, sizeof(slab_cache_t), 0);
+	str_copy(cache->name, SLAB_NAME_LEN - 1, name);
+	// Constructed objects keep their contents while free, link goes after them
+	cache->link = 0;
+	if (ctor != null){
+		cache->link = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+		size = cache->link + sizeof(void *);
+	}
+	if (size < sizeof(void *)){
+		size = sizeof(void *);
+	}
+	cache->size = (size + align - 1) & ~(align - 1);
+	cache->offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+	if (cache->offset + cache->size > SLAB_SIZE){
+		return false;
+	}
+	cache->per_slab = (SLAB_SIZE - cache->offset) / cache->size;
+	cache->ctor = ctor;
+	cache->cpu = cpu;
+	cache->cpu_count = cpu_count;
+	flags = slab_lock(&_slab_caches_lock);
+	cache->next = _slab_caches;
+	_slab_caches = cache;
+	slab_unlock(&_slab_caches_lock, flags);
+	return true;
+}
+/**
+* Get the CPU count for per-CPU freelists
+*/
+static uint64 slab_cpu_count(){
+	uint64 count = apic_num_cpu();
+	if (count == 0){
+		count = 1;
+	}
+	return count;
+}
+
+void slab_init(){
+	uint64 count = slab_cpu_count();
+	slab_cpu_t *cpu = (slab_cpu_t *)page_reserve(SLAB_CLASSES * count * sizeof(slab_cpu_t));
+	char name[SLAB_NAME_LEN];
+	uint64 size = SLAB_MIN_CLASS;
+	uint64 i;
+	if (cpu == null){
+		return;
+	}
+	for (i = 0; i < SLAB_CLASSES; i ++){
+		mem_fill((uint8 *)name, SLAB_NAME_LEN, 0);
+		str_write_f(name, SLAB_NAME_LEN - 1, "kmalloc-%u", size);
+		slab_setup(&_slab_class[i], name, size, (size < SLAB_ALIGN ? size : SLAB_ALIGN), null, cpu + i * count, count);
+		size <<= 1;
+	}
+}
+slab_cache_t *slab_create(const char *name, uint64 size, uint64 align, slab_ctor_t ctor){
+	uint64 count = slab_cpu_count();
+	slab_cache_t *cache = (slab_cache_t *)kmalloc(sizeof(slab_cache_t));
+	slab_cpu_t *cpu = (slab_cpu_t *)kmalloc(count * sizeof(slab_cpu_t));
+	if (cache == null || cpu == null){
+		kfree(cache);
+		kfree(cpu);
+		return null;
+	}
+	mem_fill((uint8 *)cpu, count * sizeof(slab_cpu_t), 0);
+	if (!slab_setup(cache, name, size, align, ctor, cpu, count)){
+		kfree(cache);
+		kfree(cpu);
+		return null;
+	}
+	return cache;
+}
+void *slab_alloc(slab_cache_t *cache){
+	slab_cpu_t *cpu;
+	void *obj = null;
+	uint64 flags;
+	// Interrupts off keep us on this CPU's freelist, no lock needed
+	flags = slab_irq_save();
+	cpu = slab_cpu(cache);
+	if (cpu->count == 0){
+		slab_refill(cache, cpu);
+	}
+	if (cpu->count > 0){
+		obj = cpu->obj[-- cpu->count];
+		cpu->allocs ++;
+	}
+	slab_irq_restore(flags);
+	return obj;
+}
+void slab_free(slab_cache_t *cache, void *obj){
+	slab_cpu_t *cpu;
+	uint64 flags;
+	if (obj == null){
+		return;
+	}
+	flags = slab_irq_save();
+	cpu = slab_cpu(cache);
+	if (cpu->count == SLAB_CPU_SIZE){
+		slab_flush(cache, cpu);
+	}
+	cpu->obj[cpu->count ++] = obj;
+	cpu->frees ++;
+	slab_irq_restore(flags);
+}
+void slab_get_stats(slab_cache_t *cache, slab_stats_t *stats){
+	uint64 i;
+	mem_fill((uint8 *)stats, sizeof(slab_stats_t), 0);
+	for (i = 0; i < cache->cpu_count; i ++){
+		stats->cached += cache->cpu[i].count;
+		stats->allocs += cache->cpu[i].allocs;
+		stats->frees += cache->cpu[i].frees;
+		stats->refills += cache->cpu[i].refills;
+		stats->flushes += cache->cpu[i].flushes;
+	}
+	stats->size = cache->size;
+	stats->slabs = cache->slabs;
+	stats->objects = cache->slabs * cache->per_slab;
+	stats->used = cache->used - stats->cached;
+}
+void *kmalloc(uint64 size){
+	uint64 i = 0;
+	uint64 class_size = SLAB_MIN_CLASS;
+	if (size == 0){
+		return null;
+	}
+	if (size > SLAB_MAX_CLASS){
+		// Whole page block, smallest order that holds it
+		while (i <= PAGE_MAX_ORDER && ((uint64)PAGE_SIZE << i) < size){
+			i ++;
+		}
+		return (void *)page_alloc(i);
+	}
+	while (class_size < size){
+		class_size <<= 1;
+		i ++;
+	}
+	if (_slab_class[i].cpu == null){
+		return null;
+	}
+	return slab_alloc(&_slab_class[i]);
+}
+void kfree(void *ptr){
+	slab_t *slab;
+	if (ptr == null){
+		return;
+	}
+	// Page blocks start on a block head, objects never do (slab header is there)
+	if (page_is_block((uint64)ptr)){
+		page_free((uint64)ptr);
+		return;
+	}
+	slab = (slab_t *)((uint64)ptr & ~(uint64)(SLAB_SIZE - 1));
+	slab_free(slab->cache, ptr);
+}
+
+#if DEBUG == 1
+void slab_list(){
+	slab_cache_t *cache;
+	slab_stats_t stats;
+	for (cache = _slab_caches; cache != null; cache = cache->next){
+		slab_get_stats(cache, &stats);
+		if (stats.slabs > 0){
+			debug_print(DC_WB, "slab:%s, size: %u, slabs: %u, used: %u/%u, cached: %u", cache->name, stats.size, stats.slabs, stats.used, stats.objects, stats.cached);
+		}
+	}
+}
+#endif
@@ -0,0 +1,122 @@
+/*
+
+Slab allocator (kernel heap)
+============================
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+
+#ifndef __slab_h
+#define __slab_h
+
+#include "common.h"
+#include "../config.h"
+
+#define SLAB_NAME_LEN		16		// Cache name length (with the terminating null)
+#define SLAB_ALIGN			64		// Cache line size
+
+typedef struct slab_cache_struct slab_cache_t;
+
+/**
+* Object constructor - runs once when a slab is carved up, objects
+* have to be back in the constructed state when freed
+*/
+typedef void (*slab_ctor_t)(void *obj);
+
+/**
+* Cache usage
+*/
+typedef struct {
+	uint64 size;			// Object stride in bytes
+	uint64 slabs;			// Slabs held
+	uint64 objects;			// Objects the slabs hold
+	uint64 used;			// Objects handed out
+	uint64 cached;			// Free objects in per-CPU freelists
+	uint64 allocs;			// Allocations
+	uint64 frees;			// Releases
+	uint64 refills;			// Per-CPU freelist refills
+	uint64 flushes;			// Per-CPU freelist flushes
+} slab_stats_t;
+
+/**
+* Set up kmalloc() size classes (call once APIC knows the CPU count)
+*/
+void slab_init();
+/**
+* Create an object cache
+* @param [in] name - cache name
+* @param size - object size in bytes
+* @param align - object alignment (power of two, 0 - 8 bytes, SLAB_ALIGN - cache line)
+* @param ctor - object constructor (null - none)
+* @return cache or null if the object doesn't fit in a slab
+*/
+slab_cache_t *slab_create(const char *name, uint64 size, uint64 align, slab_ctor_t ctor);
+/**
+* Allocate an object from a cache
+* @param cache - object cache
+* @return object or null if memory ran out
+*/
+void *slab_alloc(slab_cache_t *cache);
+/**
+* Return an object to its cache
+* @param cache - object cache
+* @param obj - object from slab_alloc()
+*/
+void slab_free(slab_cache_t *cache, void *obj);
+/**
+* Get cache usage
+* @param cache - object cache
+* @param [out] stats - usage counters
+*/
+void slab_get_stats(slab_cache_t *cache, slab_stats_t *stats);
+/**
+* Allocate kernel memory
+* Memory isn't zeroed. Sizes up to a power of two size class are aligned
+* to the class size (cache line at most), bigger ones get whole pages.
+* @param size - bytes to allocate
+* @return pointer or null
+*/
+void *kmalloc(uint64 size);
+/**
+* Release memory from kmalloc()
+* @param ptr - pointer from kmalloc() (null is ignored)
+*/
+void kfree(void *ptr);
+
+#if DEBUG == 1
+/**
+* List object caches and their usage
+*/
+void slab_list();
+#endif
+
+#endif /* __slab_h */
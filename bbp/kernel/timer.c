@@ -0,0 +1,105 @@
+/*
+
+Time Stamp Counter timing
+=========================
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "timer.h"
+#include "io.h"
+#if DEBUG == 1
+	#include "debug_print.h"
+#endif
+
+// PIT input clock (Hz)
+#define PIT_FREQUENCY		1193182
+// Calibration period (ms)
+#define TIMER_CALIBRATE_MS	10
+
+// TSC ticks per microsecond (assume 1GHz until calibrated)
+static uint64 _ticks_per_us = 1000;
+
+void timer_init(){
+	uint16 count = (PIT_FREQUENCY * TIMER_CALIBRATE_MS) / 1000;
+	uint64 start;
+	uint64 end;
+	uint8 val;
+	// Enable PIT channel 2 gate, keep the speaker off
+	val = inb(0x61);
+	outb(0x61, (val & 0xFD) | 0x01);
+	// Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+	outb(0x43, 0xB0);
+	outb(0x42, (uint8)count);
+	outb(0x42, (uint8)(count >> 8));
+	// Restart the count by toggling the gate
+	val = inb(0x61);
+	outb(0x61, val & 0xFE);
+	outb(0x61, val | 0x01);
+	start = timer_ticks();
+	// Wait for OUT2 to go high
+	while ((inb(0x61) & 0x20) == 0){}
+	end = timer_ticks();
+	_ticks_per_us = (end - start) / (TIMER_CALIBRATE_MS * 1000);
+	if (_ticks_per_us == 0){
+		_ticks_per_us = 1;
+	}
+#if DEBUG == 1
+	debug_print(DC_WB, "TSC: %dMHz", _ticks_per_us);
+#endif
+}
+
+uint64 timer_ticks(){
+	split_uint64_t v;
+	asm volatile ("rdtsc" : "=a"(v.low), "=d"(v.high));
+	return (((uint64)v.high) << 32) | v.low;
+}
+
+uint64 timer_ticks_per_us(){
+	return _ticks_per_us;
+}
+
+uint64 timer_us_to_ticks(uint64 us){
+	return us * _ticks_per_us;
+}
+
+uint64 timer_ticks_to_us(uint64 ticks){
+	return ticks / _ticks_per_us;
+}
+
+void timer_delay(uint64 us){
+	uint64 start = timer_ticks();
+	uint64 ticks = timer_us_to_ticks(us);
+	while (timer_ticks() - start < ticks){
+		asm volatile ("pause");
+	}
+}
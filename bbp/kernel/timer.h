@@ -0,0 +1,77 @@
+/*
+
+Time Stamp Counter timing
+=========================
+
+TSC calibrated against PIT channel 2, used for short delays, timeouts
+and latency measurements.
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef __timer_h
+#define __timer_h
+
+#include "common.h"
+
+/**
+* Calibrate Time Stamp Counter against PIT
+*/
+void timer_init();
+/**
+* Read Time Stamp Counter
+* @return current tick count
+*/
+uint64 timer_ticks();
+/**
+* Get the number of ticks per microsecond
+* @return tick rate
+*/
+uint64 timer_ticks_per_us();
+/**
+* Convert microseconds to ticks
+* @param us - microseconds
+* @return ticks
+*/
+uint64 timer_us_to_ticks(uint64 us);
+/**
+* Convert ticks to microseconds
+* @param ticks - tick count
+* @return microseconds
+*/
+uint64 timer_ticks_to_us(uint64 ticks);
+/**
+* Busy-wait
+* @param us - microseconds to wait
+*/
+void timer_delay(uint64 us);
+
+#endif /* __timer_h */
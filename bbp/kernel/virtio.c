@@ -0,0 +1,1413 @@
+/*
+
+virtio-blk driver
+=================
+
+License (BSD-3)
+===============
+
+Copyright (c) 2013, Gusts 'gusC' Kaksis <gusts.kaksis@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "../config.h"
+#include "lib.h"
+#include "paging.h"
+#include "slab.h"
+#include "dma.h"
+#include "timer.h"
+#include "interrupts.h"
+#include "apic.h"
+#include "pci.h"
+#include "block.h"
+#include "virtio.h"
+#if DEBUG == 1
+	#include "debug_print.h"
+#endif
+
+// PCI IDs
+#define VIRTIO_VENDOR_ID		0x1AF4
+#define VIRTIO_BLK_ID_LEGACY	0x1001	// Transitional device
+#define VIRTIO_BLK_ID_MODERN	0x1042
+
+// Vendor capability types
+#define VIRTIO_PCI_CAP_COMMON	1		// Common configuration
+#define VIRTIO_PCI_CAP_NOTIFY	2		// Queue notifications
+#define VIRTIO_PCI_CAP_ISR		3		// INTx interrupt status
+#define VIRTIO_PCI_CAP_DEVICE	4		// Device configuration
+
+// Device status bits
+#define VIRTIO_STATUS_ACK		0x01
+#define VIRTIO_STATUS_DRIVER	0x02
+#define VIRTIO_STATUS_DRIVER_OK	0x04
+#define VIRTIO_STATUS_FEATURES_OK	0x08
+#define VIRTIO_STATUS_FAILED	0x80
+
+// Feature bits
+#define VIRTIO_BLK_F_SIZE_MAX	1		// size_max is valid
+#define VIRTIO_BLK_F_SEG_MAX	2		// seg_max is valid
+#define VIRTIO_BLK_F_BLK_SIZE	6		// blk_size is valid
+#define VIRTIO_BLK_F_FLUSH		9		// Volatile cache, flush supported
+#define VIRTIO_BLK_F_TOPOLOGY	10		// Physical block size and alignment are valid
+#define VIRTIO_BLK_F_MQ			12		// num_queues is valid
+#define VIRTIO_BLK_F_DISCARD	13		// Discard supported
+#define VIRTIO_F_INDIRECT_DESC	28		// Indirect descriptor tables
+#define VIRTIO_F_EVENT_IDX		29		// Event index notification suppression
+#define VIRTIO_F_VERSION_1		32		// Modern device
+#define VIRTIO_F_RING_PACKED	34		// Packed virtqueue layout
+
+// Descriptor flags
+#define VIRTQ_DESC_F_NEXT		(1 << 0)
+#define VIRTQ_DESC_F_WRITE		(1 << 1)	// Device writes the buffer
+#define VIRTQ_DESC_F_INDIRECT	(1 << 2)
+#define VIRTQ_DESC_F_AVAIL		(1 << 7)	// Packed ring
+#define VIRTQ_DESC_F_USED		(1 << 15)	// Packed ring
+
+// Notification suppression
+#define VIRTQ_AVAIL_F_NO_INTERRUPT	1	// Split ring - driver doesn't want interrupts
+#define VIRTQ_USED_F_NO_NOTIFY	1		// Split ring - device doesn't want notifications
+#define VIRTQ_EVENT_ENABLE		0		// Packed ring - always
+#define VIRTQ_EVENT_DISABLE		1		// Packed ring - never
+#define VIRTQ_EVENT_DESC		2		// Packed ring - at a specific descriptor
+#define VIRTIO_NO_VECTOR		0xFFFF
+
+// Request types and status
+#define VIRTIO_BLK_T_IN			0
+#define VIRTIO_BLK_T_OUT		1
+#define VIRTIO_BLK_T_FLUSH		4
+#define VIRTIO_BLK_T_DISCARD	11
+#define VIRTIO_BLK_S_OK			0
+#define VIRTIO_SECTOR_SIZE		512		// Unit of request sectors and capacity
+
+// Driver limits
+#define VIRTIO_MAX_DEV			4			// Devices
+#define VIRTIO_MAX_QUEUES		8			// Virtqueues per device
+#define VIRTIO_QUEUE_SIZE		128			// Largest ring used
+#define VIRTIO_MAX_SEGS			32			// Data segments per request
+#define VIRTIO_MAX_BYTES		0x20000		// 128KiB per request
+#define VIRTIO_DISCARD_RANGES	256			// Ranges per discard request (4KiB)
+#define VIRTIO_DISCARD_MAX		0xFFFFFFFF	// Sectors per range
+#define VIRTIO_TIMEOUT_US		5000000		// Request timeout
+#define VIRTIO_RESET_TIMEOUT_US	1000000		// Device reset
+#define VIRTIO_PACKED			1			// Use packed rings when the device offers them
+
+typedef struct virtio_dev_struct virtio_dev_t;
+
+/**
+* Common configuration structure
+* 64-bit fields are accessed as two halves.
+*/
+typedef volatile struct {
+	uint32 device_feature_select;
+	uint32 device_feature;
+	uint32 driver_feature_select;
+	uint32 driver_feature;
+	uint16 msix_config;
+	uint16 num_queues;
+	uint8 device_status;
+	uint8 config_generation;
+	uint16 queue_select;
+	uint16 queue_size;
+	uint16 queue_msix_vector;
+	uint16 queue_enable;
+	uint16 queue_notify_off;
+	uint32 queue_desc_lo;
+	uint32 queue_desc_hi;
+	uint32 queue_driver_lo;
+	uint32 queue_driver_hi;
+	uint32 queue_device_lo;
+	uint32 queue_device_hi;
+} virtio_common_t;
+/**
+* Block device configuration
+*/
+typedef volatile struct {
+	uint64 capacity;			// Size in 512 byte sectors
+	uint32 size_max;			// Largest segment
+	uint32 seg_max;				// Segments per request
+	uint16 cylinders;
+	uint8 heads;
+	uint8 sectors;
+	uint32 blk_size;			// Logical block size
+	uint8 physical_block_exp;	// log2 logical blocks per physical block
+	uint8 alignment_offset;		// Offset of the first aligned logical block
+	uint16 min_io_size;
+	uint32 opt_io_size;
+	uint8 writeback;
+	uint8 unused;
+	uint16 num_queues;
+	uint32 max_discard_sectors;
+	uint32 max_discard_seg;
+	uint32 discard_sector_alignment;
+} virtio_blk_config_t;
+/**
+* Split ring descriptor
+*/
+typedef volatile struct {
+	uint64 addr;
+	uint32 len;
+	uint16 flags;
+	uint16 next;
+} virtq_desc_t; // 16 bytes
+/**
+* Split ring driver area (used_event follows the ring)
+*/
+typedef volatile struct {
+	uint16 flags;
+	uint16 idx;
+	uint16 ring[];
+} virtq_avail_t;
+/**
+* Split ring device area (avail_event follows the ring)
+*/
+typedef volatile struct {
+	uint16 flags;
+	uint16 idx;
+	struct {
+		uint32 id;				// Head of the descriptor chain
+		uint32 len;				// Bytes written by the device
+	} ring[];
+} virtq_used_t;
+/**
+* Packed ring descriptor
+*/
+typedef volatile struct {
+	uint64 addr;
+	uint32 len;
+	uint16 id;					// Buffer ID
+	uint16 flags;
+} virtq_pdesc_t; // 16 bytes
+/**
+* Packed ring event suppression
+*/
+typedef volatile struct {
+	uint16 off_wrap;			// bits 14:0 - descriptor, bit 15 - wrap counter
+	uint16 flags;				// VIRTQ_EVENT_*
+} virtq_event_t;
+/**
+* Request header
+*/
+typedef volatile struct {
+	uint32 type;				// VIRTIO_BLK_T_*
+	uint32 reserved;
+	uint64 sector;				// In 512 byte units
+} virtio_blk_hdr_t;
+/**
+* Discard range
+*/
+typedef volatile struct {
+	uint64 sector;
+	uint32 num_sectors;
+	uint32 flags;
+} virtio_blk_discard_t;
+/**
+* Per request DMA memory
+*/
+typedef volatile struct {
+	virtio_blk_hdr_t hdr;
+	uint8 status;				// Written by the device
+	uint8 reserved[15];
+	virtq_desc_t table[VIRTIO_MAX_SEGS + 2];	// Indirect descriptors (packed layout on packed rings)
+} virtio_slot_t;
+/**
+* Buffer segment of a request
+*/
+typedef struct {
+	uint64 addr;				// Physical address
+	uint32 len;
+	uint16 flags;				// VIRTQ_DESC_F_WRITE or 0
+} virtio_seg_t;
+/**
+* Request slot - indexed by buffer ID
+*/
+typedef struct {
+	bool busy;
+	bool done;					// Driver requests - completion arrived
+	bool fua;					// Write waits for a flush before it completes
+	uint8 status;				// Driver requests - completion status
+	uint16 desc_count;			// Ring descriptors taken
+	block_req_t *req;			// Block request (null for driver requests)
+	uint64 bounce;				// Bounce buffer (0 if the request buffers are used)
+	uint64 bounce_len;
+} virtio_cmd_t;
+/**
+* Virtqueue
+*/
+typedef struct {
+	virtio_dev_t *dev;
+	uint16 index;				// Queue index
+	uint16 size;				// Ring entries
+	bool packed;
+	// Split ring
+	virtq_desc_t *desc;
+	virtq_avail_t *avail;
+	virtq_used_t *used;
+	uint16 free_head;			// First free descriptor
+	uint16 head_id[VIRTIO_QUEUE_SIZE];	// Buffer ID of each chain head
+	// Packed ring
+	virtq_pdesc_t *pdesc;
+	virtq_event_t *driver_event;	// Written by the driver - interrupt suppression
+	virtq_event_t *device_event;	// Written by the device - notification suppression
+	bool avail_wrap;
+	bool used_wrap;
+	// Both
+	uint16 avail_idx;			// Next avail entry (split) or descriptor (packed)
+	uint16 last_used;			// Next used entry (split) or descriptor (packed)
+	uint16 num_free;			// Free descriptors
+	uint16 added;				// Entries made available since the last notification
+	uint16 volatile *notify;	// Notification register
+	virtio_slot_t *slot;
+	virtio_cmd_t cmd[VIRTIO_QUEUE_SIZE];
+	uint16 in_flight;			// Busy request slots
+	uint16 barrier;				// Barrier requests in flight
+	uint8 irq;					// MSI-X IRQ (0xFF - none)
+	// Statistics
+	uint64 req_count;			// Requests made available
+	uint64 notify_count;		// Notifications sent
+	uint64 notify_skipped;		// Notifications suppressed by the device
+	uint64 irq_count;			// Interrupts
+	uint64 bounce_count;		// Bounced requests
+	uint64 fua_flushes;			// Flushes sent for FUA writes
+} virtio_queue_t;
+/**
+* Device
+*/
+struct virtio_dev_struct {
+	uint64 index;
+	pci_addr_t pci;
+	virtio_common_t *common;
+	uint8 volatile *isr;
+	virtio_blk_config_t *config;
+	uint64 notify_base;
+	uint32 notify_mul;			// Notification register spacing
+	uint64 features;			// Negotiated features
+	virtio_queue_t queue[VIRTIO_MAX_QUEUES];
+	uint64 queue_count;
+	uint64 sector_size;
+	uint64 sectors;
+	uint64 seg_max;				// Data segments per request
+	uint64 size_max;			// Largest segment
+	uint64 discard_seg;			// Discard ranges per request
+	uint64 discard_max;			// Sectors per discard range (512 byte units)
+	uint8 irq;					// INTx IRQ (0xFF - none or MSI-X)
+	bool msix;
+	bool failed;
+	virtio_blk_discard_t *buf;	// Discard ranges (4KiB)
+};
+
+// Only devices actually found get allocated
+static virtio_dev_t *_virtio_dev[VIRTIO_MAX_DEV];
+static uint64 _virtio_dev_count = 0;
+
+/**
+* Check a negotiated feature
+*/
+static bool virtio_has(virtio_dev_t *dev, uint8 bit){
+	return ((dev->features >> bit) & 0x1) != 0;
+}
+/**
+* Full memory barrier - ring updates have to be visible to the device
+* before its event fields are read (and the other way round)
+*/
+static void virtio_mb(){
+	asm volatile ("mfence" : : : "memory");
+}
+/**
+* Get the virtqueue of the current CPU
+* Each CPU only touches its own queue, so queues need no locking.
+*/
+static virtio_queue_t *virtio_queue(virtio_dev_t *dev){
+	return &dev->queue[apic_cpu_index() % dev->queue_count];
+}
+/**
+* Allocate a request slot
+* @param q - virtqueue
+* @return buffer ID or -1 if all slots are busy
+*/
+static int64 virtio_cmd_alloc(virtio_queue_t *q){
+	uint16 i;
+	virtio_cmd_t *cmd;
+	for (i = 0; i < q->size; i ++){
+		cmd = &q->cmd[i];
+		if (!cmd->busy){
+			cmd->busy = true;
+			cmd->done = false;
+			cmd->fua = false;
+			cmd->status = 0;
+			cmd->desc_count = 0;
+			cmd->req = null;
+			cmd->bounce = 0;
+			cmd->bounce_len = 0;
+			q->slot[i].status = 0xFF;
+			q->in_flight ++;
+			return i;
+		}
+	}
+	return -1;
+}
+/**
+* Release a request slot
+*/
+static void virtio_cmd_free(virtio_queue_t *q, uint16 id){
+	q->cmd[id].busy = false;
+	q->in_flight --;
+}
+/**
+* Make a request available to the device
+* With indirect descriptors a request takes one ring entry, otherwise
+* it takes one descriptor per segment.
+* @param q - virtqueue
+* @param id - buffer ID
+* @param seg - segments (device readable ones first)
+* @param count - number of segments
+* @return false if the ring has no room - reap and retry
+*/
+static bool virtio_add(virtio_queue_t *q, uint16 id, virtio_seg_t *seg, uint64 count){
+	virtio_slot_t *slot = &q->slot[id];
+	virtq_pdesc_t *table = (virtq_pdesc_t *)slot->table;
+	bool indirect = virtio_has(q->dev, VIRTIO_F_INDIRECT_DESC);
+	uint16 need = (indirect ? 1 : count);
+	uint16 head;
+	uint16 idx;
+	uint16 flags;
+	uint16 head_flags = 0;
+	uint16 wrap;
+	uint64 i;
+	if (q->num_free < need){
+		return false;
+	}
+	if (indirect){
+		// Describe the request in the slot table, the ring points to it
+		for (i = 0; i < count; i ++){
+			if (q->packed){
+				table[i].addr = seg[i].addr;
+				table[i].len = seg[i].len;
+				table[i].id = 0;
+				table[i].flags = seg[i].flags;
+			} else {
+				slot->table[i].addr = seg[i].addr;
+				slot->table[i].len = seg[i].len;
+				slot->table[i].flags = seg[i].flags | (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0);
+				slot->table[i].next = i + 1;
+			}
+		}
+	}
+	if (q->packed){
+		head = q->avail_idx;
+		for (i = 0; i < need; i ++){
+			idx = q->avail_idx;
+			wrap = (q->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+			if (indirect){
+				q->pdesc[idx].addr = (uint64)slot->table;
+				q->pdesc[idx].len = count * sizeof(virtq_pdesc_t);
+				flags = VIRTQ_DESC_F_INDIRECT;
+			} else {
+				q->pdesc[idx].addr = seg[i].addr;
+				q->pdesc[idx].len = seg[i].len;
+				flags = seg[i].flags | (i + 1 < need ? VIRTQ_DESC_F_NEXT : 0);
+			}
+			q->pdesc[idx].id = id;
+			// The head goes live last, once the whole chain is in place
+			if (i == 0){
+				head_flags = (flags | wrap);
+			} else {
+				q->pdesc[idx].flags = (flags | wrap);
+			}
+			q->avail_idx ++;
+			if (q->avail_idx == q->size){
+				q->avail_idx = 0;
+				q->avail_wrap = !q->avail_wrap;
+			}
+		}
+		q->pdesc[head].flags = head_flags;
+	} else {
+		head = q->free_head;
+		idx = head;
+		for (i = 0; i < need; i ++){
+			if (indirect){
+				q->desc[idx].addr = (uint64)slot->table;
+				q->desc[idx].len = count * sizeof(virtq_desc_t);
+				q->desc[idx].flags = VIRTQ_DESC_F_INDIRECT;
+			} else {
+				q->desc[idx].addr = seg[i].addr;
+				q->desc[idx].len = seg[i].len;
+				q->desc[idx].flags = seg[i].flags | (i + 1 < need ? VIRTQ_DESC_F_NEXT : 0);
+			}
+			if (i + 1 < need){
+				idx = q->desc[idx].next;
+			}
+		}
+		q->free_head = q->desc[idx].next;
+		q->head_id[head] = id;
+		q->avail->ring[q->avail_idx % q->size] = head;
+		q->avail_idx ++;
+		q->avail->idx = q->avail_idx;
+	}
+	q->num_free -= need;
+	q->cmd[id].desc_count = need;
+	q->added += (q->packed ? need : 1);
+	q->req_count ++;
+	return true;
+}
+/**
+* Event index check - has the ring moved past the event between old and new
+*/
+static bool virtio_need_event(uint16 event, uint16 new_idx, uint16 old_idx){
+	return (uint16)(new_idx - event - 1) < (uint16)(new_idx - old_idx);
+}
+/**
+* Notify the device about new requests, unless it asked not to be
+* Requests are added by submit and pushed here once per batch.
+* @param q - virtqueue
+*/
+static void virtio_kick(virtio_queue_t *q){
+	bool event_idx = virtio_has(q->dev, VIRTIO_F_EVENT_IDX);
+	bool need;
+	uint16 off_wrap;
+	uint16 event;
+	if (q->added == 0){
+		return;
+	}
+	virtio_mb();
+	if (q->packed){
+		off_wrap = q->device_event->off_wrap;
+		switch (q->device_event->flags){
+			case VIRTQ_EVENT_DISABLE:
+				need = false;
+				break;
+			case VIRTQ_EVENT_DESC:
+				event = (off_wrap & 0x7FFF);
+				// Event in the previous lap of the ring
+				if (((off_wrap >> 15) != 0) != q->avail_wrap){
+					event -= q->size;
+				}
+				need = (!event_idx || virtio_need_event(event, q->avail_idx, q->avail_idx - q->added));
+				break;
+			default:
+				need = true;
+				break;
+		}
+	} else if (event_idx){
+		// avail_event follows the used ring
+		event = *((uint16 volatile *)&q->used->ring[q->size]);
+		need = virtio_need_event(event, q->avail_idx, q->avail_idx - q->added);
+	} else {
+		need = ((q->used->flags & VIRTQ_USED_F_NO_NOTIFY) == 0);
+	}
+	q->added = 0;
+	if (need){
+		*q->notify = q->index;
+		q->notify_count ++;
+	} else {
+		q->notify_skipped ++;
+	}
+}
+/**
+* Finish a request the device has returned
+* @param q - virtqueue
+* @param id - buffer ID
+*/
+static void virtio_cmd_done(virtio_queue_t *q, uint16 id){
+	virtio_cmd_t *cmd = &q->cmd[id];
+	virtio_slot_t *slot = &q->slot[id];
+	block_req_t *req = cmd->req;
+	virtio_seg_t seg[2];
+	bool ok = (slot->status == VIRTIO_BLK_S_OK);
+	uint64 off = 0;
+	uint64 i;
+	if (cmd->fua && ok){
+		// No FUA in virtio-blk - the write completes after a flush
+		cmd->fua = false;
+		slot->hdr.type = VIRTIO_BLK_T_FLUSH;
+		slot->hdr.sector = 0;
+		slot->status = 0xFF;
+		seg[0].addr = (uint64)&slot->hdr;
+		seg[0].len = sizeof(virtio_blk_hdr_t);
+		seg[0].flags = 0;
+		seg[1].addr = (uint64)&slot->status;
+		seg[1].len = 1;
+		seg[1].flags = VIRTQ_DESC_F_WRITE;
+		// Descriptors of the write have just been freed, so there is room
+		if (virtio_add(q, id, seg, 2)){
+			q->fua_flushes ++;
+			return;
+		}
+		ok = false;
+	}
+	if (cmd->bounce != 0){
+		if (ok && req->op == BLOCK_OP_READ){
+			for (i = 0; i < req->sg_count; i ++){
+				mem_copy((uint8 *)req->sg[i].addr, req->sg[i].len, (uint8 *)(cmd->bounce + off));
+				off += req->sg[i].len;
+			}
+		}
+		dma_free(cmd->bounce, cmd->bounce_len);
+		cmd->bounce = 0;
+	}
+	if (req == null){
+		// Driver request - the waiter releases the slot
+		cmd->status = slot->status;
+		cmd->done = true;
+		return;
+	}
+	if ((req->flags & BLOCK_REQ_BARRIER) != 0){
+		q->barrier --;
+	}
+	virtio_cmd_free(q, id);
+	block_complete(req, ok);
+}
+/**
+* Reap requests the device has returned
+* @param q - virtqueue
+* @return number of requests reaped
+*/
+static uint64 virtio_reap(virtio_queue_t *q){
+	uint64 n = 0;
+	uint16 id;
+	uint16 head;
+	uint16 tail;
+	uint16 flags;
+	uint16 i;
+	while (true){
+		if (q->packed){
+			flags = q->pdesc[q->last_used].flags;
+			// Used descriptors have both bits equal to the used wrap counter
+			if (((flags & VIRTQ_DESC_F_AVAIL) != 0) != ((flags & VIRTQ_DESC_F_USED) != 0)
+				|| ((flags & VIRTQ_DESC_F_USED) != 0) != q->used_wrap){
+				break;
+			}
+			id = q->pdesc[q->last_used].id;
+			if (id >= q->size){
+				break;
+			}
+			q->last_used += q->cmd[id].desc_count;
+			if (q->last_used >= q->size){
+				q->last_used -= q->size;
+				q->used_wrap = !q->used_wrap;
+			}
+		} else {
+			if (q->last_used == q->used->idx){
+				break;
+			}
+			head = q->used->ring[q->last_used % q->size].id;
+			id = q->head_id[head];
+			// Chain goes back to the free list
+			tail = head;
+			for (i = 1; i < q->cmd[id].desc_count; i ++){
+				tail = q->desc[tail].next;
+			}
+			q->desc[tail].next = q->free_head;
+			q->free_head = head;
+			q->last_used ++;
+		}
+		q->num_free += q->cmd[id].desc_count;
+		n ++;
+		virtio_cmd_done(q, id);
+	}
+	// Flushes of FUA writes
+	virtio_kick(q);
+	return n;
+}
+/**
+* Ask for (or stop asking for) an interrupt on the next used request
+* @param q - virtqueue
+* @param enable - true to get interrupted
+*/
+static void virtio_irq_enable(virtio_queue_t *q, bool enable){
+	bool event_idx = virtio_has(q->dev, VIRTIO_F_EVENT_IDX);
+	if (q->packed){
+		if (!enable){
+			q->driver_event->flags = VIRTQ_EVENT_DISABLE;
+		} else if (event_idx){
+			q->driver_event->off_wrap = q->last_used | (q->used_wrap ? 0x8000 : 0);
+			q->driver_event->flags = VIRTQ_EVENT_DESC;
+		} else {
+			q->driver_event->flags = VIRTQ_EVENT_ENABLE;
+		}
+	} else if (event_idx){
+		// A stale used_event is already behind the ring, so only enabling writes it
+		if (enable){
+			q->avail->ring[q->size] = q->last_used;
+		}
+	} else {
+		q->avail->flags = (enable ? 0 : VIRTQ_AVAIL_F_NO_INTERRUPT);
+	}
+}
+/**
+* Check if the device has returned requests that are not reaped yet
+*/
+static bool virtio_pending(virtio_queue_t *q){
+	uint16 flags;
+	if (q->packed){
+		flags = q->pdesc[q->last_used].flags;
+		return (((flags & VIRTQ_DESC_F_AVAIL) != 0) == ((flags & VIRTQ_DESC_F_USED) != 0)
+			&& ((flags & VIRTQ_DESC_F_USED) != 0) == q->used_wrap);
+	}
+	return (q->last_used != q->used->idx);
+}
+/**
+* Give up on a device that stopped responding
+* Reset makes the device drop every request, so all busy slots are
+* completed with an error.
+* @param dev - device
+*/
+static void virtio_fail(virtio_dev_t *dev){
+	virtio_queue_t *q;
+	uint64 i;
+	uint16 id;
+	dev->failed = true;
+	dev->common->device_status = 0;
+	for (i = 0; i < dev->queue_count; i ++){
+		q = &dev->queue[i];
+		for (id = 0; id < q->size; id ++){
+			if (q->cmd[id].busy && !q->cmd[id].done){
+				q->cmd[id].fua = false;
+				q->slot[id].status = 0xFF;
+				virtio_cmd_done(q, id);
+			}
+		}
+	}
+}
+/**
+* Sleep until the next interrupt, unless requests have returned already
+* @param q - virtqueue
+*/
+static void virtio_sleep(virtio_queue_t *q){
+	if (q->irq == 0xFF && q->dev->irq == 0xFF){
+		asm volatile ("pause");
+		return;
+	}
+	asm volatile ("cli");
+	virtio_irq_enable(q, true);
+	virtio_mb();
+	if (!virtio_pending(q)){
+		// STI takes effect after HLT starts, so the wake-up can't slip in between
+		asm volatile ("sti\n\thlt");
+	} else {
+		asm volatile ("sti");
+	}
+	virtio_irq_enable(q, false);
+}
+/**
+* Push pending requests and reap returned ones
+* @param q - virtqueue
+* @param wait - block until at least one request completes
+*/
+static void virtio_poll(virtio_queue_t *q, bool wait){
+	uint64 start = timer_ticks();
+	uint64 timeout = timer_us_to_ticks(VIRTIO_TIMEOUT_US);
+	virtio_kick(q);
+	while (virtio_reap(q) == 0 && wait && q->in_flight > 0 && !q->dev->failed){
+		if (timer_ticks() - start > timeout){
+			virtio_fail(q->dev);
+			return;
+		}
+		virtio_sleep(q);
+	}
+}
+/**
+* Get a free request slot, reaping while all of them are busy
+* @param q - virtqueue
+* @return buffer ID or -1 if the device has failed
+*/
+static int64 virtio_cmd_wait(virtio_queue_t *q){
+	int64 id;
+	while ((id = virtio_cmd_alloc(q)) < 0 && !q->dev->failed){
+		virtio_poll(q, true);
+	}
+	return (q->dev->failed ? -1 : id);
+}
+/**
+* Send a driver request and wait for it
+* @param q - virtqueue
+* @param id - buffer ID (header filled in)
+* @param seg - segments
+* @param count - number of segments
+* @return false on error or timeout
+*/
+static bool virtio_exec(virtio_queue_t *q, uint16 id, virtio_seg_t *seg, uint64 count){
+	virtio_cmd_t *cmd = &q->cmd[id];
+	bool ok;
+	while (!virtio_add(q, id, seg, count) && !q->dev->failed){
+		virtio_poll(q, true);
+	}
+	while (!cmd->done && !q->dev->failed){
+		virtio_poll(q, true);
+	}
+	ok = (cmd->done && cmd->status == VIRTIO_BLK_S_OK);
+	virtio_cmd_free(q, id);
+	return ok;
+}
+/**
+* Translate a buffer address for DMA, mapping the page in if needed
+* @param vaddr - virtual address
+* @return physical address or 0 if the page can't be mapped
+*/
+static uint64 virtio_resolve(uint64 vaddr){
+	uint64 paddr = page_resolve(vaddr);
+	if (paddr == 0 && (vaddr & PAGE_MASK) != 0){
+		// Touch the page so the page fault handler maps it in
+		*((volatile uint8 *)vaddr);
+		paddr = page_resolve(vaddr);
+	}
+	return paddr;
+}
+/**
+* Split buffers into physically contiguous segments
+* @param dev - device
+* @param sg - data buffers
+* @param sg_count - number of scatter-gather entries
+* @param flags - descriptor flags of the segments
+* @param [out] seg - segments
+* @param [out] count - number of segments
+* @return false if the buffers take more segments than the device takes
+*/
+static bool virtio_build_segs(virtio_dev_t *dev, block_sg_t *sg, uint64 sg_count, uint16 flags, virtio_seg_t *seg, uint64 *count){
+	uint64 n = 0;
+	uint64 addr;
+	uint64 len;
+	uint64 chunk;
+	uint64 paddr;
+	uint64 i;
+	for (i = 0; i < sg_count; i ++){
+		addr = sg[i].addr;
+		len = sg[i].len;
+		while (len > 0){
+			paddr = virtio_resolve(addr);
+			if (paddr == 0 && (addr & PAGE_MASK) != 0){
+				return false;
+			}
+			chunk = PAGE_SIZE - (addr & PAGE_IMASK);
+			if (chunk > len){
+				chunk = len;
+			}
+			if (n > 0 && seg[n - 1].addr + seg[n - 1].len == paddr && seg[n - 1].len + chunk <= dev->size_max){
+				seg[n - 1].len += chunk;
+			} else if (n < dev->seg_max){
+				seg[n].addr = paddr;
+				seg[n].len = chunk;
+				seg[n].flags = flags;
+				n ++;
+			} else {
+				return false;
+			}
+			addr += chunk;
+			len -= chunk;
+		}
+	}
+	*count = n;
+	return (n > 0);
+}
+
+/**
+* Block layer glue - the device travels in the private pointer
+* Submit only makes the request available, the device is notified by
+* commit (or poll) once for the whole batch.
+*/
+static bool virtio_block_submit(block_dev_t *bdev, block_req_t *req){
+	virtio_dev_t *dev = (virtio_dev_t *)bdev->priv;
+	virtio_queue_t *q = virtio_queue(dev);
+	virtio_seg_t seg[VIRTIO_MAX_SEGS + 2];
+	virtio_slot_t *slot;
+	virtio_cmd_t *cmd;
+	block_sg_t bounce;
+	uint64 len = req->count * dev->sector_size;
+	uint16 flags = (req->op == BLOCK_OP_READ ? VIRTQ_DESC_F_WRITE : 0);
+	uint64 count;
+	uint64 off = 0;
+	uint64 i;
+	int64 id;
+	if (dev->failed){
+		block_complete(req, false);
+		return true;
+	}
+	// Requests complete out of order - a barrier drains the queue on both sides
+	if (q->barrier > 0 || ((req->flags & BLOCK_REQ_BARRIER) != 0 && q->in_flight > 0)){
+		return false;
+	}
+	id = virtio_cmd_alloc(q);
+	if (id < 0){
+		return false;
+	}
+	cmd = &q->cmd[id];
+	slot = &q->slot[id];
+	if (!virtio_build_segs(dev, req->sg, req->sg_count, flags, &seg[1], &count)){
+		// Too scattered - copy through a contiguous buffer
+		cmd->bounce = dma_alloc(len, PAGE_SIZE, DMA_ZONE_ANY);
+		if (cmd->bounce == 0){
+			virtio_cmd_free(q, id);
+			block_complete(req, false);
+			return true;
+		}
+		cmd->bounce_len = len;
+		if (req->op == BLOCK_OP_WRITE){
+			for (i = 0; i < req->sg_count; i ++){
+				mem_copy((uint8 *)(cmd->bounce + off), req->sg[i].len, (uint8 *)req->sg[i].addr);
+				off += req->sg[i].len;
+			}
+		}
+		bounce.addr = cmd->bounce;
+		bounce.len = len;
+		q->bounce_count ++;
+		if (!virtio_build_segs(dev, &bounce, 1, flags, &seg[1], &count)){
+			dma_free(cmd->bounce, cmd->bounce_len);
+			virtio_cmd_free(q, id);
+			block_complete(req, false);
+			return true;
+		}
+	}
+	slot->hdr.type = (req->op == BLOCK_OP_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN);
+	slot->hdr.sector = req->lba * (dev->sector_size / VIRTIO_SECTOR_SIZE);
+	seg[0].addr = (uint64)&slot->hdr;
+	seg[0].len = sizeof(virtio_blk_hdr_t);
+	seg[0].flags = 0;
+	seg[count + 1].addr = (uint64)&slot->status;
+	seg[count + 1].len = 1;
+	seg[count + 1].flags = VIRTQ_DESC_F_WRITE;
+	cmd->req = req;
+	// Devices without a volatile cache write through anyway
+	cmd->fua = (req->op == BLOCK_OP_WRITE && (req->flags & BLOCK_REQ_FUA) != 0 && virtio_has(dev, VIRTIO_BLK_F_FLUSH));
+	if (!virtio_add(q, id, seg, count + 2)){
+		if (cmd->bounce != 0){
+			dma_free(cmd->bounce, cmd->bounce_len);
+		}
+		virtio_cmd_free(q, id);
+		return false;
+	}
+	if ((req->flags & BLOCK_REQ_BARRIER) != 0){
+		q->barrier ++;
+	}
+	return true;
+}
+static void virtio_block_commit(block_dev_t *bdev){
+	virtio_kick(virtio_queue((virtio_dev_t *)bdev->priv));
+}
+static void virtio_block_poll(block_dev_t *bdev, bool wait){
+	virtio_poll(virtio_queue((virtio_dev_t *)bdev->priv), wait);
+}
+static bool virtio_block_flush(block_dev_t *bdev){
+	virtio_dev_t *dev = (virtio_dev_t *)bdev->priv;
+	virtio_queue_t *q = virtio_queue(dev);
+	virtio_seg_t seg[2];
+	int64 id;
+	// Writes go straight to the media without a volatile cache
+	if (!virtio_has(dev, VIRTIO_BLK_F_FLUSH)){
+		return !dev->failed;
+	}
+	id = virtio_cmd_wait(q);
+	if (id < 0){
+		return false;
+	}
+	q->slot[id].hdr.type = VIRTIO_BLK_T_FLUSH;
+	q->slot[id].hdr.sector = 0;
+	seg[0].addr = (uint64)&q->slot[id].hdr;
+	seg[0].len = sizeof(virtio_blk_hdr_t);
+	seg[0].flags = 0;
+	seg[1].addr = (uint64)&q->slot[id].status;
+	seg[1].len = 1;
+	seg[1].flags = VIRTQ_DESC_F_WRITE;
+	return virtio_exec(q, id, seg, 2);
+}
+static bool virtio_block_discard(block_dev_t *bdev, uint64 lba, uint64 count){
+	virtio_dev_t *dev = (virtio_dev_t *)bdev->priv;
+	virtio_queue_t *q = virtio_queue(dev);
+	uint64 scale = dev->sector_size / VIRTIO_SECTOR_SIZE;
+	virtio_seg_t seg[3];
+	uint64 sector = lba * scale;
+	uint64 left = count * scale;
+	uint64 n;
+	uint64 r;
+	int64 id;
+	if (!virtio_has(dev, VIRTIO_BLK_F_DISCARD)){
+		return false;
+	}
+	while (left > 0){
+		id = virtio_cmd_wait(q);
+		if (id < 0){
+			return false;
+		}
+		for (r = 0; r < dev->discard_seg && left > 0; r ++){
+			n = (left > dev->discard_max ? dev->discard_max : left);
+			dev->buf[r].sector = sector;
+			dev->buf[r].num_sectors = (uint32)n;
+			dev->buf[r].flags = 0;
+			sector += n;
+			left -= n;
+		}
+		q->slot[id].hdr.type = VIRTIO_BLK_T_DISCARD;
+		q->slot[id].hdr.sector = 0;
+		seg[0].addr = (uint64)&q->slot[id].hdr;
+		seg[0].len = sizeof(virtio_blk_hdr_t);
+		seg[0].flags = 0;
+		seg[1].addr = (uint64)dev->buf;
+		seg[1].len = r * sizeof(virtio_blk_discard_t);
+		seg[1].flags = 0;
+		seg[2].addr = (uint64)&q->slot[id].status;
+		seg[2].len = 1;
+		seg[2].flags = VIRTQ_DESC_F_WRITE;
+		if (!virtio_exec(q, id, seg, 3)){
+			return false;
+		}
+	}
+	return true;
+}
+
+static block_ops_t _virtio_block_ops = {
+	.submit = virtio_block_submit,
+	.commit = virtio_block_commit,
+	.poll = virtio_block_poll,
+	.flush = virtio_block_flush,
+	.discard = virtio_block_discard
+};
+
+/**
+* Interrupt handler - requests are reaped by whoever waits for them
+*/
+static void virtio_irq(uint8 irq){
+	virtio_dev_t *dev;
+	uint64 i;
+	uint64 q;
+	for (i = 0; i < _virtio_dev_count; i ++){
+		dev = _virtio_dev[i];
+		if (dev->irq == irq){
+			// Reading the ISR status deasserts the line
+			if ((*dev->isr & 0x1) != 0){
+				virtio_queue(dev)->irq_count ++;
+			}
+		}
+		for (q = 0; q < dev->queue_count; q ++){
+			if (dev->queue[q].irq == irq){
+				dev->queue[q].irq_count ++;
+			}
+		}
+	}
+}
+/**
+* Map a structure described by a virtio vendor capability
+* @param addr - PCI address
+* @param cap - capability offset
+* @param [out] length - structure length (optional)
+* @return structure address or 0 if the BAR is not a memory BAR
+*/
+static uint64 virtio_map_cap(pci_addr_t addr, uint8 cap, uint32 *length){
+	uint64 base;
+	uint64 page;
+	uint32 len;
+	addr.s.reg = (cap >> 2) + 1;
+	base = pci_get_bar(addr, (uint8)(pci_read(addr) & 0xFF));
+	if (base == 0){
+		return 0;
+	}
+	addr.s.reg = (cap >> 2) + 2;
+	base += pci_read(addr);
+	addr.s.reg = (cap >> 2) + 3;
+	len = pci_read(addr);
+	for (page = (base & PAGE_MASK); page < base + len; page += PAGE_SIZE){
+		page_map_mmio(page);
+	}
+	if (length != null){
+		*length = len;
+	}
+	return base;
+}
+/**
+* Locate the configuration structures of a modern device
+* @param dev - device (PCI address set)
+* @return false if any of the required structures is missing
+*/
+static bool virtio_find_caps(virtio_dev_t *dev){
+	pci_addr_t addr = dev->pci;
+	uint8 cap = pci_find_capability(addr, PCI_CAP_VENDOR);
+	uint8 type;
+	while (cap != 0){
+		addr.s.reg = (cap >> 2);
+		type = (uint8)(pci_read(addr) >> 24);
+		// The first structure of each type is the preferred one
+		switch (type){
+			case VIRTIO_PCI_CAP_COMMON:
+				if (dev->common == null){
+					dev->common = (virtio_common_t *)virtio_map_cap(addr, cap, null);
+				}
+				break;
+			case VIRTIO_PCI_CAP_NOTIFY:
+				if (dev->notify_base == 0){
+					dev->notify_base = virtio_map_cap(addr, cap, null);
+					addr.s.reg = (cap >> 2) + 4;
+					dev->notify_mul = pci_read(addr);
+				}
+				break;
+			case VIRTIO_PCI_CAP_ISR:
+				if (dev->isr == null){
+					dev->isr = (uint8 volatile *)virtio_map_cap(addr, cap, null);
+				}
+				break;
+			case VIRTIO_PCI_CAP_DEVICE:
+				if (dev->config == null){
+					dev->config = (virtio_blk_config_t *)virtio_map_cap(addr, cap, null);
+				}
+				break;
+		}
+		cap = pci_next_capability(addr, cap, PCI_CAP_VENDOR);
+	}
+	return (dev->common != null && dev->notify_base != 0 && dev->isr != null && dev->config != null);
+}
+/**
+* Reset the device and agree on features
+* @param dev - device
+* @return false if the device doesn't take the features
+*/
+static bool virtio_negotiate(virtio_dev_t *dev){
+	virtio_common_t *common = dev->common;
+	uint64 start = timer_ticks();
+	uint64 offered;
+	uint64 wanted = ((uint64)1 << VIRTIO_F_VERSION_1) | ((uint64)1 << VIRTIO_F_INDIRECT_DESC) | ((uint64)1 << VIRTIO_F_EVENT_IDX)
+		| ((uint64)1 << VIRTIO_BLK_F_SIZE_MAX) | ((uint64)1 << VIRTIO_BLK_F_SEG_MAX) | ((uint64)1 << VIRTIO_BLK_F_BLK_SIZE)
+		| ((uint64)1 << VIRTIO_BLK_F_FLUSH) | ((uint64)1 << VIRTIO_BLK_F_TOPOLOGY) | ((uint64)1 << VIRTIO_BLK_F_MQ)
+		| ((uint64)1 << VIRTIO_BLK_F_DISCARD);
+	if (VIRTIO_PACKED){
+		wanted |= ((uint64)1 << VIRTIO_F_RING_PACKED);
+	}
+	common->device_status = 0;
+	while (common->device_status != 0){
+		if (timer_ticks() - start > timer_us_to_ticks(VIRTIO_RESET_TIMEOUT_US)){
+			return false;
+		}
+		asm volatile ("pause");
+	}
+	common->device_status = VIRTIO_STATUS_ACK;
+	common->device_status = VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER;
+	common->device_feature_select = 0;
+	offered = common->device_feature;
+	common->device_feature_select = 1;
+	offered |= ((uint64)common->device_feature << 32);
+	dev->features = (offered & wanted);
+	if (!virtio_has(dev, VIRTIO_F_VERSION_1)){
+		return false;
+	}
+	common->driver_feature_select = 0;
+	common->driver_feature = (uint32)dev->features;
+	common->driver_feature_select = 1;
+	common->driver_feature = (uint32)(dev->features >> 32);
+	common->device_status = VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK;
+	return ((common->device_status & VIRTIO_STATUS_FEATURES_OK) != 0);
+}
+/**
+* Allocate and register a virtqueue
+* @param dev - device (features negotiated)
+* @param q - virtqueue
+* @param index - queue index
+* @param vector - MSI-X vector (VIRTIO_NO_VECTOR for none)
+* @return false on failure
+*/
+static bool virtio_queue_init(virtio_dev_t *dev, virtio_queue_t *q, uint16 index, uint16 vector){
+	virtio_common_t *common = dev->common;
+	uint64 ring_desc;
+	uint64 ring_driver;
+	uint64 ring_device;
+	uint16 size;
+	uint16 i;
+	uint8 irq = q->irq;
+	mem_fill((uint8 *)q, sizeof(virtio_queue_t), 0);
+	q->dev = dev;
+	q->index = index;
+	q->irq = irq;
+	q->packed = virtio_has(dev, VIRTIO_F_RING_PACKED);
+	common->queue_select = index;
+	size = common->queue_size;
+	if (size == 0){
+		return false;
+	}
+	// Split rings have to be a power of 2
+	q->size = 1;
+	while (q->size * 2 <= size && q->size * 2 <= VIRTIO_QUEUE_SIZE){
+		q->size *= 2;
+	}
+	q->num_free = q->size;
+	q->slot = (virtio_slot_t *)dma_alloc(sizeof(virtio_slot_t) * q->size, PAGE_SIZE, DMA_ZONE_ANY);
+	if (q->packed){
+		q->pdesc = (virtq_pdesc_t *)dma_alloc(sizeof(virtq_pdesc_t) * q->size, PAGE_SIZE, DMA_ZONE_ANY);
+		q->driver_event = (virtq_event_t *)dma_alloc(sizeof(virtq_event_t), DMA_UNIT, DMA_ZONE_ANY);
+		q->device_event = (virtq_event_t *)dma_alloc(sizeof(virtq_event_t), DMA_UNIT, DMA_ZONE_ANY);
+		if (q->slot == null || q->pdesc == null || q->driver_event == null || q->device_event == null){
+			return false;
+		}
+		q->avail_wrap = true;
+		q->used_wrap = true;
+		q->driver_event->flags = VIRTQ_EVENT_DISABLE;
+		ring_desc = (uint64)q->pdesc;
+		ring_driver = (uint64)q->driver_event;
+		ring_device = (uint64)q->device_event;
+	} else {
+		q->desc = (virtq_desc_t *)dma_alloc(sizeof(virtq_desc_t) * q->size, PAGE_SIZE, DMA_ZONE_ANY);
+		q->avail = (virtq_avail_t *)dma_alloc(sizeof(uint16) * (3 + q->size), PAGE_SIZE, DMA_ZONE_ANY);
+		q->used = (virtq_used_t *)dma_alloc(sizeof(uint16) * 3 + sizeof(uint32) * 2 * q->size, PAGE_SIZE, DMA_ZONE_ANY);
+		if (q->slot == null || q->desc == null || q->avail == null || q->used == null){
+			return false;
+		}
+		for (i = 0; i < q->size; i ++){
+			q->desc[i].next = (i + 1 < q->size ? i + 1 : 0);
+		}
+		q->free_head = 0;
+		// Interrupts only when somebody sleeps
+		if (virtio_has(dev, VIRTIO_F_EVENT_IDX)){
+			q->avail->ring[q->size] = 0xFFFF;
+		} else {
+			q->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+		}
+		ring_desc = (uint64)q->desc;
+		ring_driver = (uint64)q->avail;
+		ring_device = (uint64)q->used;
+	}
+	common->queue_size = q->size;
+	common->queue_desc_lo = (uint32)ring_desc;
+	common->queue_desc_hi = (uint32)(ring_desc >> 32);
+	common->queue_driver_lo = (uint32)ring_driver;
+	common->queue_driver_hi = (uint32)(ring_driver >> 32);
+	common->queue_device_lo = (uint32)ring_device;
+	common->queue_device_hi = (uint32)(ring_device >> 32);
+	if (vector != VIRTIO_NO_VECTOR){
+		common->queue_msix_vector = vector;
+		// Device refuses vectors it can't use
+		if (common->queue_msix_vector != vector){
+			q->irq = 0xFF;
+		}
+	}
+	q->notify = (uint16 volatile *)(dev->notify_base + (uint64)common->queue_notify_off * dev->notify_mul);
+	common->queue_enable = 1;
+	return true;
+}
+/**
+* Route queue interrupts - one MSI-X vector per queue, or the INTx
+* line shared by all of them, or none (queues are polled)
+* @param dev - device
+* @param pci - PCI configuration
+*/
+static void virtio_init_irq(virtio_dev_t *dev, pci_device_t *pci){
+	uint16 vectors = pci_msix_count(dev->pci);
+	uint64 msg_addr;
+	uint32 msg_data;
+	uint64 i;
+	dev->irq = 0xFF;
+	dev->msix = false;
+	for (i = 0; i < VIRTIO_MAX_QUEUES; i ++){
+		dev->queue[i].irq = 0xFF;
+	}
+	if (vectors > 0){
+		for (i = 0; i < dev->queue_count && i < vectors; i ++){
+			dev->queue[i].irq = irq_alloc_msi(virtio_irq, &msg_addr, &msg_data);
+			if (dev->queue[i].irq == 0xFF){
+				break;
+			}
+			pci_msix_set(dev->pci, i, msg_addr, msg_data);
+			dev->msix = true;
+		}
+		if (dev->msix){
+			pci_msix_enable(dev->pci);
+			dev->common->msix_config = VIRTIO_NO_VECTOR;
+			return;
+		}
+	}
+	if (pci->int_line < 16 && irq_register(pci->int_line, virtio_irq)){
+		dev->irq = pci->int_line;
+	}
+}
+/**
+* Bring up a device
+* @param dev - device (PCI address set)
+* @param pci - PCI configuration
+* @return false on failure
+*/
+static bool virtio_init_dev(virtio_dev_t *dev, pci_device_t *pci){
+	virtio_blk_config_t *config;
+	char name[BLOCK_NAME_LEN];
+	block_dev_t *bdev;
+	uint64 count;
+	uint64 capacity;
+	uint8 generation;
+	uint64 i;
+	if (!virtio_find_caps(dev) || !virtio_negotiate(dev)){
+		return false;
+	}
+	config = dev->config;
+	// Multi-field reads are consistent only within one configuration generation
+	do {
+		generation = dev->common->config_generation;
+		capacity = config->capacity;
+	} while (generation != dev->common->config_generation);
+	dev->sector_size = VIRTIO_SECTOR_SIZE;
+	if (virtio_has(dev, VIRTIO_BLK_F_BLK_SIZE) && config->blk_size >= VIRTIO_SECTOR_SIZE && config->blk_size <= PAGE_SIZE){
+		dev->sector_size = config->blk_size;
+	}
+	dev->sectors = capacity / (dev->sector_size / VIRTIO_SECTOR_SIZE);
+	dev->seg_max = VIRTIO_MAX_SEGS;
+	if (virtio_has(dev, VIRTIO_BLK_F_SEG_MAX) && config->seg_max > 0 && config->seg_max < dev->seg_max){
+		dev->seg_max = config->seg_max;
+	}
+	dev->size_max = VIRTIO_MAX_BYTES;
+	if (virtio_has(dev, VIRTIO_BLK_F_SIZE_MAX) && config->size_max >= PAGE_SIZE && config->size_max < dev->size_max){
+		dev->size_max = config->size_max;
+	}
+	dev->discard_seg = 1;
+	dev->discard_max = VIRTIO_DISCARD_MAX;
+	if (virtio_has(dev, VIRTIO_BLK_F_DISCARD)){
+		if (config->max_discard_seg > 1){
+			dev->discard_seg = (config->max_discard_seg < VIRTIO_DISCARD_RANGES ? config->max_discard_seg : VIRTIO_DISCARD_RANGES);
+		}
+		if (config->max_discard_sectors > 0){
+			dev->discard_max = config->max_discard_sectors;
+		}
+		dev->buf = (virtio_blk_discard_t *)dma_alloc(PAGE_SIZE, PAGE_SIZE, DMA_ZONE_ANY);
+		if (dev->buf == null){
+			dev->features &= ~((uint64)1 << VIRTIO_BLK_F_DISCARD);
+		}
+	}
+	// One queue per CPU
+	count = apic_num_cpu();
+	if (count == 0){
+		count = 1;
+	}
+	if (count > VIRTIO_MAX_QUEUES){
+		count = VIRTIO_MAX_QUEUES;
+	}
+	if (!virtio_has(dev, VIRTIO_BLK_F_MQ)){
+		count = 1;
+	} else if (config->num_queues < count){
+		count = (config->num_queues > 0 ? config->num_queues : 1);
+	}
+	dev->queue_count = count;
+	virtio_init_irq(dev, pci);
+	for (i = 0; i < dev->queue_count; i ++){
+		if (!virtio_queue_init(dev, &dev->queue[i], i, (dev->queue[i].irq != 0xFF ? i : VIRTIO_NO_VECTOR))){
+			break;
+		}
+		// Chains without indirect descriptors have to fit the ring
+		if (!virtio_has(dev, VIRTIO_F_INDIRECT_DESC) && dev->seg_max + 2 > dev->queue[i].size){
+			dev->seg_max = dev->queue[i].size - 2;
+		}
+	}
+	dev->queue_count = i;
+	if (dev->queue_count == 0 || dev->seg_max == 0){
+		dev->common->device_status = VIRTIO_STATUS_FAILED;
+		return false;
+	}
+	dev->common->device_status = VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK | VIRTIO_STATUS_DRIVER_OK;
+	mem_fill((uint8 *)name, BLOCK_NAME_LEN, 0);
+	str_write_f(name, BLOCK_NAME_LEN - 1, "vblk%u", dev->index);
+	// Each CPU submits to its own queue, so the depth is per queue
+	bdev = block_register(name, &_virtio_block_ops, dev->sector_size, dev->sectors, dev->queue[0].size, (void *)dev);
+	if (bdev == null){
+		return false;
+	}
+	if (virtio_has(dev, VIRTIO_BLK_F_TOPOLOGY) && config->physical_block_exp < 4){
+		bdev->phys_sector_size = (dev->sector_size << config->physical_block_exp);
+		bdev->align_offset = config->alignment_offset;
+	}
+	// A contiguous bounce buffer has to fit the segment limits
+	bdev->max_sectors = dev->seg_max * dev->size_max;
+	if (bdev->max_sectors > VIRTIO_MAX_BYTES){
+		bdev->max_sectors = VIRTIO_MAX_BYTES;
+	}
+	bdev->max_sectors /= dev->sector_size;
+	return true;
+}
+
+bool virtio_init(){
+	pci_device_t pci;
+	pci_addr_t addr;
+	virtio_dev_t *dev;
+	uint16 ids[2] = {VIRTIO_BLK_ID_MODERN, VIRTIO_BLK_ID_LEGACY};
+	uint8 dev_count;
+	uint8 i;
+	uint8 t;
+	bool found = false;
+	for (t = 0; t < 2; t ++){
+		dev_count = pci_num_device_id(VIRTIO_VENDOR_ID, ids[t]);
+		for (i = 0; i < dev_count && _virtio_dev_count < VIRTIO_MAX_DEV; i ++){
+			addr = pci_get_device_id(VIRTIO_VENDOR_ID, ids[t], i);
+			if (addr.raw == 0){
+				continue;
+			}
+			pci_get_config(&pci, addr);
+			pci_enable_device(addr);
+			dev = (virtio_dev_t *)kmalloc(sizeof(virtio_dev_t));
+			if (dev == null){
+				return found;
+			}
+			mem_fill((uint8 *)dev, sizeof(virtio_dev_t), 0);
+			_virtio_dev[_virtio_dev_count] = dev;
+			dev->index = _virtio_dev_count;
+			dev->pci = addr;
+			dev->irq = 0xFF;
+#if DEBUG == 1
+			debug_print(DC_WB, "virtio-blk at %u:%u", (uint64)addr.s.bus, (uint64)addr.s.device);
+#endif
+			_virtio_dev_count ++;
+			if (virtio_init_dev(dev, &pci)){
+				found = true;
+			} else {
+				dev->failed = true;
+#if DEBUG == 1
+				// Transitional devices without the modern interface end up here too
+				debug_print(DC_WB, "     Initialization failed");
+#endif
+			}
+		}
+	}
+#if DEBUG == 1
+	if (_virtio_dev_count == 0){
+		debug_print(DC_WB, "virtio-blk device was not found");
+	}
+#endif
+	return found;
+}
+
+uint64 virtio_num_dev(){
+	return _virtio_dev_count;
+}
+
+#if DEBUG == 1
+void virtio_list(){
+	uint64 i;
+	uint64 q;
+	virtio_dev_t *dev;
+	virtio_queue_t *queue;
+	for (i = 0; i < _virtio_dev_count; i ++){
+		dev = _virtio_dev[i];
+		debug_print(DC_WB, "vblk%u: %uMB, sector:%u, queues:%u, %s, %s%s%s, segs:%u%s",
+			i, (dev->sectors * dev->sector_size) / 1024 / 1024, dev->sector_size, dev->queue_count,
+			(virtio_has(dev, VIRTIO_F_RING_PACKED) ? "packed" : "split"), (dev->msix ? "MSI-X" : (dev->irq != 0xFF ? "INTx" : "polled")),
+			(virtio_has(dev, VIRTIO_F_INDIRECT_DESC) ? ", indirect" : ""), (virtio_has(dev, VIRTIO_F_EVENT_IDX) ? ", event idx" : ""),
+			dev->seg_max, (dev->failed ? ", failed" : ""));
+		for (q = 0; q < dev->queue_count; q ++){
+			queue = &dev->queue[q];
+			debug_print(DC_WB, "     q%u: size:%u, reqs:%u, notify:%u, skipped:%u, irqs:%u, bounced:%u, fua:%u",
+				(uint64)queue->index, (uint64)queue->size, queue->req_count, queue->notify_count, queue->notify_skipped,
+				queue->irq_count, queue->bounce_count, queue->fua_flushes);
+		}
+	}
+}
+#endif